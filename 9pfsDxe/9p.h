@@ -17,6 +17,7 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #define P9_NOFID    (UINT32)(~0)
 #define P9_MAX_PATH (UINT16)(4096)
 #define P9_MAX_FLEN (UINT16)(255)
+#define P9_MAX_WELEM (UINT16)(16)
 
 #define QID_SIZE    (UINTN)(13)
 
@@ -167,6 +168,29 @@ typedef struct _P9RRead {
   UINT8           Data[0];
 } P9RRead;
 
+typedef struct _P9TWrite {
+  P9Header        Header;
+  UINT32          Fid;
+  UINT64          Offset;
+  UINT32          Count;
+  UINT8           Data[0];
+} P9TWrite;
+
+typedef struct _P9RWrite {
+  P9Header        Header;
+  UINT32          Count;
+} P9RWrite;
+
+typedef struct _P9TFsync {
+  P9Header        Header;
+  UINT32          Fid;
+  UINT32          DataSync;
+} P9TFsync;
+
+typedef struct _P9RFsync {
+  P9Header        Header;
+} P9RFsync;
+
 typedef struct _P9TReadDir {
   P9Header        Header;
   UINT32          Fid;
@@ -190,6 +214,15 @@ typedef struct _P9RReadLink {
   P9String        Target;
 } P9RReadLink;
 
+typedef struct _P9TFlush {
+  P9Header        Header;
+  UINT16          OldTag;
+} P9TFlush;
+
+typedef struct _P9RFlush {
+  P9Header        Header;
+} P9RFlush;
+
 typedef struct _P9TWalk {
   P9Header        Header;
   UINT32          Fid;
@@ -227,14 +260,20 @@ enum {
   Rgetattr,
   Treaddir  = 40,
   Rreaddir,
+  Tfsync    = 50,
+  Rfsync,
   Tversion  = 100,
   Rversion,
   Tattach   = 104,
   Rattach,
+  Tflush    = 108,
+  Rflush,
   Twalk     = 110,
   Rwalk,
   Tread     = 116,
   Rread,
+  Twrite    = 118,
+  Rwrite,
   Tclunk    = 120,
   Rclunk,
 };
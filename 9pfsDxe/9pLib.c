@@ -10,6 +10,8 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 UINT32 mFid = 1;
 
+volatile UINT64 mTick = 0;
+
 UINT32
 GetFid (
   VOID
@@ -18,195 +20,860 @@ GetFid (
   return mFid++;
 }
 
+/**
+
+  Advances the millisecond tick used to time round trips and deadlines.
+  Notifications held back while the TPL is raised are lost, so the tick
+  runs slow rather than fast and deadlines err on the late side.
+
+  @param  Event                 - The tick timer event.
+  @param  Context               - Not used.
+
+**/
+VOID
+EFIAPI
+P9TickNotify (
+  IN EFI_EVENT          Event,
+  IN VOID               *Context
+  )
+{
+  mTick++;
+}
+
+UINT64
+P9GetTick (
+  VOID
+  )
+{
+  return mTick;
+}
+
+/**
+
+  Transmits a message described by a fragment table without copying it.
+
+  The transmit descriptor is not allocated here: TransmitToken->Packet.TxData
+  must already point to a descriptor with room for FragmentCount fragments.
+  The fragment table is copied into it, but the fragment buffers are
+  referenced in place and must stay valid until the transmit token is
+  signaled.
+
+  @param  Tcp4                  - TCP4 instance to transmit on.
+  @param  TransmitToken         - Token to be signaled on completion.
+  @param  Fragments             - Fragments making up the message.
+  @param  FragmentCount         - Number of entries in Fragments.
+
+  @retval EFI_SUCCESS           - The message is queued for transmission.
+  @retval EFI_INVALID_PARAMETER - No descriptor or no fragment was given.
+  @return Others                - The status of Transmit().
+
+**/
 EFI_STATUS
-TransmitTcp4 (
-  IN EFI_TCP4_PROTOCOL  *Tcp4,
-  IN EFI_TCP4_IO_TOKEN  *TransmitToken,
-  IN VOID               *Data,
-  IN UINTN              DataSize
+TransmitTcp4Fragments (
+  IN EFI_TCP4_PROTOCOL      *Tcp4,
+  IN EFI_TCP4_IO_TOKEN      *TransmitToken,
+  IN EFI_TCP4_FRAGMENT_DATA *Fragments,
+  IN UINT32                 FragmentCount
   )
 {
-  EFI_STATUS                    Status;
   UINTN                         Index;
-  UINT32                        FragmentCount;
-  UINTN                         TransmitDataSize;
+  UINT32                        DataLength;
   EFI_TCP4_TRANSMIT_DATA        *TransmitData;
-  EFI_TCP4_FRAGMENT_DATA        *FragmentTable;
 
-  FragmentCount = DataSize / FRAGMENT_SIZE + (DataSize % FRAGMENT_SIZE ? 1 : 0);
-  TransmitDataSize = sizeof (EFI_TCP4_TRANSMIT_DATA) + sizeof (EFI_TCP4_FRAGMENT_DATA) * (FragmentCount - 1);
-  TransmitData = AllocateZeroPool (TransmitDataSize);
-  if (TransmitData == NULL) {
-    return EFI_OUT_OF_RESOURCES;
+  TransmitData = TransmitToken->Packet.TxData;
+  if (TransmitData == NULL || Fragments == NULL || FragmentCount == 0) {
+    return EFI_INVALID_PARAMETER;
   }
 
-  FragmentTable = TransmitData->FragmentTable;
+  DataLength = 0;
   for (Index = 0; Index < FragmentCount; Index++) {
-    FragmentTable[Index].FragmentLength =
-      (Index < FragmentCount - 1) ? FRAGMENT_SIZE : (DataSize % FRAGMENT_SIZE);
-    FragmentTable[Index].FragmentBuffer = (UINT8 *)Data + FRAGMENT_SIZE * Index;
+    DataLength += Fragments[Index].FragmentLength;
   }
+  CopyMem (TransmitData->FragmentTable, Fragments, sizeof (EFI_TCP4_FRAGMENT_DATA) * FragmentCount);
 
-  TransmitData->Push = FALSE;
+  TransmitData->Push = TRUE;
   TransmitData->Urgent = FALSE;
-  TransmitData->DataLength = DataSize;
+  TransmitData->DataLength = DataLength;
   TransmitData->FragmentCount = FragmentCount;
-  TransmitToken->Packet.TxData = TransmitData;
-
-  Status = Tcp4->Transmit (Tcp4, TransmitToken);
-  if (EFI_ERROR (Status)) {
-    return Status;
-  }
 
-  return EFI_SUCCESS;
+  return Tcp4->Transmit (Tcp4, TransmitToken);
 }
 
+/**
+
+  Posts a receive of up to DataSize bytes into one contiguous fragment.
+
+  The receive descriptor is not allocated here: ReceiveToken->Packet.RxData
+  must already point to a descriptor with room for one fragment, which is
+  reused across receives.
+
+  @param  Tcp4                  - TCP4 instance to receive on.
+  @param  ReceiveToken          - Token to be signaled on completion.
+  @param  Data                  - Buffer receiving the data.
+  @param  DataSize              - Size of Data.
+
+  @retval EFI_SUCCESS           - The receive is posted.
+  @retval EFI_INVALID_PARAMETER - No descriptor or an empty buffer was given.
+  @return Others                - The status of Receive().
+
+**/
 EFI_STATUS
 ReceiveTcp4 (
   IN EFI_TCP4_PROTOCOL  *Tcp4,
   IN EFI_TCP4_IO_TOKEN  *ReceiveToken,
   OUT VOID              *Data,
-  OUT UINTN             DataSize
+  IN UINTN              DataSize
   )
 {
-  EFI_STATUS                    Status;
-  UINTN                         Index;
-  UINT32                        FragmentCount;
-  UINTN                         ReceiveDataSize;
   EFI_TCP4_RECEIVE_DATA         *ReceiveData;
-  EFI_TCP4_FRAGMENT_DATA        *FragmentTable;
 
-  FragmentCount = DataSize / FRAGMENT_SIZE + (DataSize % FRAGMENT_SIZE ? 1 : 0);
-  ReceiveDataSize = sizeof (EFI_TCP4_RECEIVE_DATA) + sizeof (EFI_TCP4_FRAGMENT_DATA) * (FragmentCount - 1);
-  ReceiveData = AllocateZeroPool (ReceiveDataSize);
-  if (ReceiveData == NULL) {
-    return EFI_OUT_OF_RESOURCES;
+  ReceiveData = ReceiveToken->Packet.RxData;
+  if (ReceiveData == NULL || DataSize == 0 || DataSize > MAX_UINT32) {
+    return EFI_INVALID_PARAMETER;
   }
 
-  FragmentTable = ReceiveData->FragmentTable;
-  for (Index = 0; Index < FragmentCount; Index++) {
-    FragmentTable[Index].FragmentLength =
-      (Index < FragmentCount - 1) ? FRAGMENT_SIZE : (DataSize % FRAGMENT_SIZE);
-    FragmentTable[Index].FragmentBuffer = (UINT8 *)Data + FRAGMENT_SIZE * Index;
+  ReceiveData->UrgentFlag                      = FALSE;
+  ReceiveData->DataLength                      = (UINT32)DataSize;
+  ReceiveData->FragmentCount                   = 1;
+  ReceiveData->FragmentTable[0].FragmentLength = (UINT32)DataSize;
+  ReceiveData->FragmentTable[0].FragmentBuffer = Data;
+
+  return Tcp4->Receive (Tcp4, ReceiveToken);
+}
+
+UINT16
+P9GetTag (
+  IN P9_VOLUME          *Volume
+  )
+{
+  LIST_ENTRY  *Entry;
+  P9_REQUEST  *Request;
+  UINT16      Tag;
+  BOOLEAN     InUse;
+
+  do {
+    Tag = Volume->NextTag++;
+    InUse = (Tag == P9_NOTAG || Tag == Volume->Tag);
+    BASE_LIST_FOR_EACH (Entry, &Volume->Requests) {
+      Request = BASE_CR (Entry, P9_REQUEST, Link);
+      if (Request->Tag == Tag) {
+        InUse = TRUE;
+        break;
+      }
+    }
+  } while (InUse);
+
+  return Tag;
+}
+
+/**
+
+  Waits for the posted receive on the volume to complete.
+
+  With Wait the receive is given P9_REQUEST_TIMEOUT ticks. A stream that
+  stalls inside a message can not be resynchronized, so the connection is
+  then dropped.
+
+  @param  Volume                - The 9P volume.
+  @param  Wait                  - Whether to block until the data arrives.
+  @param  Length                - Number of bytes received.
+
+  @retval EFI_SUCCESS           - The receive completed.
+  @retval EFI_NOT_READY         - Wait is FALSE and no data has arrived yet.
+  @retval EFI_TIMEOUT           - No data arrived in time; the connection is
+                                  dropped.
+  @return Others                - The receive failed.
+
+**/
+EFI_STATUS
+P9WaitReceive (
+  IN P9_VOLUME          *Volume,
+  IN BOOLEAN            Wait,
+  OUT UINTN             *Length
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_TCP4_PROTOCOL             *Tcp4;
+  UINT64                        Deadline;
+
+  Tcp4 = Volume->Tcp4;
+  Deadline = P9GetTick () + P9_REQUEST_TIMEOUT;
+  for (;;) {
+    Tcp4->Poll (Tcp4);
+    if (!EFI_ERROR (gBS->CheckEvent (Volume->RxIoToken.CompletionToken.Event))) {
+      break;
+    }
+    if (!Wait) {
+      return EFI_NOT_READY;
+    }
+    if (P9GetTick () >= Deadline) {
+      P9ResetConnection (Volume);
+      return EFI_TIMEOUT;
+    }
   }
 
-  ReceiveData->UrgentFlag = FALSE;
-  ReceiveData->DataLength = (UINT32)DataSize;
-  ReceiveData->FragmentCount = FragmentCount;
-  ReceiveToken->Packet.RxData = ReceiveData;
+  Volume->IsRxPosted = FALSE;
+  Status = Volume->RxIoToken.CompletionToken.Status;
+  *Length = EFI_ERROR (Status) ? 0 : Volume->RxData.DataLength;
 
-  Status = Tcp4->Receive (Tcp4, ReceiveToken);
-  if (EFI_ERROR (Status)) {
-    return Status;
+  return Status;
+}
+
+/**
+
+  Receives exactly DataSize bytes, leaving any following data in the socket.
+  A NULL Data discards DataSize bytes.
+
+**/
+EFI_STATUS
+P9ReceiveExact (
+  IN P9_VOLUME          *Volume,
+  OUT VOID              *Data OPTIONAL,
+  IN UINTN              DataSize
+  )
+{
+  EFI_STATUS                    Status;
+  UINT8                         Scratch[256];
+  UINTN                         Size;
+  UINTN                         Length;
+
+  while (DataSize > 0) {
+    Size = (Data == NULL) ? MIN (DataSize, sizeof (Scratch)) : DataSize;
+    Status = ReceiveTcp4 (
+      Volume->Tcp4,
+      &Volume->RxIoToken,
+      (Data == NULL) ? Scratch : Data,
+      Size
+      );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+    Volume->IsRxPosted = TRUE;
+
+    Status = P9WaitReceive (Volume, TRUE, &Length);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    DataSize -= Length;
+    if (Data != NULL) {
+      Data = (UINT8 *)Data + Length;
+    }
   }
 
   return EFI_SUCCESS;
 }
 
+/**
+
+  Takes an object of Size bytes from the request slab of a volume, starting
+  with a P9_REQUEST. Only the request is zeroed; the rest of the object,
+  which holds the messages, is left to the caller to fill in.
+
+  @param  Volume                - The 9P volume.
+  @param  Size                  - Size of the object, at most
+                                  P9_REQUEST_OBJECT_SIZE.
+
+  @return The request, or NULL if it could not be allocated.
+
+**/
+P9_REQUEST *
+P9AllocateRequest (
+  IN P9_VOLUME          *Volume,
+  IN UINTN              Size
+  )
+{
+  P9_REQUEST                    *Request;
+
+  ASSERT (Size >= sizeof (P9_REQUEST) && Size <= P9_REQUEST_OBJECT_SIZE);
+
+  Request = P9AllocateObject (&Volume->RequestSlab);
+  if (Request != NULL) {
+    ZeroMem (Request, sizeof (P9_REQUEST));
+  }
+
+  return Request;
+}
+
+/**
+
+  Returns a request taken with P9AllocateRequest to its volume.
+
+**/
 VOID
-EFIAPI
-TxCallback (
-  IN EFI_EVENT  Event,
-  IN VOID       *Context
+P9FreeRequest (
+  IN P9_VOLUME          *Volume,
+  IN P9_REQUEST         *Request
   )
 {
-  P9_VOLUME *Volume;
+  P9FreeObject (&Volume->RequestSlab, Request);
+}
 
-  Volume = (P9_VOLUME *)Context;
-  Volume->IsTxDone = TRUE;
+/**
+
+  Reports a completed asynchronous request in its token, or to its Notify
+  function, and frees it.
+
+**/
+VOID
+P9SignalRequest (
+  IN P9_VOLUME          *Volume,
+  IN P9_REQUEST         *Request
+  )
+{
+  EFI_STATUS                    Status;
+
+  Status = Request->Status;
+  if (!EFI_ERROR (Status)) {
+    Status = P9CheckMessage (Request->Id, Request->RxData, Request->RxLength);
+  }
+
+  while (gBS->CheckEvent (Request->TxIoToken.CompletionToken.Event) == EFI_NOT_READY) {
+    Volume->Tcp4->Poll (Volume->Tcp4);
+  }
+  gBS->CloseEvent (Request->TxIoToken.CompletionToken.Event);
+
+  if (Request->Notify != NULL) {
+    Request->Notify (Volume, Request, Status);
+  } else {
+    Request->Token->Status = Status;
+    gBS->SignalEvent (Request->Token->Event);
+  }
+  P9FreeRequest (Volume, Request);
 }
 
+/**
+
+  Removes a request from the volume and completes it. Asynchronous requests
+  report the reply in their token and are freed.
+
+**/
 VOID
-EFIAPI
-RxCallback (
-  IN EFI_EVENT  Event,
-  IN VOID       *Context
+P9CompleteRequest (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_REQUEST     *Request,
+  IN EFI_STATUS         Status
   )
 {
-  P9_VOLUME *Volume;
+  RemoveEntryList (&Request->Link);
+  Request->Status = Status;
+  Request->IsDone = TRUE;
 
-  Volume = (P9_VOLUME *)Context;
-  Volume->IsRxDone = TRUE;
+  if (Request->Token != NULL) {
+    P9SignalRequest (Volume, Request);
+  }
 }
 
+/**
+
+  Receives one R-message and hands it to the request with the same tag.
+  Replies nobody is waiting for are discarded.
+
+  @param  Volume                - The 9P volume.
+  @param  Wait                  - Whether to block until a reply arrives.
+
+  @retval EFI_SUCCESS           - A reply was received and dispatched.
+  @retval EFI_NOT_READY         - Wait is FALSE and no reply has arrived yet.
+  @return Others                - The connection failed.
+
+**/
 EFI_STATUS
-DoP9 (
+P9Dispatch (
   IN P9_VOLUME          *Volume,
-  IN VOID               *TxData,
-  IN UINTN              TxDataSize,
-  IN OUT VOID           *RxData,
-  IN OUT UINTN          RxDataSize
+  IN BOOLEAN            Wait
   )
 {
   EFI_STATUS                    Status;
-  EFI_TCP4_PROTOCOL             *Tcp4;
-
-  if (Volume == NULL || TxData == NULL || RxData == NULL) {
-    return EFI_INVALID_PARAMETER;
-  }
+  LIST_ENTRY                    *Entry;
+  P9_REQUEST                    *Request;
+  P9Header                      Header;
+  UINTN                         Length;
+  UINTN                         PayloadLength;
 
-  Tcp4 = Volume->Tcp4;
+  while (Volume->RxHeaderLength < sizeof (P9Header)) {
+    if (!Volume->IsRxPosted) {
+      Status = ReceiveTcp4 (
+        Volume->Tcp4,
+        &Volume->RxIoToken,
+        (UINT8 *)&Volume->RxHeader + Volume->RxHeaderLength,
+        sizeof (P9Header) - Volume->RxHeaderLength
+        );
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+      Volume->IsRxPosted = TRUE;
+    }
 
-  if (Volume->TxIoToken.CompletionToken.Event == NULL) {
-    Status = gBS->CreateEvent (
-      EVT_NOTIFY_SIGNAL,
-      TPL_CALLBACK,
-      TxCallback,
-      Volume,
-      &Volume->TxIoToken.CompletionToken.Event
-      );
+    Status = P9WaitReceive (Volume, Wait, &Length);
     if (EFI_ERROR (Status)) {
-      goto Exit;
+      return Status;
     }
+    Volume->RxHeaderLength += Length;
   }
 
-  if (Volume->RxIoToken.CompletionToken.Event == NULL) {
-    Status = gBS->CreateEvent (
-      EVT_NOTIFY_SIGNAL,
-      TPL_CALLBACK,
-      RxCallback,
-      Volume,
-      &Volume->RxIoToken.CompletionToken.Event
-      );
-    if (EFI_ERROR (Status)) {
-      goto Exit;
+  CopyMem (&Header, &Volume->RxHeader, sizeof (P9Header));
+  Volume->RxHeaderLength = 0;
+  if (Header.Size < sizeof (P9Header)) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  Request = NULL;
+  BASE_LIST_FOR_EACH (Entry, &Volume->Requests) {
+    if (BASE_CR (Entry, P9_REQUEST, Link)->Tag == Header.Tag) {
+      Request = BASE_CR (Entry, P9_REQUEST, Link);
+      break;
     }
   }
 
-  Volume->IsTxDone = FALSE;
-  Status = TransmitTcp4 (
-    Tcp4,
-    &Volume->TxIoToken,
-    TxData,
-    TxDataSize
+  if (Request == NULL) {
+    DEBUG ((DEBUG_INFO, "%a:%d: Unexpected tag %d\n", __func__, __LINE__, Header.Tag));
+    return P9ReceiveExact (Volume, NULL, Header.Size - sizeof (P9Header));
+  }
+
+  Length = MIN (Request->RxDataSize, Header.Size);
+  CopyMem (Request->RxData, &Header, sizeof (P9Header));
+  Status = P9ReceiveExact (
+    Volume,
+    (UINT8 *)Request->RxData + sizeof (P9Header),
+    Length - sizeof (P9Header)
+    );
+
+  //
+  // The data of Rread and Rreaddir goes straight to where it is wanted.
+  //
+  if (!EFI_ERROR (Status) && Request->RxPayload != NULL) {
+    PayloadLength = MIN (Request->RxPayloadSize, Header.Size - Length);
+    Status = P9ReceiveExact (Volume, Request->RxPayload, PayloadLength);
+    Length += PayloadLength;
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = P9ReceiveExact (Volume, NULL, Header.Size - Length);
+  }
+
+  Request->RxLength = Length;
+  P9CompleteRequest (Volume, Request, Status);
+
+  return Status;
+}
+
+/**
+
+  Transmits a request and registers it for its reply. The request tag must
+  already be set and match the tag in the message.
+
+**/
+EFI_STATUS
+P9SendRequest (
+  IN P9_VOLUME              *Volume,
+  IN OUT P9_REQUEST         *Request,
+  IN EFI_TCP4_FRAGMENT_DATA *Fragments,
+  IN UINT32                 FragmentCount
+  )
+{
+  EFI_STATUS                    Status;
+  BOOLEAN                       IsBusy;
+
+  if (FragmentCount > P9_MAX_FRAGMENTS) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Request->Id       = ((P9Header *)Fragments[0].FragmentBuffer)->Id;
+  Request->IsDone   = FALSE;
+  Request->RxLength = 0;
+  Request->Status   = EFI_NOT_READY;
+  Request->Deadline = P9GetTick () + ((Request->Timeout != 0) ? Request->Timeout : P9_REQUEST_TIMEOUT);
+  Request->TxIoToken.Packet.TxData = &Request->TxData;
+  Volume->LastActivity = P9GetTick ();
+
+  Status = gBS->CreateEvent (0, 0, NULL, NULL, &Request->TxIoToken.CompletionToken.Event);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  IsBusy = Volume->IsBusy;
+  Volume->IsBusy = TRUE;
+
+  InsertTailList (&Volume->Requests, &Request->Link);
+  Status = TransmitTcp4Fragments (
+    Volume->Tcp4,
+    &Request->TxIoToken,
+    Fragments,
+    FragmentCount
     );
   if (EFI_ERROR (Status)) {
-    goto Exit;
+    RemoveEntryList (&Request->Link);
+    gBS->CloseEvent (Request->TxIoToken.CompletionToken.Event);
   }
 
-  while (Volume->IsTxDone != TRUE) {
-    Tcp4->Poll (Tcp4);
+  Volume->IsBusy = IsBusy;
+
+  return Status;
+}
+
+/**
+
+  Runs the reactor until the reply to Request has arrived or its deadline
+  has passed. The request is not completed on failure.
+
+**/
+EFI_STATUS
+P9RunRequest (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_REQUEST     *Request
+  )
+{
+  EFI_STATUS                    Status;
+
+  while (!Request->IsDone) {
+    Status = P9Dispatch (Volume, FALSE);
+    if (Status == EFI_NOT_READY) {
+      if (P9GetTick () >= Request->Deadline) {
+        return EFI_TIMEOUT;
+      }
+    } else if (EFI_ERROR (Status)) {
+      return Status;
+    }
   }
 
-  Volume->IsRxDone = FALSE;
-  Status = ReceiveTcp4 (
-    Tcp4,
-    &Volume->RxIoToken,
-    RxData,
-    RxDataSize
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Waits for the transmit of a completed request and frees its descriptor.
+
+**/
+VOID
+P9ReleaseRequest (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_REQUEST     *Request
+  )
+{
+  while (gBS->CheckEvent (Request->TxIoToken.CompletionToken.Event) == EFI_NOT_READY) {
+    Volume->Tcp4->Poll (Volume->Tcp4);
+  }
+  gBS->CloseEvent (Request->TxIoToken.CompletionToken.Event);
+}
+
+/**
+
+  Cancels an overdue request with Tflush, which releases its tag. The
+  request is completed by its own reply if the server answered it before
+  the flush. When the flush is not answered either, the connection is
+  dropped, taking the tag with it.
+
+**/
+VOID
+P9FlushRequest (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_REQUEST     *Request
+  )
+{
+  EFI_STATUS                    Status;
+  P9_REQUEST                    Flush;
+  P9TFlush                      TxFlush;
+  P9RLError                     RxFlush;
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+  UINTN                         TxFlushSize;
+
+  DEBUG ((DEBUG_ERROR, "%a:%d: Tag %d timed out\n", __func__, __LINE__, Request->Tag));
+
+  ZeroMem (&Flush, sizeof (P9_REQUEST));
+  P9EncodeMessage (
+    &TxFlush,
+    sizeof (P9TFlush),
+    Tflush,
+    P9GetTag (Volume),
+    &TxFlushSize,
+    Request->Tag
     );
+
+  Flush.Tag           = TxFlush.Header.Tag;
+  Flush.RxData        = &RxFlush;
+  Flush.RxDataSize    = sizeof (P9RLError);
+
+  Fragment.FragmentLength = (UINT32)TxFlushSize;
+  Fragment.FragmentBuffer = &TxFlush;
+
+  Status = P9SendRequest (Volume, &Flush, &Fragment, 1);
+  if (!EFI_ERROR (Status)) {
+    Status = P9RunRequest (Volume, &Flush);
+    if (!Flush.IsDone) {
+      P9CompleteRequest (Volume, &Flush, Status);
+    }
+    P9ReleaseRequest (Volume, &Flush);
+  }
+
   if (EFI_ERROR (Status)) {
-    goto Exit;
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    P9ResetConnection (Volume);
   }
+}
 
-  while (Volume->IsRxDone != TRUE) {
-    Tcp4->Poll (Tcp4);
+/**
+
+  Runs the reactor until the reply to Request has arrived and its transmit
+  has completed. A request not answered by its deadline is flushed and
+  fails with EFI_TIMEOUT.
+
+**/
+EFI_STATUS
+P9WaitRequest (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_REQUEST     *Request
+  )
+{
+  EFI_STATUS                    Status;
+  BOOLEAN                       IsBusy;
+
+  IsBusy = Volume->IsBusy;
+  Volume->IsBusy = TRUE;
+
+  Status = P9RunRequest (Volume, Request);
+  if (Status == EFI_TIMEOUT && Volume->IsConfigured) {
+    P9FlushRequest (Volume, Request);
   }
 
-  Status = EFI_SUCCESS;
+  if (!Request->IsDone) {
+    P9CompleteRequest (Volume, Request, Status);
+  }
 
-Exit:
-  return Status;
+  P9ReleaseRequest (Volume, Request);
+
+  Volume->IsBusy = IsBusy;
+
+  return Request->Status;
+}
+
+/**
+
+  Completes every request queued on the volume with Status, typically after
+  its connection was lost.
+
+**/
+VOID
+P9AbortRequests (
+  IN P9_VOLUME          *Volume,
+  IN EFI_STATUS         Status
+  )
+{
+  while (!IsListEmpty (&Volume->Requests)) {
+    P9CompleteRequest (
+      Volume,
+      BASE_CR (GetFirstNode (&Volume->Requests), P9_REQUEST, Link),
+      Status
+      );
+  }
+}
+
+/**
+
+  Tells whether a request failed because its connection was lost, as opposed
+  to being answered with an error.
+
+**/
+BOOLEAN
+P9IsConnectionLost (
+  IN EFI_STATUS         Status
+  )
+{
+  return (BOOLEAN)(Status == EFI_CONNECTION_FIN ||
+                   Status == EFI_CONNECTION_RESET ||
+                   Status == EFI_ABORTED ||
+                   Status == EFI_NOT_STARTED ||
+                   Status == EFI_DEVICE_ERROR);
+}
+
+/**
+
+  Flushes the asynchronous requests of the volume that are past their
+  deadline and completes them with EFI_TIMEOUT, unless their reply arrives
+  during the flush.
+
+**/
+VOID
+P9ExpireRequests (
+  IN P9_VOLUME          *Volume
+  )
+{
+  LIST_ENTRY                    *Entry;
+  P9_REQUEST                    *Request;
+  EFI_FILE_IO_TOKEN             *Token;
+
+  for (;;) {
+    Request = NULL;
+    BASE_LIST_FOR_EACH (Entry, &Volume->Requests) {
+      if (BASE_CR (Entry, P9_REQUEST, Link)->Token != NULL &&
+          P9GetTick () >= BASE_CR (Entry, P9_REQUEST, Link)->Deadline) {
+        Request = BASE_CR (Entry, P9_REQUEST, Link);
+        break;
+      }
+    }
+
+    if (Request == NULL) {
+      break;
+    }
+
+    //
+    // Detach the token so that the request outlives its completion during
+    // the flush.
+    //
+    Token = Request->Token;
+    Request->Token = NULL;
+    if (Volume->IsConfigured) {
+      P9FlushRequest (Volume, Request);
+    }
+    if (!Request->IsDone) {
+      P9CompleteRequest (Volume, Request, EFI_TIMEOUT);
+    }
+    Request->Token = Token;
+    P9SignalRequest (Volume, Request);
+  }
+}
+
+/**
+
+  Completes the asynchronous requests of one connection that can be
+  completed without blocking, and keeps the connection warm when it is idle.
+
+**/
+VOID
+P9RunReactor (
+  IN P9_VOLUME          *Volume
+  )
+{
+  while (!IsListEmpty (&Volume->Requests)) {
+    if (EFI_ERROR (P9Dispatch (Volume, FALSE))) {
+      break;
+    }
+  }
+
+  P9ExpireRequests (Volume);
+
+  if (IsListEmpty (&Volume->Requests)) {
+    P9KeepAlive (Volume);
+  }
+}
+
+/**
+
+  Periodic timer completing asynchronous requests while the volume is idle,
+  on the primary connection and the stripe connections.
+
+**/
+VOID
+EFIAPI
+P9ReactorTimer (
+  IN EFI_EVENT          Event,
+  IN VOID               *Context
+  )
+{
+  P9_VOLUME                     *Volume;
+  P9_VOLUME                     *Stripe;
+  UINTN                         Index;
+
+  Volume = (P9_VOLUME *)Context;
+  if (Volume->IsBusy) {
+    return;
+  }
+
+  Volume->IsBusy = TRUE;
+  P9RunReactor (Volume);
+  for (Index = 0; Index < Volume->StripeCount; Index++) {
+    Stripe = Volume->Stripes[Index];
+    if (!Stripe->IsBusy) {
+      Stripe->IsBusy = TRUE;
+      P9RunReactor (Stripe);
+      Stripe->IsBusy = FALSE;
+    }
+  }
+  Volume->IsBusy = FALSE;
+}
+
+/**
+
+  Sends a message and waits for its reply. A request that timed out is sent
+  again, and a lost connection is failed over once.
+
+  @param  Volume                - The 9P volume.
+  @param  TxData                - The T-message.
+  @param  TxDataSize            - Size of the T-message.
+  @param  RxData                - Buffer receiving the reply.
+  @param  RxDataSize            - Size of RxData.
+  @param  Payload               - Buffer receiving the rest of a reply
+                                  longer than RxDataSize, or NULL.
+  @param  PayloadSize           - Size of Payload.
+  @param  RxLength              - Gets the number of bytes received.
+
+  @retval EFI_SUCCESS           - The reply was received.
+  @return Others                - The request failed.
+
+**/
+EFI_STATUS
+DoP9 (
+  IN P9_VOLUME          *Volume,
+  IN VOID               *TxData,
+  IN UINTN              TxDataSize,
+  OUT VOID              *RxData,
+  IN UINTN              RxDataSize,
+  OUT VOID              *Payload OPTIONAL,
+  IN UINTN              PayloadSize,
+  OUT UINTN             *RxLength
+  )
+{
+  EFI_STATUS                    Status;
+  P9_REQUEST                    Request;
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+  UINTN                         Retries;
+  BOOLEAN                       IsReconnected;
+
+  if (Volume == NULL || TxData == NULL || RxData == NULL || RxDataSize < sizeof (P9Header)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  ZeroMem (&Request, sizeof (P9_REQUEST));
+  Request.Tag           = ((P9Header *)TxData)->Tag;
+  Request.RxData        = RxData;
+  Request.RxDataSize    = RxDataSize;
+  Request.RxPayload     = Payload;
+  Request.RxPayloadSize = PayloadSize;
+
+  Request.Timeout       = P9_REQUEST_TIMEOUT;
+
+  Fragment.FragmentLength = (UINT32)TxDataSize;
+  Fragment.FragmentBuffer = TxData;
+
+  Retries       = 0;
+  IsReconnected = FALSE;
+  for (;;) {
+    Status = P9SendRequest (Volume, &Request, &Fragment, 1);
+    if (!EFI_ERROR (Status)) {
+      Status = P9WaitRequest (Volume, &Request);
+    }
+
+    //
+    // A flushed request is sent again with twice the time. Its tag is free
+    // again, and so is the tag of a request on a dropped connection.
+    //
+    if (Status == EFI_TIMEOUT && Retries < P9_REQUEST_RETRIES) {
+      Retries++;
+      Request.Timeout *= 2;
+      continue;
+    }
+
+    //
+    // Fids keep their numbers across a failover, so the message is sent
+    // again as is.
+    //
+    if (P9IsConnectionLost (Status) && !IsReconnected && !EFI_ERROR (P9Reconnect (Volume))) {
+      IsReconnected = TRUE;
+      continue;
+    }
+
+    *RxLength = Request.RxLength;
+    return Status;
+  }
 }
 
 EFI_STATUS
@@ -238,6 +905,171 @@ AsciiStrToP9StringS (
   return EFI_SUCCESS;
 }
 
+/**
+
+  Returns the number of bytes the first Length characters of String take in
+  UTF-8. Lone surrogates count as the three bytes of U+FFFD.
+
+**/
+UINTN
+P9Utf8Size (
+  IN CONST CHAR16       *String,
+  IN UINTN              Length
+  )
+{
+  UINTN       Size;
+  UINTN       Index;
+
+  Size = Length;
+  for (Index = 0; Index < Length; Index++) {
+    if (String[Index] >= 0x80) {
+      Size += (String[Index] >= 0x800) ? 2 : 1;
+    }
+  }
+
+  return Size;
+}
+
+/**
+
+  Encodes the first Length characters of String in UTF-8. Runs of ASCII are
+  narrowed four characters at a time. Surrogates, which UCS-2 does not pair,
+  are encoded as U+FFFD.
+
+  @param  String                - The UCS-2 characters.
+  @param  Length                - Number of characters.
+  @param  Buffer                - Receives P9Utf8Size() bytes.
+
+  @return The number of bytes written.
+
+**/
+UINTN
+P9EncodeUtf8 (
+  IN CONST CHAR16       *String,
+  IN UINTN              Length,
+  OUT CHAR8             *Buffer
+  )
+{
+  UINT8       *Out;
+  UINT64      Word;
+  CHAR16      Char;
+  UINTN       Index;
+
+  Out   = (UINT8 *)Buffer;
+  Index = 0;
+  while (Index < Length) {
+    if (Length - Index >= 4) {
+      Word = ReadUnaligned64 ((CONST UINT64 *)&String[Index]);
+      if ((Word & P9_UCS2_NON_ASCII_MASK) == 0) {
+        Out[0] = (UINT8)Word;
+        Out[1] = (UINT8)(Word >> 16);
+        Out[2] = (UINT8)(Word >> 32);
+        Out[3] = (UINT8)(Word >> 48);
+        Out   += 4;
+        Index += 4;
+        continue;
+      }
+    }
+
+    Char = String[Index++];
+    if (Char < 0x80) {
+      *(Out++) = (UINT8)Char;
+    } else if (Char < 0x800) {
+      *(Out++) = (UINT8)(0xC0 | (Char >> 6));
+      *(Out++) = (UINT8)(0x80 | (Char & 0x3F));
+    } else {
+      if (Char >= 0xD800 && Char <= 0xDFFF) {
+        Char = 0xFFFD;
+      }
+      *(Out++) = (UINT8)(0xE0 | (Char >> 12));
+      *(Out++) = (UINT8)(0x80 | ((Char >> 6) & 0x3F));
+      *(Out++) = (UINT8)(0x80 | (Char & 0x3F));
+    }
+  }
+
+  return (UINTN)(Out - (UINT8 *)Buffer);
+}
+
+/**
+
+  Decodes Size bytes of UTF-8 into UCS-2. Runs of ASCII are widened eight
+  bytes at a time. Malformed sequences, surrogates and characters beyond
+  the BMP, which UCS-2 can not hold, are decoded as U+FFFD.
+
+  @param  Buffer                - The UTF-8 bytes.
+  @param  Size                  - Number of bytes.
+  @param  String                - Receives up to Size characters, without a
+                                  terminating NUL.
+
+  @return The number of characters written.
+
+**/
+UINTN
+P9DecodeUtf8 (
+  IN CONST CHAR8        *Buffer,
+  IN UINTN              Size,
+  OUT CHAR16            *String
+  )
+{
+  CONST UINT8 *In;
+  CHAR16      *Out;
+  UINT64      Word;
+  UINT32      Char;
+  UINT32      Min;
+  UINTN       Index;
+  UINTN       Count;
+
+  In    = (CONST UINT8 *)Buffer;
+  Out   = String;
+  Index = 0;
+  while (Index < Size) {
+    if (Size - Index >= 8) {
+      Word = ReadUnaligned64 ((CONST UINT64 *)&In[Index]);
+      if ((Word & P9_UTF8_NON_ASCII_MASK) == 0) {
+        for (Count = 0; Count < 8; Count++) {
+          Out[Count] = (CHAR16)(UINT8)(Word >> (Count * 8));
+        }
+        Out   += 8;
+        Index += 8;
+        continue;
+      }
+    }
+
+    Char = In[Index++];
+    if (Char >= 0x80) {
+      if (Char >= 0xC2 && Char <= 0xDF) {
+        Count = 1;
+        Char &= 0x1F;
+        Min   = 0x80;
+      } else if (Char >= 0xE0 && Char <= 0xEF) {
+        Count = 2;
+        Char &= 0x0F;
+        Min   = 0x800;
+      } else if (Char >= 0xF0 && Char <= 0xF4) {
+        Count = 3;
+        Char &= 0x07;
+        Min   = 0x10000;
+      } else {
+        Count = 0;
+        Char  = 0xFFFD;
+        Min   = 0;
+      }
+
+      for (; Count > 0 && Index < Size && (In[Index] & 0xC0) == 0x80; Count--) {
+        Char = (Char << 6) | (In[Index++] & 0x3F);
+      }
+
+      if (Count != 0 || Char < Min || Char > 0xFFFF || (Char >= 0xD800 && Char <= 0xDFFF)) {
+        Char = 0xFFFD;
+      }
+    }
+
+    *(Out++) = (CHAR16)Char;
+  }
+
+  return (UINTN)(Out - String);
+}
+
 EFI_STATUS
 UnicodeStrToP9StringS (
   IN CONST CHAR16       *Source,
@@ -246,23 +1078,19 @@ UnicodeStrToP9StringS (
   )
 {
   UINTN SourceLen;
-  CHAR8 *DestStr;
+  UINTN Size;
 
   if (Destination == NULL || Source == NULL || DestMax == 0) {
     return EFI_INVALID_PARAMETER;
   }
 
   SourceLen = StrLen (Source);
-  if (!(DestMax >= SourceLen)) {
+  Size      = P9Utf8Size (Source, SourceLen);
+  if (!(DestMax >= Size) || Size > MAX_UINT16) {
     return EFI_BUFFER_TOO_SMALL;
   }
 
-  Destination->Size = 0;
-  DestStr = Destination->String;
-  while (*Source != L'\0') {
-    *(DestStr++) = (CHAR8)(CHAR16)*(Source++);
-    Destination->Size++;
-  }
+  Destination->Size = (UINT16)P9EncodeUtf8 (Source, SourceLen, Destination->String);
 
   return EFI_SUCCESS;
 }
@@ -274,22 +1102,21 @@ P9StringToUnicodeStrS (
   IN UINTN              DestMax
   )
 {
-  CHAR8   *SourceStr;
-  UINT16  SourceSize;
+  UINTN   Length;
 
   if (Destination == NULL || Source == NULL || DestMax == 0) {
     return EFI_INVALID_PARAMETER;
   }
 
+  //
+  // A name never decodes to more characters than it has bytes.
+  //
   if (!(DestMax > Source->Size)) {
     return EFI_BUFFER_TOO_SMALL;
   }
 
-  SourceStr = Source->String;
-  SourceSize = Source->Size;
-  for (; SourceSize > 0; *(Destination++) = (CHAR16)(CHAR8)*(SourceStr++), SourceSize--) {
-  }
-  *Destination = L'\0';
+  Length = P9DecodeUtf8 (Source->String, Source->Size, Destination);
+  Destination[Length] = L'\0';
 
   return EFI_SUCCESS;
 }
\ No newline at end of file
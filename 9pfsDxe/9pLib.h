@@ -30,34 +30,198 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #include "9p.h"
 #include "9pfs.h"
 
-#define FRAGMENT_SIZE 576
-
-typedef struct _P9_CONNECT_PRIVATE_DATA P9_CONNECT_PRIVATE_DATA;
-typedef struct _P9_MESSAGE_PRIVATE_DATA P9_MESSAGE_PRIVATE_DATA;
+//
+// Number of Twrite requests kept in flight by P9LWrite.
+//
+#define P9_WRITE_PIPELINE_DEPTH 4
+
+//
+// Time a request may wait for its reply before it is flushed, in ticks,
+// and how many more times DoP9 sends it after it timed out. The time is
+// doubled on each attempt.
+//
+#define P9_REQUEST_TIMEOUT      3000
+#define P9_REQUEST_RETRIES      2
+
+//
+// Time a connection may stay idle before P9KeepAlive sends a request on it,
+// in ticks. Middleboxes commonly drop flows idle for a minute or more.
+//
+#define P9_KEEPALIVE_IDLE       15000
+
+//
+// Number of Tread requests kept in flight on each connection by
+// P9LReadStriped, and the smallest read that is striped.
+//
+#define P9_READ_PIPELINE_DEPTH  4
+#define P9_STRIPE_MIN_SIZE      (P9_MSIZE * 2)
+
+//
+// Number of directory entries whose attributes are fetched at once.
+//
+#define P9_READDIR_PIPELINE_DEPTH 16
+
+//
+// Values of the Handshake variable.
+//
+#define P9_HANDSHAKE_SEQUENTIAL 0
+#define P9_HANDSHAKE_PIPELINED  1
+#define P9_HANDSHAKE_PREFETCH   2
+
+//
+// Period of the tick used to time round trips, in 100ns units (1 ms).
+//
+#define P9_TICK_PERIOD          10000
+
+//
+// Automatic TCP options. Buffers are sized to sustain P9_TCP_TARGET_RATE
+// bytes per second over the measured round-trip time, up to
+// P9_TCP_BUFFER_MAX. Keepalive times are in seconds.
+//
+#define P9_TCP_TARGET_RATE          (125 * 1000 * 1000)
+#define P9_TCP_BUFFER_MAX           (16 * 1024 * 1024)
+#define P9_TCP_KEEPALIVE_TIME       60
+#define P9_TCP_KEEPALIVE_INTERVAL   10
+#define P9_TCP_KEEPALIVE_PROBES     5
+
+//
+// Bits that are clear in a little-endian word of eight ASCII bytes, and of
+// four ASCII UCS-2 characters. Names are converted a word at a time while
+// they are ASCII.
+//
+#define P9_UTF8_NON_ASCII_MASK  0x8080808080808080ULL
+#define P9_UCS2_NON_ASCII_MASK  0xFF80FF80FF80FF80ULL
+
+//
+// Most fragments a message is sent in, and the size of the objects of the
+// request slab of a volume, which hold the asynchronous requests together
+// with their messages.
+//
+#define P9_MAX_FRAGMENTS        2
+#define P9_REQUEST_OBJECT_SIZE  512
+
+//
+// Size of the buffer an Rversion is received into. A reply naming a version
+// that does not fit is rejected as malformed.
+//
+#define P9_VERSION_REPLY_SIZE   (sizeof (P9RVersion) + 32)
+
+typedef struct _P9_REQUEST              P9_REQUEST;
+
+//
+// Called instead of signaling the token when an asynchronous request with a
+// Notify function completes, before the request is freed.
+//
+typedef
+VOID
+(*P9_REQUEST_NOTIFY) (
+  IN P9_VOLUME          *Volume,
+  IN P9_REQUEST         *Request,
+  IN EFI_STATUS         Status
+  );
 
-struct _P9_CONNECT_PRIVATE_DATA {
-  EFI_TCP4_CONNECTION_TOKEN ConnectionToken;
-  BOOLEAN                   IsConnectDone;
+//
+// Messages of a pipelined handshake.
+//
+#define P9_HANDSHAKE_VERSION    0
+#define P9_HANDSHAKE_ATTACH     1
+#define P9_HANDSHAKE_STATFS     2
+#define P9_HANDSHAKE_GETATTR    3
+#define P9_HANDSHAKE_MAX        4
+
+//
+// Room the handshake messages take in the buffer of a handshake apart from
+// the user and export names, and the size of the buffer each reply is
+// received into, which fits the largest of them.
+//
+#define P9_HANDSHAKE_TX_SIZE    128
+#define P9_HANDSHAKE_RX_SIZE    sizeof (P9RGetAttr)
+
+//
+// A T-message waiting for its R-message. Replies are matched to requests by
+// tag, so several requests may be in flight on one connection. A request
+// with a Token is completed asynchronously: the reply status is stored in
+// the token, its event is signaled and the request is returned to the
+// request slab of the volume, so such a request must be the first member of
+// an object from P9AllocateRequest. With a Notify function, the reply
+// status is passed to it instead and the token is left alone. The transmit
+// descriptor is held in the request itself. The part of a reply past
+// RxDataSize is received into RxPayload, if there is one.
+//
+// A request not answered within Timeout ticks, P9_REQUEST_TIMEOUT if zero,
+// is flushed and completed with EFI_TIMEOUT.
+//
+struct _P9_REQUEST {
+  LIST_ENTRY                Link;
+  UINT8                     Id;
+  UINT16                    Tag;
+  UINT64                    Timeout;
+  UINT64                    Deadline;
+  EFI_TCP4_IO_TOKEN         TxIoToken;
+  EFI_TCP4_TRANSMIT_DATA    TxData;
+  EFI_TCP4_FRAGMENT_DATA    TxFragments[P9_MAX_FRAGMENTS - 1];
+  VOID                      *RxData;
+  UINTN                     RxDataSize;
+  VOID                      *RxPayload;
+  UINTN                     RxPayloadSize;
+  UINTN                     RxLength;
+  BOOLEAN                   IsDone;
+  EFI_STATUS                Status;
+  EFI_FILE_IO_TOKEN         *Token;
+  P9_REQUEST_NOTIFY         Notify;
 };
 
-struct _P9_MESSAGE_PRIVATE_DATA {
-  EFI_TCP4_IO_TOKEN         TxIoToken;
-  EFI_TCP4_IO_TOKEN         RxIoToken;
-  BOOLEAN                   IsTxDone;
-  BOOLEAN                   IsRxDone;
+//
+// A pipelined handshake sent by P9HandshakeStart and waiting for
+// P9HandshakeFinish. The handshake is one pool allocation: the T-messages
+// are serialized into the buffer that follows the structure, which is
+// sized to the names, and the replies are received into RxData.
+//
+struct _P9_HANDSHAKE {
+  P9_IFILE                  *Root;
+  CHAR8                     *UNameStr;
+  CHAR8                     *ANameStr;
+  BOOLEAN                   Prefetch;
+  UINTN                     Count;
+  UINTN                     Sent;
+  UINT64                    Start;
+  BOOLEAN                   IsTimed;
+  P9_REQUEST                Requests[P9_HANDSHAKE_MAX];
+  VOID                      *TxData[P9_HANDSHAKE_MAX];
+  UINTN                     TxDataSize[P9_HANDSHAKE_MAX];
+  UINT8                     RxData[P9_HANDSHAKE_MAX][P9_HANDSHAKE_RX_SIZE];
 };
 
+#define P9_HANDSHAKE_TX_BUFFER(Handshake) ((UINT8 *)((Handshake) + 1))
+
 UINT32
 GetFid (
   VOID
   );
 
+VOID
+EFIAPI
+P9TickNotify (
+  IN EFI_EVENT          Event,
+  IN VOID               *Context
+  );
+
+UINT64
+P9GetTick (
+  VOID
+  );
+
+UINT16
+P9GetTag (
+  IN P9_VOLUME          *Volume
+  );
+
 EFI_STATUS
-TransmitTcp4 (
-  IN EFI_TCP4_PROTOCOL  *Tcp4,
-  IN EFI_TCP4_IO_TOKEN  *TransmitToken,
-  IN VOID               *Data,
-  IN UINTN              DataSize
+TransmitTcp4Fragments (
+  IN EFI_TCP4_PROTOCOL      *Tcp4,
+  IN EFI_TCP4_IO_TOKEN      *TransmitToken,
+  IN EFI_TCP4_FRAGMENT_DATA *Fragments,
+  IN UINT32                 FragmentCount
   );
 
 EFI_STATUS
@@ -65,15 +229,36 @@ ReceiveTcp4 (
   IN EFI_TCP4_PROTOCOL  *Tcp4,
   IN EFI_TCP4_IO_TOKEN  *ReceiveToken,
   OUT VOID              *Data,
-  OUT UINTN             DataSize
+  IN UINTN              DataSize
+  );
+
+VOID
+P9TcpOption (
+  IN P9_VOLUME          *Volume,
+  OUT EFI_TCP4_OPTION   *Option
+  );
+
+EFI_STATUS
+StrToIpv4Addr (
+  IN CHAR16             *String,
+  OUT EFI_IPv4_ADDRESS  *Addr,
+  OUT UINT16            *Port
   );
 
 EFI_STATUS
 ConfigureP9 (
-  IN OUT P9_VOLUME      *Volume,
-  IN CHAR16             *StationAddrStr,
-  IN CHAR16             *SubnetMaskStr,
-  IN CHAR16             *RemoteAddrStr
+  IN OUT P9_VOLUME      *Volume
+  );
+
+EFI_STATUS
+P9StartConnect (
+  IN P9_VOLUME          *Volume
+  );
+
+EFI_STATUS
+P9CheckConnect (
+  IN P9_VOLUME          *Volume,
+  IN BOOLEAN            Wait
   );
 
 EFI_STATUS
@@ -81,13 +266,128 @@ ConnectP9 (
   IN P9_VOLUME          *Volume
   );
 
+VOID
+P9ResetConnection (
+  IN OUT P9_VOLUME      *Volume
+  );
+
+P9_REQUEST *
+P9AllocateRequest (
+  IN P9_VOLUME          *Volume,
+  IN UINTN              Size
+  );
+
+VOID
+P9FreeRequest (
+  IN P9_VOLUME          *Volume,
+  IN P9_REQUEST         *Request
+  );
+
+EFI_STATUS
+P9SendRequest (
+  IN P9_VOLUME              *Volume,
+  IN OUT P9_REQUEST         *Request,
+  IN EFI_TCP4_FRAGMENT_DATA *Fragments,
+  IN UINT32                 FragmentCount
+  );
+
+EFI_STATUS
+P9WaitRequest (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_REQUEST     *Request
+  );
+
+EFI_STATUS
+P9Dispatch (
+  IN P9_VOLUME          *Volume,
+  IN BOOLEAN            Wait
+  );
+
+VOID
+P9AbortRequests (
+  IN P9_VOLUME          *Volume,
+  IN EFI_STATUS         Status
+  );
+
+VOID
+P9ExpireRequests (
+  IN P9_VOLUME          *Volume
+  );
+
+BOOLEAN
+P9IsConnectionLost (
+  IN EFI_STATUS         Status
+  );
+
+VOID
+EFIAPI
+P9ReactorTimer (
+  IN EFI_EVENT          Event,
+  IN VOID               *Context
+  );
+
 EFI_STATUS
 DoP9 (
   IN P9_VOLUME          *Volume,
   IN VOID               *TxData,
   IN UINTN              TxDataSize,
-  IN OUT VOID           *RxData,
-  IN OUT UINTN          RxDataSize
+  OUT VOID              *RxData,
+  IN UINTN              RxDataSize,
+  OUT VOID              *Payload OPTIONAL,
+  IN UINTN              PayloadSize,
+  OUT UINTN             *RxLength
+  );
+
+EFI_STATUS
+P9EncodeMessageV (
+  OUT VOID              *Buffer,
+  IN UINTN              BufferSize,
+  IN UINT8              Id,
+  IN UINT16             Tag,
+  OUT UINTN             *Size,
+  IN VA_LIST            Args
+  );
+
+EFI_STATUS
+EFIAPI
+P9EncodeMessage (
+  OUT VOID              *Buffer,
+  IN UINTN              BufferSize,
+  IN UINT8              Id,
+  IN UINT16             Tag,
+  OUT UINTN             *Size,
+  ...
+  );
+
+EFI_STATUS
+P9CheckMessage (
+  IN UINT8              Id,
+  IN VOID               *Data,
+  IN UINTN              Length
+  );
+
+VOID *
+P9ReserveMessage (
+  IN P9_VOLUME          *Volume,
+  IN UINTN              Size
+  );
+
+VOID
+P9ReleaseMessage (
+  IN P9_VOLUME          *Volume,
+  IN VOID               *Buffer
+  );
+
+EFI_STATUS
+EFIAPI
+P9Rpc (
+  IN P9_VOLUME          *Volume,
+  IN UINT8              Id,
+  OUT VOID              *RxData OPTIONAL,
+  IN UINTN              RxDataSize,
+  OUT VOID              *Payload OPTIONAL,
+  IN UINTN              PayloadSize,
+  ...
   );
 
 EFI_STATUS
@@ -96,6 +396,12 @@ P9Error (
   IN UINTN              DataSize
   );
 
+EFI_STATUS
+P9ParseVersion (
+  IN P9RVersion         *RxVersion,
+  OUT UINT32            *MSize
+  );
+
 EFI_STATUS
 P9Version (
   IN P9_VOLUME          *Volume,
@@ -112,9 +418,60 @@ P9Attach (
   OUT P9_IFILE          *IFile
   );
 
+EFI_STATUS
+P9HandshakeStart (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *Root,
+  IN CHAR8              *UNameStr,
+  IN CHAR8              *ANameStr,
+  IN BOOLEAN            Prefetch,
+  OUT P9_HANDSHAKE      **Handshake
+  );
+
+EFI_STATUS
+P9HandshakeFinish (
+  IN P9_VOLUME          *Volume,
+  IN P9_HANDSHAKE       *Handshake,
+  IN BOOLEAN            Wait
+  );
+
+VOID
+P9HandshakeCancel (
+  IN P9_VOLUME          *Volume,
+  IN P9_HANDSHAKE       *Handshake
+  );
+
+EFI_STATUS
+P9Handshake (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *Root,
+  IN CHAR8              *UNameStr,
+  IN CHAR8              *ANameStr,
+  IN BOOLEAN            Prefetch
+  );
+
+EFI_STATUS
+P9ParseStatfs (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid,
+  IN P9RStatfs          *RxStatfs
+  );
+
 EFI_STATUS
 P9Statfs (
-  IN  P9_VOLUME         *Volume
+  IN  P9_VOLUME         *Volume,
+  IN  UINT32            Fid
+  );
+
+EFI_STATUS
+P9LookupStatfs (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid
+  );
+
+VOID
+P9ResetStatfsCache (
+  IN P9_VOLUME          *Volume
   );
 
 EFI_STATUS
@@ -123,6 +480,12 @@ P9LOpen (
   IN OUT P9_IFILE       *IFile
   );
 
+EFI_STATUS
+P9ParseGetAttr (
+  IN OUT P9_IFILE       *IFile,
+  IN P9RGetAttr         *RxGetAttr
+  );
+
 EFI_STATUS
 P9GetAttr (
   IN P9_VOLUME          *Volume,
@@ -137,6 +500,63 @@ P9LRead (
   OUT VOID              *Data
   );
 
+EFI_STATUS
+P9LReadStriped (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *IFile,
+  IN UINT64             Offset,
+  IN OUT UINTN          *Count,
+  OUT VOID              *Data
+  );
+
+EFI_STATUS
+P9LWrite (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  IN UINT64             Offset,
+  IN OUT UINTN          *Count,
+  IN VOID               *Data
+  );
+
+P9_WRITE_BATCH *
+P9StartWriteBatch (
+  IN P9_IFILE           *IFile,
+  IN EFI_FILE_IO_TOKEN  *Token
+  );
+
+EFI_STATUS
+P9QueueWrite (
+  IN OUT P9_WRITE_BATCH *Batch,
+  IN UINT64             Offset,
+  IN UINTN              Count,
+  IN VOID               *Data,
+  IN BOOLEAN            IsOwned
+  );
+
+VOID
+P9EndWriteBatch (
+  IN OUT P9_WRITE_BATCH *Batch,
+  IN EFI_STATUS         Status,
+  IN BOOLEAN            Fsync
+  );
+
+VOID
+P9WaitWrites (
+  IN P9_IFILE           *IFile
+  );
+
+EFI_STATUS
+P9Fsync (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  IN EFI_FILE_IO_TOKEN  *Token OPTIONAL
+  );
+
+EFI_STATUS
+P9KeepAlive (
+  IN P9_VOLUME          *Volume
+  );
+
 EFI_STATUS
 P9LReadDir (
   IN P9_VOLUME          *Volume,
@@ -146,26 +566,216 @@ P9LReadDir (
   OUT VOID              *Data
   );
 
+EFI_STATUS
+P9OpenDirReader (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  OUT P9_DIR_READER     **Reader
+  );
+
+EFI_STATUS
+P9PeekDirEntry (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  IN OUT P9_DIR_READER  *Reader,
+  OUT EFI_FILE_INFO     **FileInfo
+  );
+
+VOID
+P9NextDirEntry (
+  IN OUT P9_DIR_READER  *Reader
+  );
+
+VOID
+P9CloseDirReader (
+  IN P9_DIR_READER      *Reader
+  );
+
 EFI_STATUS
 P9LReadLink (
   IN P9_VOLUME          *Volume,
   IN OUT P9_IFILE       *IFile
   );
 
+BOOLEAN
+P9LookupLink (
+  IN P9_VOLUME          *Volume,
+  IN Qid                *LinkQid,
+  OUT CHAR16            *Target,
+  IN UINTN              TargetLength
+  );
+
+EFI_STATUS
+P9ReadLinkFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid,
+  IN Qid                *LinkQid,
+  OUT CHAR16            *Target,
+  IN UINTN              TargetLength
+  );
+
+VOID
+P9ResetLinkCache (
+  IN P9_VOLUME          *Volume
+  );
+
 EFI_STATUS
 P9Walk (
   IN P9_VOLUME          *Volume,
   IN P9_IFILE           *IFile,
   OUT P9_IFILE          *NewIFile,
+  IN CHAR16             *Path,
+  IN BOOLEAN            Follow
+  );
+
+UINTN
+P9NameLength (
+  IN CHAR16             *Path
+  );
+
+CHAR16 *
+P9SkipNames (
+  IN CHAR16             *Path,
+  IN UINTN              Count
+  );
+
+UINT16
+P9CountWalkNames (
   IN CHAR16             *Path
   );
 
+EFI_STATUS
+P9FixNameCase (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *Root,
+  IN OUT CHAR16         *FullPath,
+  IN UINTN              WalkedLength
+  );
+
+VOID
+P9ResetDirIndexes (
+  IN P9_VOLUME          *Volume
+  );
+
+EFI_STATUS
+P9LookupDirSnapshot (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *IFile,
+  OUT P9_DIR_SNAPSHOT   **Snapshot
+  );
+
+VOID
+P9CacheDirSnapshot (
+  IN P9_VOLUME          *Volume,
+  IN P9_DIR_SNAPSHOT    *Snapshot
+  );
+
+EFI_STATUS
+P9AppendDirEntry (
+  IN OUT P9_DIR_SNAPSHOT  *Snapshot,
+  IN EFI_FILE_INFO        *FileInfo
+  );
+
+VOID
+P9ReleaseDirSnapshot (
+  IN P9_DIR_SNAPSHOT    *Snapshot
+  );
+
+VOID
+P9ResetDirCache (
+  IN P9_VOLUME          *Volume
+  );
+
+EFI_STATUS
+P9WalkFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid,
+  IN UINT32             NewFid,
+  IN CHAR16             *Path,
+  OUT Qid               *NewQid,
+  OUT UINTN             *Walked OPTIONAL
+  );
+
+EFI_STATUS
+P9ClunkFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid
+  );
+
+P9_CACHED_FID *
+P9LookupFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN CHAR16             *Path,
+  IN UINTN              PathLength
+  );
+
+P9_CACHED_FID *
+P9LookupAncestorFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN CHAR16             *Path
+  );
+
+EFI_STATUS
+P9CacheFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN UINT32             Fid,
+  IN CHAR16             *Path,
+  IN UINTN              PathLength,
+  IN Qid                *FidQid
+  );
+
+VOID
+P9TakeCachedFid (
+  IN OUT P9_CACHED_FID  *Entry,
+  OUT UINT32            *Fid,
+  OUT Qid               *FidQid
+  );
+
+EFI_STATUS
+P9CacheClone (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN UINT32             Fid,
+  IN CHAR16             *Path,
+  IN Qid                *FidQid
+  );
+
+VOID
+P9ResetFidCache (
+  IN P9_VOLUME          *Volume
+  );
+
 EFI_STATUS
 P9Clunk (
   IN P9_VOLUME          *Volume,
   IN P9_IFILE           *IFile
   );
 
+VOID
+P9InitSlab (
+  OUT P9_SLAB           *Slab,
+  IN UINTN              ObjectSize
+  );
+
+VOID *
+P9AllocateObject (
+  IN OUT P9_SLAB        *Slab
+  );
+
+VOID
+P9FreeObject (
+  IN OUT P9_SLAB        *Slab,
+  IN VOID               *Object
+  );
+
+VOID
+P9DestroySlab (
+  IN OUT P9_SLAB        *Slab
+  );
+
 EFI_STATUS
 AsciiStrToP9StringS (
   IN CONST CHAR8        *Source,
@@ -173,6 +783,26 @@ AsciiStrToP9StringS (
   IN UINTN              DestMax
   );
 
+UINTN
+P9Utf8Size (
+  IN CONST CHAR16       *String,
+  IN UINTN              Length
+  );
+
+UINTN
+P9EncodeUtf8 (
+  IN CONST CHAR16       *String,
+  IN UINTN              Length,
+  OUT CHAR8             *Buffer
+  );
+
+UINTN
+P9DecodeUtf8 (
+  IN CONST CHAR8        *Buffer,
+  IN UINTN              Size,
+  OUT CHAR16            *String
+  );
+
 EFI_STATUS
 UnicodeStrToP9StringS (
   IN CONST CHAR16       *Source,
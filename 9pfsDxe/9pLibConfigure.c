@@ -148,24 +148,81 @@ Exit:
   return EFI_UNSUPPORTED;
 }
 
+/**
+
+  Derives the TCP options of a connection of Volume.
+
+  Buffers are sized to hold P9_WRITE_PIPELINE_DEPTH messages of the negotiated
+  msize, and once a round-trip time has been measured, to sustain
+  P9_TCP_TARGET_RATE over it. An option set in the TcpOption variable takes
+  precedence, except for buffer sizes left zero there.
+
+  @param  Volume                - The 9P volume.
+  @param  Option                - The derived TCP options.
+
+**/
+VOID
+P9TcpOption (
+  IN P9_VOLUME          *Volume,
+  OUT EFI_TCP4_OPTION   *Option
+  )
+{
+  P9_CONFIG                     *Config;
+  UINT64                        BufferSize;
+
+  //
+  // Stripe connections share the configuration of the primary connection.
+  //
+  Config = (Volume->Primary != NULL) ? &Volume->Primary->Config : &Volume->Config;
+
+  BufferSize = MultU64x32 ((UINT64)Volume->MSize, P9_WRITE_PIPELINE_DEPTH + 1);
+  BufferSize = MAX (BufferSize, DivU64x32 (MultU64x32 (Volume->Rtt, P9_TCP_TARGET_RATE), 1000));
+  BufferSize = MIN (BufferSize, P9_TCP_BUFFER_MAX);
+
+  if (Config->IsTcpOptionSet) {
+    CopyMem (Option, &Config->TcpOption, sizeof (EFI_TCP4_OPTION));
+  } else {
+    ZeroMem (Option, sizeof (EFI_TCP4_OPTION));
+    Option->KeepAliveProbes     = P9_TCP_KEEPALIVE_PROBES;
+    Option->KeepAliveTime       = P9_TCP_KEEPALIVE_TIME;
+    Option->KeepAliveInterval   = P9_TCP_KEEPALIVE_INTERVAL;
+    Option->EnableNagle         = FALSE;
+    Option->EnableTimeStamp     = TRUE;
+    Option->EnableWindowScaling = BufferSize > MAX_UINT16;
+  }
+
+  if (Option->SendBufferSize == 0) {
+    Option->SendBufferSize = (UINT32)BufferSize;
+  }
+
+  if (Option->ReceiveBufferSize == 0) {
+    Option->ReceiveBufferSize = (UINT32)BufferSize;
+  }
+}
+
+/**
+
+  Configures the TCP instance of Volume from the volume configuration.
+
+  @param  Volume                - The 9P volume. Stripe connections use the
+                                  configuration of their primary connection.
+
+  @retval EFI_SUCCESS           - The TCP instance is configured.
+  @retval EFI_ALREADY_STARTED   - The volume is already configured.
+  @return Others                - The TCP instance could not be configured.
+
+**/
 EFI_STATUS
 ConfigureP9 (
-  IN OUT P9_VOLUME          *Volume,
-  IN CHAR16                 *StationAddrStr,
-  IN CHAR16                 *SubnetMaskStr,
-  IN CHAR16                 *RemoteAddrStr
+  IN OUT P9_VOLUME          *Volume
   )
 {
   EFI_STATUS                    Status;
-  EFI_IPv4_ADDRESS              StationAddr;
-  UINT16                        StationPort;
-  EFI_IPv4_ADDRESS              SubnetMask;
-  EFI_IPv4_ADDRESS              RemoteAddr;
-  UINT16                        RemotePort;
-  EFI_TCP4_CONFIG_DATA          *Tcp4Config;
-  EFI_TCP4_OPTION               *ControlOption;
-
-  if (Volume == NULL || StationAddrStr == NULL || SubnetMaskStr == NULL || RemoteAddrStr == NULL) {
+  P9_CONFIG                     *Config;
+  EFI_TCP4_CONFIG_DATA          Tcp4Config;
+  EFI_TCP4_OPTION               ControlOption;
+
+  if (Volume == NULL) {
     return EFI_INVALID_PARAMETER;
   }
 
@@ -173,68 +230,47 @@ ConfigureP9 (
     return EFI_ALREADY_STARTED;
   }
 
-  Status = P9InitProtocol (Volume);
-  if (EFI_ERROR (Status)) {
-    return Status;
+  if (Volume->Tcp4 == NULL) {
+    Status = P9InitProtocol (Volume);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
   }
 
-  Tcp4Config = NULL;
-  ControlOption = NULL;
-
-  Status = StrToIpv4Addr(StationAddrStr, &StationAddr, &StationPort);
-  if (EFI_ERROR (Status)) {
-    goto Done;
-  }
-  Status = StrToIpv4Addr(SubnetMaskStr, &SubnetMask, NULL);
-  if (EFI_ERROR (Status)) {
-    goto Done;
-  }
-  Status = StrToIpv4Addr(RemoteAddrStr, &RemoteAddr, &RemotePort);
-  if (EFI_ERROR (Status)) {
-    goto Done;
-  }
+  Config = (Volume->Primary != NULL) ? &Volume->Primary->Config : &Volume->Config;
 
-  Tcp4Config = AllocateZeroPool (sizeof (EFI_TCP4_CONFIG_DATA));
-  if (Tcp4Config == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Done;
+  if (Volume->MSize == 0) {
+    Volume->MSize = P9_MSIZE;
   }
-
-  ControlOption = AllocateZeroPool (sizeof (EFI_TCP4_OPTION));
-  if (ControlOption == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Done;
+  P9TcpOption (Volume, &ControlOption);
+
+  ZeroMem (&Tcp4Config, sizeof (EFI_TCP4_CONFIG_DATA));
+  Tcp4Config.TypeOfService = 0;
+  Tcp4Config.TimeToLive = 255;
+  Tcp4Config.AccessPoint.UseDefaultAddress = FALSE;
+  Tcp4Config.AccessPoint.StationPort = Config->StationPort;
+  Tcp4Config.AccessPoint.RemotePort = Config->RemotePort[Volume->Replica];
+  Tcp4Config.AccessPoint.ActiveFlag = TRUE;
+  Tcp4Config.ControlOption = &ControlOption;
+
+  //
+  // Stripe and racing connections share the station address of the primary
+  // connection and take an ephemeral port.
+  //
+  if (Volume->Primary != NULL) {
+    Tcp4Config.AccessPoint.StationPort = 0;
   }
 
-  ControlOption->SendBufferSize = P9_MSIZE;
-  ControlOption->ReceiveBufferSize = P9_MSIZE;
-  Tcp4Config->TypeOfService = 0;
-  Tcp4Config->TimeToLive = 255;
-  Tcp4Config->AccessPoint.UseDefaultAddress = FALSE;
-  Tcp4Config->AccessPoint.StationPort = StationPort;
-  Tcp4Config->AccessPoint.RemotePort = RemotePort;
-  Tcp4Config->AccessPoint.ActiveFlag = TRUE;
-  Tcp4Config->ControlOption = ControlOption;
+  CopyMem (&Tcp4Config.AccessPoint.StationAddress, &Config->StationAddr, sizeof (EFI_IPv4_ADDRESS));
+  CopyMem (&Tcp4Config.AccessPoint.SubnetMask, &Config->SubnetMask, sizeof (EFI_IPv4_ADDRESS));
+  CopyMem (&Tcp4Config.AccessPoint.RemoteAddress, &Config->RemoteAddr[Volume->Replica], sizeof (EFI_IPv4_ADDRESS));
 
-  CopyMem (&Tcp4Config->AccessPoint.StationAddress, &StationAddr, sizeof (EFI_IPv4_ADDRESS));
-  CopyMem (&Tcp4Config->AccessPoint.SubnetMask, &SubnetMask, sizeof (EFI_IPv4_ADDRESS));
-  CopyMem (&Tcp4Config->AccessPoint.RemoteAddress, &RemoteAddr, sizeof (EFI_IPv4_ADDRESS));
-
-  Status = Volume->Tcp4->Configure (Volume->Tcp4, Tcp4Config);
+  Status = Volume->Tcp4->Configure (Volume->Tcp4, &Tcp4Config);
   if (EFI_ERROR (Status)) {
-    goto Done;
-  } else {
-    Volume->IsConfigured = TRUE;
-  }
-
-Done:
-  if (EFI_ERROR (Status) && Tcp4Config != NULL) {
-    FreePool (Tcp4Config);
+    return Status;
   }
 
-  if (EFI_ERROR (Status) && ControlOption != NULL) {
-    FreePool (ControlOption);
-  }
+  Volume->IsConfigured = TRUE;
 
-  return Status;
-}
\ No newline at end of file
+  return EFI_SUCCESS;
+}
@@ -8,27 +8,24 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 #include "9pLib.h"
 
-VOID
-EFIAPI
-P9ConnectionCallback (
-  IN EFI_EVENT  Event,
-  IN VOID       *Context
-  )
-{
-  P9_CONNECT_PRIVATE_DATA *Connect;
+/**
 
-  Connect = (P9_CONNECT_PRIVATE_DATA *)Context;
-  Connect->IsConnectDone = TRUE;
-  gBS->CloseEvent (Connect->ConnectionToken.CompletionToken.Event);
-}
+  Starts connecting the volume to the server without waiting for the
+  connection to be established.
 
+  @param  Volume                - The configured 9P volume.
+
+  @retval EFI_SUCCESS           - The connection is being established.
+  @retval EFI_ALREADY_STARTED   - The volume is not in the closed state.
+  @return Others                - The connection could not be started.
+
+**/
 EFI_STATUS
-ConnectP9 (
+P9StartConnect (
   IN P9_VOLUME              *Volume
-)
+  )
 {
   EFI_STATUS                Status;
-  P9_CONNECT_PRIVATE_DATA   *Connect;
   EFI_TCP4_CONNECTION_STATE Tcp4State;
 
   Status = Volume->Tcp4->GetModeData (
@@ -41,55 +38,130 @@ ConnectP9 (
       );
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
-    goto Exit;
+    return Status;
   }
 
   if (Tcp4State != Tcp4StateClosed) {
     DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
-    Status = EFI_ALREADY_STARTED;
-    goto Exit;
+    return EFI_ALREADY_STARTED;
   }
 
-  Connect = AllocateZeroPool (sizeof (P9_CONNECT_PRIVATE_DATA));
-  if (Connect == NULL) {
+  Status = gBS->CreateEvent (0, 0, NULL, NULL, &Volume->ConnectToken.CompletionToken.Event);
+  if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
+    return Status;
   }
 
-  Status = gBS->CreateEvent (
-      EVT_NOTIFY_SIGNAL,
-      TPL_CALLBACK,
-      P9ConnectionCallback,
-      Connect,
-      &Connect->ConnectionToken.CompletionToken.Event
-      );
+  Volume->ConnectDeadline = P9GetTick () + P9_REQUEST_TIMEOUT;
+  Status = Volume->Tcp4->Connect (Volume->Tcp4, &Volume->ConnectToken);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
-    goto Exit;
+    gBS->CloseEvent (Volume->ConnectToken.CompletionToken.Event);
+    Volume->ConnectToken.CompletionToken.Event = NULL;
+    return Status;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Checks whether a connection started by P9StartConnect is established. A
+  connection not established within P9_REQUEST_TIMEOUT ticks of its start
+  is reset.
+
+  @param  Volume                - The 9P volume.
+  @param  Wait                  - Whether to block until the connection is
+                                  established or fails.
+
+  @retval EFI_SUCCESS           - The connection is established.
+  @retval EFI_NOT_READY         - Wait is FALSE and the connection is still
+                                  being established.
+  @retval EFI_TIMEOUT           - The connection was not established in time.
+  @return Others                - The connection failed.
+
+**/
+EFI_STATUS
+P9CheckConnect (
+  IN P9_VOLUME              *Volume,
+  IN BOOLEAN                Wait
+  )
+{
+  EFI_STATUS                Status;
+
+  for (;;) {
+    Volume->Tcp4->Poll (Volume->Tcp4);
+    if (!EFI_ERROR (gBS->CheckEvent (Volume->ConnectToken.CompletionToken.Event))) {
+      break;
+    }
+    if (P9GetTick () >= Volume->ConnectDeadline) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, EFI_TIMEOUT));
+      P9ResetConnection (Volume);
+      return EFI_TIMEOUT;
+    }
+    if (!Wait) {
+      return EFI_NOT_READY;
+    }
   }
 
-  Connect->IsConnectDone = FALSE;
-  Status = Volume->Tcp4->Connect (Volume->Tcp4, &Connect->ConnectionToken);
+  gBS->CloseEvent (Volume->ConnectToken.CompletionToken.Event);
+  Volume->ConnectToken.CompletionToken.Event = NULL;
+
+  Status = Volume->ConnectToken.CompletionToken.Status;
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
-    goto Exit;
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
   }
 
-  while (!Connect->IsConnectDone) {
-    Volume->Tcp4->Poll (Volume->Tcp4);
+  return Status;
+}
+
+EFI_STATUS
+ConnectP9 (
+  IN P9_VOLUME              *Volume
+)
+{
+  EFI_STATUS                Status;
+
+  Status = P9StartConnect (Volume);
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
 
-  if (EFI_ERROR (Connect->ConnectionToken.CompletionToken.Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
-    Status = Connect->ConnectionToken.CompletionToken.Status;
-    goto Exit;
+  return P9CheckConnect (Volume, TRUE);
+}
+
+/**
+
+  Closes the TCP connection of a volume and drops the receive state, leaving
+  the TCP instance unconfigured for ConfigureP9. Requests still queued are
+  left to their owners, their next wait fails.
+
+  @param  Volume                - The 9P volume.
+
+**/
+VOID
+P9ResetConnection (
+  IN OUT P9_VOLUME          *Volume
+  )
+{
+  if (Volume->Tcp4 != NULL && Volume->IsConfigured) {
+    Volume->Tcp4->Configure (Volume->Tcp4, NULL);
   }
 
-Exit:
-  if (Connect != NULL) {
-    FreePool (Connect);
+  if (Volume->ConnectToken.CompletionToken.Event != NULL) {
+    gBS->CloseEvent (Volume->ConnectToken.CompletionToken.Event);
+    Volume->ConnectToken.CompletionToken.Event = NULL;
   }
 
-  return Status;
-}
\ No newline at end of file
+  //
+  // Resetting the instance signals a posted receive with EFI_ABORTED; clear
+  // the event so that the next receive is not taken as complete.
+  //
+  if (Volume->IsRxPosted) {
+    gBS->CheckEvent (Volume->RxIoToken.CompletionToken.Event);
+  }
+
+  Volume->IsConfigured   = FALSE;
+  Volume->IsRxPosted     = FALSE;
+  Volume->RxHeaderLength = 0;
+}
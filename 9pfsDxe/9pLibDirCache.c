@@ -0,0 +1,210 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+/**
+
+  Drops a reference to a directory listing, freeing it with the last one.
+
+  @param  Snapshot              - The directory listing.
+
+**/
+VOID
+P9ReleaseDirSnapshot (
+  IN P9_DIR_SNAPSHOT    *Snapshot
+  )
+{
+  if (--Snapshot->RefCount != 0) {
+    return;
+  }
+
+  if (Snapshot->Entries != NULL) {
+    FreePool (Snapshot->Entries);
+  }
+  FreePool (Snapshot);
+}
+
+/**
+
+  Appends an entry to a directory listing being recorded.
+
+  @param  Snapshot              - The directory listing.
+  @param  FileInfo              - File info of the entry.
+
+  @retval EFI_SUCCESS           - The entry is appended.
+  @retval EFI_BUFFER_TOO_SMALL  - The listing would grow over
+                                  P9_DIR_CACHE_MAX_SIZE.
+  @retval EFI_OUT_OF_RESOURCES  - The listing could not be grown.
+
+**/
+EFI_STATUS
+P9AppendDirEntry (
+  IN OUT P9_DIR_SNAPSHOT  *Snapshot,
+  IN EFI_FILE_INFO        *FileInfo
+  )
+{
+  UINT8                         *Entries;
+  UINTN                         Size;
+  UINTN                         MaxSize;
+
+  Size = ALIGN_VALUE ((UINTN)FileInfo->Size, 8);
+  if (Snapshot->Size + Size > P9_DIR_CACHE_MAX_SIZE) {
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  MaxSize = MAX (Snapshot->MaxSize, EFI_PAGE_SIZE);
+  while (Snapshot->Size + Size > MaxSize) {
+    MaxSize *= 2;
+  }
+
+  if (MaxSize != Snapshot->MaxSize) {
+    Entries = ReallocatePool (Snapshot->MaxSize, MaxSize, Snapshot->Entries);
+    if (Entries == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    Snapshot->Entries = Entries;
+    Snapshot->MaxSize = MaxSize;
+  }
+
+  CopyMem (Snapshot->Entries + Snapshot->Size, FileInfo, (UINTN)FileInfo->Size);
+  Snapshot->Size += Size;
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Removes a listing from the cache of a volume.
+
+**/
+VOID
+P9EvictDirSnapshot (
+  IN P9_VOLUME          *Volume,
+  IN UINTN              Index
+  )
+{
+  P9ReleaseDirSnapshot (Volume->DirCache[Index]);
+  Volume->DirCache[Index] = NULL;
+}
+
+/**
+
+  Finds the cached listing of an open directory, if the directory did not
+  change since it was read. Once P9_DIR_CACHE_TTL passed since the last
+  check, the qid version of the directory is checked with a Tgetattr before
+  the listing is used.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The open directory.
+  @param  Snapshot              - Gets a reference to the listing.
+
+  @retval EFI_SUCCESS           - Snapshot holds the listing.
+  @retval EFI_NOT_FOUND         - The directory has to be read.
+  @return Others                - The directory could not be checked.
+
+**/
+EFI_STATUS
+P9LookupDirSnapshot (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *IFile,
+  OUT P9_DIR_SNAPSHOT   **Snapshot
+  )
+{
+  EFI_STATUS                    Status;
+  P9_DIR_SNAPSHOT               *Cached;
+  UINTN                         Index;
+
+  for (Index = 0; Index < P9_DIR_CACHE_SIZE; Index++) {
+    Cached = Volume->DirCache[Index];
+    if (Cached == NULL || Cached->Qid.Path != IFile->Qid.Path) {
+      continue;
+    }
+
+    if (P9GetTick () - Cached->CheckedAt >= P9_DIR_CACHE_TTL) {
+      Status = P9GetAttr (Volume, IFile);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+      if (Cached->Qid.Version != IFile->Qid.Version) {
+        P9EvictDirSnapshot (Volume, Index);
+        return EFI_NOT_FOUND;
+      }
+      Cached->CheckedAt = P9GetTick ();
+    }
+
+    Cached->LastUsed = P9GetTick ();
+    Cached->RefCount++;
+    *Snapshot = Cached;
+    return EFI_SUCCESS;
+  }
+
+  return EFI_NOT_FOUND;
+}
+
+/**
+
+  Keeps a recorded listing in the cache of a volume, in place of an older
+  listing of the same directory or else the listing used least recently.
+
+  @param  Volume                - The 9P volume.
+  @param  Snapshot              - The listing. The cache takes over the
+                                  reference of the caller.
+
+**/
+VOID
+P9CacheDirSnapshot (
+  IN P9_VOLUME          *Volume,
+  IN P9_DIR_SNAPSHOT    *Snapshot
+  )
+{
+  UINTN                         Index;
+  UINTN                         Victim;
+
+  Snapshot->CheckedAt = P9GetTick ();
+  Snapshot->LastUsed  = Snapshot->CheckedAt;
+
+  Victim = 0;
+  for (Index = 0; Index < P9_DIR_CACHE_SIZE; Index++) {
+    if (Volume->DirCache[Index] == NULL ||
+        Volume->DirCache[Index]->Qid.Path == Snapshot->Qid.Path) {
+      Victim = Index;
+      break;
+    }
+    if (Volume->DirCache[Index]->LastUsed < Volume->DirCache[Victim]->LastUsed) {
+      Victim = Index;
+    }
+  }
+
+  if (Volume->DirCache[Victim] != NULL) {
+    P9EvictDirSnapshot (Volume, Victim);
+  }
+  Volume->DirCache[Victim] = Snapshot;
+}
+
+/**
+
+  Drops the listings cached by a volume. Handles keep the listings they are
+  enumerating.
+
+  @param  Volume                - The 9P volume.
+
+**/
+VOID
+P9ResetDirCache (
+  IN P9_VOLUME          *Volume
+  )
+{
+  UINTN                         Index;
+
+  for (Index = 0; Index < P9_DIR_CACHE_SIZE; Index++) {
+    if (Volume->DirCache[Index] != NULL) {
+      P9EvictDirSnapshot (Volume, Index);
+    }
+  }
+}
@@ -0,0 +1,573 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+EFI_UNICODE_COLLATION_PROTOCOL  *mUnicodeCollation = NULL;
+
+/**
+
+  Locates the Unicode Collation 2 instance that supports the platform
+  language, or else the first instance.
+
+  @retval EFI_SUCCESS           - mUnicodeCollation is set.
+  @return Others                - No instance is installed.
+
+**/
+EFI_STATUS
+P9LocateUnicodeCollation (
+  VOID
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_HANDLE                      *Handles;
+  UINTN                           HandleCount;
+  UINTN                           Index;
+  EFI_UNICODE_COLLATION_PROTOCOL  *Collation;
+  CHAR8                           *PlatformLang;
+  CHAR8                           *BestLanguage;
+
+  if (mUnicodeCollation != NULL) {
+    return EFI_SUCCESS;
+  }
+
+  Status = gBS->LocateHandleBuffer (
+                  ByProtocol,
+                  &gEfiUnicodeCollation2ProtocolGuid,
+                  NULL,
+                  &HandleCount,
+                  &Handles
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  PlatformLang = NULL;
+  GetEfiGlobalVariable2 (L"PlatformLang", (VOID **)&PlatformLang, NULL);
+
+  for (Index = 0; Index < HandleCount; Index++) {
+    Status = gBS->HandleProtocol (Handles[Index], &gEfiUnicodeCollation2ProtocolGuid, (VOID **)&Collation);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    if (mUnicodeCollation == NULL) {
+      mUnicodeCollation = Collation;
+    }
+
+    BestLanguage = GetBestLanguage (
+                     Collation->SupportedLanguages,
+                     FALSE,
+                     (PlatformLang != NULL) ? PlatformLang : "",
+                     (CHAR8 *)PcdGetPtr (PcdUefiVariableDefaultPlatformLang),
+                     NULL
+                     );
+    if (BestLanguage != NULL) {
+      FreePool (BestLanguage);
+      mUnicodeCollation = Collation;
+      break;
+    }
+  }
+
+  if (PlatformLang != NULL) {
+    FreePool (PlatformLang);
+  }
+  FreePool (Handles);
+
+  return (mUnicodeCollation != NULL) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+/**
+
+  Hashes a name regardless of its case.
+
+  @param  Name                  - The name.
+  @param  Length                - Length of the name, at most P9_MAX_FLEN.
+
+  @return The hash of the upper case form of the name.
+
+**/
+UINT32
+P9HashName (
+  IN CHAR16             *Name,
+  IN UINTN              Length
+  )
+{
+  CHAR16      Upper[P9_MAX_FLEN + 1];
+  UINT32      Hash;
+  UINTN       Index;
+
+  CopyMem (Upper, Name, Length * sizeof (CHAR16));
+  Upper[Length] = L'\0';
+  mUnicodeCollation->StrUpr (mUnicodeCollation, Upper);
+
+  //
+  // FNV-1a
+  //
+  Hash = 2166136261U;
+  for (Index = 0; Index < Length; Index++) {
+    Hash = (Hash ^ Upper[Index]) * 16777619U;
+  }
+
+  return Hash;
+}
+
+/**
+
+  Frees the names of a directory index.
+
+**/
+VOID
+P9FreeDirIndex (
+  IN OUT P9_DIR_INDEX   *Index
+  )
+{
+  if (Index->Path != NULL) {
+    FreePool (Index->Path);
+  }
+  if (Index->Names != NULL) {
+    FreePool (Index->Names);
+  }
+  if (Index->Slots != NULL) {
+    FreePool (Index->Slots);
+  }
+  ZeroMem (Index, sizeof (P9_DIR_INDEX));
+}
+
+/**
+
+  Puts the name at Offset in Names into a free slot.
+
+**/
+VOID
+P9InsertIndexSlot (
+  IN OUT P9_DIR_INDEX   *Index,
+  IN UINTN              Offset
+  )
+{
+  UINTN       Slot;
+
+  Slot = P9HashName (&Index->Names[Offset], StrLen (&Index->Names[Offset])) & (Index->SlotCount - 1);
+  while (Index->Slots[Slot] != 0) {
+    Slot = (Slot + 1) & (Index->SlotCount - 1);
+  }
+
+  Index->Slots[Slot] = (UINT32)(Offset + 1);
+}
+
+/**
+
+  Adds a name read from the directory to its index, growing the name buffer
+  and the slots as needed. Slots are kept at most half used.
+
+  @param  Index                 - The directory index.
+  @param  Name                  - The name, as sent by the server.
+
+  @retval EFI_SUCCESS           - The name is indexed.
+  @retval EFI_OUT_OF_RESOURCES  - The index could not be grown.
+
+**/
+EFI_STATUS
+P9AddIndexName (
+  IN OUT P9_DIR_INDEX   *Index,
+  IN P9String           *Name
+  )
+{
+  CHAR16      *Names;
+  UINT32      *Slots;
+  UINTN       NamesMax;
+  UINTN       SlotCount;
+  UINTN       Offset;
+  UINTN       Length;
+
+  NamesMax = MAX (Index->NamesMax, 4096);
+  while (Index->NamesLength + Name->Size + 1 > NamesMax) {
+    NamesMax *= 2;
+  }
+
+  if (NamesMax != Index->NamesMax) {
+    Names = ReallocatePool (
+              Index->NamesMax * sizeof (CHAR16),
+              NamesMax * sizeof (CHAR16),
+              Index->Names
+              );
+    if (Names == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    Index->Names    = Names;
+    Index->NamesMax = NamesMax;
+  }
+
+  if ((Index->NameCount + 1) * 2 > Index->SlotCount) {
+    SlotCount = MAX (Index->SlotCount * 2, 256);
+    Slots = AllocateZeroPool (SlotCount * sizeof (UINT32));
+    if (Slots == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    if (Index->Slots != NULL) {
+      FreePool (Index->Slots);
+    }
+    Index->Slots     = Slots;
+    Index->SlotCount = SlotCount;
+    for (Offset = 0; Offset < Index->NamesLength; Offset += Length + 1) {
+      Length = StrLen (&Index->Names[Offset]);
+      P9InsertIndexSlot (Index, Offset);
+    }
+  }
+
+  Offset = Index->NamesLength;
+  P9StringToUnicodeStrS (Name, &Index->Names[Offset], Name->Size + 1);
+  Index->NamesLength += StrLen (&Index->Names[Offset]) + 1;
+  Index->NameCount++;
+  P9InsertIndexSlot (Index, Offset);
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Finds a name in a directory index regardless of its case.
+
+  @param  Index                 - The directory index.
+  @param  Name                  - The NUL-terminated name.
+  @param  Length                - Length of the name, at most P9_MAX_FLEN.
+
+  @return The name as stored in the directory, or NULL.
+
+**/
+CHAR16 *
+P9FindIndexName (
+  IN P9_DIR_INDEX       *Index,
+  IN CHAR16             *Name,
+  IN UINTN              Length
+  )
+{
+  CHAR16      *Found;
+  UINTN       Slot;
+
+  if (Index->SlotCount == 0) {
+    return NULL;
+  }
+
+  Slot = P9HashName (Name, Length) & (Index->SlotCount - 1);
+  while (Index->Slots[Slot] != 0) {
+    Found = &Index->Names[Index->Slots[Slot] - 1];
+    if (mUnicodeCollation->StriColl (mUnicodeCollation, Found, Name) == 0) {
+      return Found;
+    }
+    Slot = (Slot + 1) & (Index->SlotCount - 1);
+  }
+
+  return NULL;
+}
+
+/**
+
+  Reads the names of a directory into its index, in Treaddir batches of up
+  to the negotiated msize.
+
+  @param  Volume                - The 9P volume.
+  @param  Index                 - The empty directory index.
+  @param  Fid                   - An unopened fid of the directory. It is
+                                  opened, and left to the caller to clunk.
+
+  @retval EFI_SUCCESS           - The directory is indexed.
+  @return Others                - The directory could not be read.
+
+**/
+EFI_STATUS
+P9BuildDirIndex (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_DIR_INDEX   *Index,
+  IN UINT32             Fid
+  )
+{
+  EFI_STATUS                    Status;
+  P9_IFILE                      *Dir;
+  UINT8                         *Buffer;
+  UINT8                         *End;
+  P9DirEnt                      *DirEnt;
+  UINT32                        BufferSize;
+  UINT32                        Count;
+  UINT64                        Offset;
+
+  Buffer = NULL;
+
+  Dir = AllocateZeroPool (sizeof (P9_IFILE));
+  if (Dir == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto Exit;
+  }
+
+  Dir->Fid   = Fid;
+  Dir->Flags = O_RDONLY;
+  Status = P9LOpen (Volume, Dir);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  BufferSize = Volume->MSize - sizeof (P9RReadDir);
+  if (Dir->IoUnit != 0 && Dir->IoUnit < BufferSize) {
+    BufferSize = Dir->IoUnit;
+  }
+
+  Buffer = AllocatePool (BufferSize);
+  if (Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto Exit;
+  }
+
+  Offset = 0;
+  do {
+    Count = BufferSize;
+    Status = P9LReadDir (Volume, Dir, Offset, &Count, Buffer);
+    if (EFI_ERROR (Status)) {
+      goto Exit;
+    }
+
+    End    = Buffer + Count;
+    DirEnt = (P9DirEnt *)Buffer;
+    while ((UINT8 *)DirEnt + sizeof (P9DirEnt) <= End &&
+           DirEnt->Name.String + DirEnt->Name.Size <= (CHAR8 *)End) {
+      Offset = DirEnt->Offset;
+      if (DirEnt->Name.Size <= P9_MAX_FLEN &&
+          !(DirEnt->Name.Size == 1 && DirEnt->Name.String[0] == '.') &&
+          !(DirEnt->Name.Size == 2 && DirEnt->Name.String[0] == '.' && DirEnt->Name.String[1] == '.')) {
+        Status = P9AddIndexName (Index, &DirEnt->Name);
+        if (EFI_ERROR (Status)) {
+          goto Exit;
+        }
+      }
+      DirEnt = (P9DirEnt *)(DirEnt->Name.String + DirEnt->Name.Size);
+    }
+
+    //
+    // A reply that does not hold a whole entry would be asked for again.
+    //
+    if (Count != 0 && (UINT8 *)DirEnt == Buffer) {
+      Status = EFI_DEVICE_ERROR;
+      goto Exit;
+    }
+  } while (Count != 0);
+
+Exit:
+  if (Dir != NULL) {
+    FreePool (Dir);
+  }
+
+  if (Buffer != NULL) {
+    FreePool (Buffer);
+  }
+
+  return Status;
+}
+
+/**
+
+  Finds the index of the directory at the first PathLength characters of
+  Path.
+
+**/
+P9_DIR_INDEX *
+P9LookupDirIndex (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN CHAR16             *Path,
+  IN UINTN              PathLength
+  )
+{
+  P9_DIR_INDEX                  *Index;
+  UINTN                         Entry;
+
+  for (Entry = 0; Entry < P9_DIR_INDEX_CACHE_SIZE; Entry++) {
+    Index = &Volume->DirIndex[Entry];
+    if (Index->Path != NULL && Index->RootFid == RootFid &&
+        StrLen (Index->Path) == PathLength &&
+        StrnCmp (Index->Path, Path, PathLength) == 0) {
+      Index->LastUsed = P9GetTick ();
+      return Index;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+
+  Returns a free directory index, freeing the one used least recently when
+  all of them are in use.
+
+**/
+P9_DIR_INDEX *
+P9AllocateDirIndex (
+  IN P9_VOLUME          *Volume
+  )
+{
+  P9_DIR_INDEX                  *Index;
+  P9_DIR_INDEX                  *Victim;
+  UINTN                         Entry;
+
+  Victim = &Volume->DirIndex[0];
+  for (Entry = 0; Entry < P9_DIR_INDEX_CACHE_SIZE; Entry++) {
+    Index = &Volume->DirIndex[Entry];
+    if (Index->Path == NULL) {
+      return Index;
+    }
+    if (Index->LastUsed < Victim->LastUsed) {
+      Victim = Index;
+    }
+  }
+
+  P9FreeDirIndex (Victim);
+
+  return Victim;
+}
+
+/**
+
+  Corrects the case of the name a walk did not find, from the index of the
+  directory it is in. The directory is read into an index when it has none,
+  and read again when its qid version changed since.
+
+  @param  Volume                - The 9P volume.
+  @param  Root                  - The root directory of the export.
+  @param  FullPath              - Absolute path that was walked. The name
+                                  after the walked part is corrected in
+                                  place.
+  @param  WalkedLength          - Length of the part of FullPath walked.
+
+  @retval EFI_SUCCESS           - The name was corrected.
+  @retval EFI_NOT_FOUND         - The directory has no such name in any case.
+  @return Others                - The directory could not be read.
+
+**/
+EFI_STATUS
+P9FixNameCase (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *Root,
+  IN OUT CHAR16         *FullPath,
+  IN UINTN              WalkedLength
+  )
+{
+  EFI_STATUS                    Status;
+  P9_DIR_INDEX                  *Index;
+  CHAR16                        *Name;
+  CHAR16                        *Found;
+  CHAR16                        *DirPath;
+  CHAR16                        Folded[P9_MAX_FLEN + 1];
+  UINTN                         NameLength;
+  UINTN                         DirLength;
+  UINT32                        Fid;
+  Qid                           DirQid;
+
+  Name       = P9SkipNames (FullPath + WalkedLength, 0);
+  NameLength = P9NameLength (Name);
+  if (NameLength == 0 || NameLength > P9_MAX_FLEN) {
+    return EFI_NOT_FOUND;
+  }
+
+  Status = P9LocateUnicodeCollation ();
+  if (EFI_ERROR (Status)) {
+    return EFI_NOT_FOUND;
+  }
+
+  CopyMem (Folded, Name, NameLength * sizeof (CHAR16));
+  Folded[NameLength] = L'\0';
+
+  //
+  // FullPath starts with a separator, which is the path of the root.
+  //
+  for (DirLength = WalkedLength; DirLength > 1 && FullPath[DirLength - 1] == PATH_NAME_SEPARATOR; DirLength--) {
+  }
+
+  Index = P9LookupDirIndex (Volume, Root->Fid, FullPath, DirLength);
+  Found = NULL;
+  if (Index != NULL) {
+    Found = P9FindIndexName (Index, Folded, NameLength);
+  }
+
+  //
+  // A name the index does not have, or has in the same case, may have been
+  // created or removed since the directory was read.
+  //
+  if (Found == NULL || StrCmp (Found, Folded) == 0) {
+    DirPath = AllocateCopyPool ((DirLength + 1) * sizeof (CHAR16), FullPath);
+    if (DirPath == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    DirPath[DirLength] = L'\0';
+
+    // A clone of the root returns no qid.
+    CopyMem (&DirQid, &Root->Qid, QID_SIZE);
+    Fid = GetFid ();
+    Status = P9WalkFid (Volume, Root->Fid, Fid, DirPath, &DirQid, NULL);
+    if (EFI_ERROR (Status)) {
+      FreePool (DirPath);
+      return Status;
+    }
+
+    if (Index != NULL &&
+        Index->Qid.Path == DirQid.Path &&
+        Index->Qid.Version == DirQid.Version) {
+      P9ClunkFid (Volume, Fid);
+      FreePool (DirPath);
+      return EFI_NOT_FOUND;
+    }
+
+    if (Index != NULL) {
+      P9FreeDirIndex (Index);
+    } else {
+      Index = P9AllocateDirIndex (Volume);
+    }
+
+    Index->Path     = DirPath;
+    Index->RootFid  = Root->Fid;
+    Index->LastUsed = P9GetTick ();
+    CopyMem (&Index->Qid, &DirQid, QID_SIZE);
+
+    Status = P9BuildDirIndex (Volume, Index, Fid);
+    P9ClunkFid (Volume, Fid);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+      P9FreeDirIndex (Index);
+      return Status;
+    }
+
+    Found = P9FindIndexName (Index, Folded, NameLength);
+    if (Found == NULL || StrCmp (Found, Folded) == 0) {
+      return EFI_NOT_FOUND;
+    }
+  }
+
+  if (StrLen (Found) != NameLength) {
+    return EFI_NOT_FOUND;
+  }
+
+  CopyMem (Name, Found, NameLength * sizeof (CHAR16));
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Frees the directory indexes of a connection.
+
+  @param  Volume                - The 9P volume.
+
+**/
+VOID
+P9ResetDirIndexes (
+  IN P9_VOLUME          *Volume
+  )
+{
+  UINTN                         Index;
+
+  for (Index = 0; Index < P9_DIR_INDEX_CACHE_SIZE; Index++) {
+    P9FreeDirIndex (&Volume->DirIndex[Index]);
+  }
+}
@@ -0,0 +1,381 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+//
+// A background clone. The reply, an Rwalk without qids or an Rlerror, is
+// received into RxWalk.
+//
+typedef struct {
+  P9_REQUEST                Request;
+  P9TWalk                   TxWalk;
+  P9RLError                 RxWalk;
+} P9_CLONE_PRIVATE_DATA;
+
+/**
+
+  Frees a cache entry without clunking its fid.
+
+**/
+VOID
+P9FreeCachedFid (
+  IN OUT P9_CACHED_FID  *Entry
+  )
+{
+  if (Entry->Token.Event != NULL) {
+    gBS->CloseEvent (Entry->Token.Event);
+  }
+  if (Entry->Path != NULL) {
+    FreePool (Entry->Path);
+  }
+  ZeroMem (Entry, sizeof (P9_CACHED_FID));
+}
+
+/**
+
+  Tells whether a cache entry holds a usable fid. An entry whose background
+  clone failed is freed.
+
+**/
+BOOLEAN
+P9IsCachedFidReady (
+  IN OUT P9_CACHED_FID  *Entry
+  )
+{
+  if (Entry->Path == NULL) {
+    return FALSE;
+  }
+
+  if (Entry->Token.Event == NULL) {
+    return TRUE;
+  }
+
+  if (gBS->CheckEvent (Entry->Token.Event) != EFI_SUCCESS) {
+    return FALSE;
+  }
+
+  gBS->CloseEvent (Entry->Token.Event);
+  Entry->Token.Event = NULL;
+  if (EFI_ERROR (Entry->Token.Status)) {
+    P9FreeCachedFid (Entry);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+
+  Finds the cached fid of the directory at the first PathLength characters
+  of Path.
+
+  @param  Volume                - The 9P volume.
+  @param  RootFid               - The root fid of the export.
+  @param  Path                  - Absolute path of the directory.
+  @param  PathLength            - Length of the path in Path.
+
+  @return The cache entry, or NULL if the directory has no usable fid.
+
+**/
+P9_CACHED_FID *
+P9LookupFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN CHAR16             *Path,
+  IN UINTN              PathLength
+  )
+{
+  P9_CACHED_FID                 *Entry;
+  UINTN                         Index;
+
+  for (Index = 0; Index < P9_FID_CACHE_SIZE; Index++) {
+    Entry = &Volume->FidCache[Index];
+    if (Entry->Path != NULL && Entry->RootFid == RootFid &&
+        StrLen (Entry->Path) == PathLength &&
+        StrnCmp (Entry->Path, Path, PathLength) == 0 &&
+        P9IsCachedFidReady (Entry)) {
+      Entry->LastUsed = P9GetTick ();
+      return Entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+
+  Finds the deepest directory above Path, or Path itself, that has a cached
+  fid. The root has no entry, its own fid is used instead.
+
+  @param  Volume                - The 9P volume.
+  @param  RootFid               - The root fid of the export.
+  @param  Path                  - Absolute path as built by P9BuildPath().
+
+  @return The cache entry, or NULL if no directory on the path is cached.
+
+**/
+P9_CACHED_FID *
+P9LookupAncestorFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN CHAR16             *Path
+  )
+{
+  P9_CACHED_FID                 *Entry;
+  P9_CACHED_FID                 *Ancestor;
+  UINTN                         Length;
+  UINTN                         AncestorLength;
+  UINTN                         Index;
+
+  Ancestor       = NULL;
+  AncestorLength = 1;
+  for (Index = 0; Index < P9_FID_CACHE_SIZE; Index++) {
+    Entry = &Volume->FidCache[Index];
+    if (Entry->Path == NULL || Entry->RootFid != RootFid) {
+      continue;
+    }
+
+    Length = StrLen (Entry->Path);
+    if (Length > AncestorLength &&
+        StrnCmp (Entry->Path, Path, Length) == 0 &&
+        (Path[Length] == L'\0' || Path[Length] == PATH_NAME_SEPARATOR) &&
+        P9IsCachedFidReady (Entry)) {
+      Ancestor       = Entry;
+      AncestorLength = Length;
+    }
+  }
+
+  if (Ancestor != NULL) {
+    Ancestor->LastUsed = P9GetTick ();
+  }
+
+  return Ancestor;
+}
+
+/**
+
+  Returns a free cache entry, making room by clunking the fid used least
+  recently when the cache is full. Entries being cloned are not evicted.
+
+**/
+P9_CACHED_FID *
+P9AllocateCachedFid (
+  IN P9_VOLUME          *Volume
+  )
+{
+  P9_CACHED_FID                 *Entry;
+  P9_CACHED_FID                 *Victim;
+  UINTN                         Index;
+
+  Victim = NULL;
+  for (Index = 0; Index < P9_FID_CACHE_SIZE; Index++) {
+    Entry = &Volume->FidCache[Index];
+    if (Entry->Path == NULL) {
+      return Entry;
+    }
+    if (Entry->Token.Event == NULL &&
+        (Victim == NULL || Entry->LastUsed < Victim->LastUsed)) {
+      Victim = Entry;
+    }
+  }
+
+  if (Victim != NULL) {
+    P9ClunkFid (Volume, Victim->Fid);
+    P9FreeCachedFid (Victim);
+  }
+
+  return Victim;
+}
+
+/**
+
+  Keeps an unopened fid of a directory in the cache, which then owns it.
+
+  @param  Volume                - The 9P volume.
+  @param  RootFid               - The root fid of the export.
+  @param  Fid                   - The fid of the directory.
+  @param  Path                  - Absolute path of the directory.
+  @param  PathLength            - Length of the path in Path.
+  @param  FidQid                - The qid of the directory.
+
+  @retval EFI_SUCCESS           - The fid is cached.
+  @return Others                - The fid is not cached and still owned by
+                                  the caller.
+
+**/
+EFI_STATUS
+P9CacheFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN UINT32             Fid,
+  IN CHAR16             *Path,
+  IN UINTN              PathLength,
+  IN Qid                *FidQid
+  )
+{
+  P9_CACHED_FID                 *Entry;
+
+  Entry = P9AllocateCachedFid (Volume);
+  if (Entry == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Entry->Path = AllocateZeroPool ((PathLength + 1) * sizeof (CHAR16));
+  if (Entry->Path == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  CopyMem (Entry->Path, Path, PathLength * sizeof (CHAR16));
+  CopyMem (&Entry->Qid, FidQid, QID_SIZE);
+  Entry->RootFid  = RootFid;
+  Entry->Fid      = Fid;
+  Entry->LastUsed = P9GetTick ();
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Removes a usable fid from the cache and passes it to the caller.
+
+  @param  Entry                 - The cache entry.
+  @param  Fid                   - The fid, now owned by the caller.
+  @param  FidQid                - The qid of the directory.
+
+**/
+VOID
+P9TakeCachedFid (
+  IN OUT P9_CACHED_FID  *Entry,
+  OUT UINT32            *Fid,
+  OUT Qid               *FidQid
+  )
+{
+  *Fid = Entry->Fid;
+  CopyMem (FidQid, &Entry->Qid, QID_SIZE);
+  P9FreeCachedFid (Entry);
+}
+
+/**
+
+  Clones Fid in the background into a new cache entry for Path, so that the
+  next clone of the directory is handed out without a round trip. Nothing is
+  done if the directory already has an entry.
+
+  @param  Volume                - The 9P volume.
+  @param  RootFid               - The root fid of the export.
+  @param  Fid                   - The fid of the directory to clone.
+  @param  Path                  - Absolute path of the directory.
+  @param  FidQid                - The qid of the directory.
+
+  @retval EFI_SUCCESS           - The clone is sent, or not needed.
+  @return Others                - The clone could not be sent.
+
+**/
+EFI_STATUS
+P9CacheClone (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             RootFid,
+  IN UINT32             Fid,
+  IN CHAR16             *Path,
+  IN Qid                *FidQid
+  )
+{
+  EFI_STATUS                    Status;
+  P9_CACHED_FID                 *Entry;
+  P9_CLONE_PRIVATE_DATA         *Clone;
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+  UINTN                         TxSize;
+  UINTN                         Index;
+
+  for (Index = 0; Index < P9_FID_CACHE_SIZE; Index++) {
+    Entry = &Volume->FidCache[Index];
+    if (Entry->Path != NULL && Entry->RootFid == RootFid && StrCmp (Entry->Path, Path) == 0) {
+      return EFI_SUCCESS;
+    }
+  }
+
+  Entry = P9AllocateCachedFid (Volume);
+  if (Entry == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Clone = (P9_CLONE_PRIVATE_DATA *)P9AllocateRequest (Volume, sizeof (P9_CLONE_PRIVATE_DATA));
+  if (Clone == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Entry->Path = AllocateCopyPool (StrSize (Path), Path);
+  if (Entry->Path == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto Exit;
+  }
+
+  Status = gBS->CreateEvent (0, 0, NULL, NULL, &Entry->Token.Event);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  CopyMem (&Entry->Qid, FidQid, QID_SIZE);
+  Entry->RootFid  = RootFid;
+  Entry->Fid      = GetFid ();
+  Entry->LastUsed = P9GetTick ();
+
+  P9EncodeMessage (
+    &Clone->TxWalk,
+    sizeof (P9TWalk),
+    Twalk,
+    P9GetTag (Volume),
+    &TxSize,
+    Fid,
+    Entry->Fid,
+    NULL
+    );
+
+  Clone->Request.Tag        = Clone->TxWalk.Header.Tag;
+  Clone->Request.RxData     = &Clone->RxWalk;
+  Clone->Request.RxDataSize = sizeof (P9RLError);
+  Clone->Request.Token      = &Entry->Token;
+
+  Fragment.FragmentLength = (UINT32)TxSize;
+  Fragment.FragmentBuffer = &Clone->TxWalk;
+
+  Status = P9SendRequest (Volume, &Clone->Request, &Fragment, 1);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  return EFI_SUCCESS;
+
+Exit:
+  P9FreeRequest (Volume, &Clone->Request);
+  P9FreeCachedFid (Entry);
+
+  return Status;
+}
+
+/**
+
+  Empties the fid cache of a connection without clunking the fids, after
+  the connection was lost. Background clones must have completed, as after
+  P9AbortRequests().
+
+  @param  Volume                - The 9P volume.
+
+**/
+VOID
+P9ResetFidCache (
+  IN P9_VOLUME          *Volume
+  )
+{
+  UINTN                         Index;
+
+  for (Index = 0; Index < P9_FID_CACHE_SIZE; Index++) {
+    P9FreeCachedFid (&Volume->FidCache[Index]);
+  }
+}
@@ -0,0 +1,93 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+typedef struct {
+  P9_REQUEST                Request;
+  P9TFsync                  TxFsync;
+  P9RLError                 RxFsync;
+} P9_FSYNC_PRIVATE_DATA;
+
+/**
+
+  Sends Tfsync for IFile.
+
+  Without a Token (or with a Token that has no event) the call waits for
+  Rfsync. Otherwise it returns as soon as Tfsync is queued and the reply is
+  reported through Token when the reactor receives it.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The file to synchronize.
+  @param  Token                 - Optional token for asynchronous completion.
+
+  @retval EFI_SUCCESS           - The file was synchronized, or Tfsync is queued.
+  @return Others                - The request failed.
+
+**/
+EFI_STATUS
+P9Fsync (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  IN EFI_FILE_IO_TOKEN  *Token OPTIONAL
+  )
+{
+  EFI_STATUS                    Status;
+  P9_FSYNC_PRIVATE_DATA         *Fsync;
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+  UINTN                         TxSize;
+  BOOLEAN                       IsAsync;
+
+  Fsync = (P9_FSYNC_PRIVATE_DATA *)P9AllocateRequest (Volume, sizeof (P9_FSYNC_PRIVATE_DATA));
+  if (Fsync == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  P9EncodeMessage (
+    &Fsync->TxFsync,
+    sizeof (P9TFsync),
+    Tfsync,
+    P9GetTag (Volume),
+    &TxSize,
+    IFile->Fid,
+    0
+    );
+
+  Fsync->Request.Tag          = Fsync->TxFsync.Header.Tag;
+  Fsync->Request.RxData       = &Fsync->RxFsync;
+  Fsync->Request.RxDataSize   = sizeof (P9RLError);
+  IsAsync = (Token != NULL && Token->Event != NULL);
+  if (IsAsync) {
+    Fsync->Request.Token      = Token;
+  }
+
+  Fragment.FragmentLength = (UINT32)TxSize;
+  Fragment.FragmentBuffer = &Fsync->TxFsync;
+
+  Status = P9SendRequest (Volume, &Fsync->Request, &Fragment, 1);
+  if (EFI_ERROR (Status)) {
+    P9FreeRequest (Volume, &Fsync->Request);
+    return Status;
+  }
+
+  //
+  // The reactor owns asynchronous requests from here on.
+  //
+  if (IsAsync) {
+    return EFI_SUCCESS;
+  }
+
+  Status = P9WaitRequest (Volume, &Fsync->Request);
+  if (!EFI_ERROR (Status)) {
+    Status = P9CheckMessage (Tfsync, &Fsync->RxFsync, Fsync->Request.RxLength);
+  }
+
+  P9FreeRequest (Volume, &Fsync->Request);
+
+  return Status;
+}
@@ -76,60 +76,33 @@ EpochToEfiTime (
 
 }
 
+/**
+
+  Stores an Rgetattr reply in the qid and file info of IFile.
+
+  @param  IFile                 - The file the reply is about.
+  @param  RxGetAttr             - The reply.
+
+  @retval EFI_SUCCESS           - The file info is updated.
+  @retval EFI_OUT_OF_RESOURCES  - Can not allocate the file info.
+
+**/
 EFI_STATUS
-P9GetAttr (
-  IN P9_VOLUME          *Volume,
-  IN OUT P9_IFILE       *IFile
+P9ParseGetAttr (
+  IN OUT P9_IFILE       *IFile,
+  IN P9RGetAttr         *RxGetAttr
   )
 {
-  EFI_STATUS                    Status;
-  P9TGetAttr                    *TxGetAttr;
-  P9RGetAttr                    *RxGetAttr;
   UINTN                         Size;
   EFI_FILE_INFO                 *FileInfo;
 
-  TxGetAttr = AllocateZeroPool (sizeof (P9TGetAttr));
-  if (TxGetAttr == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  TxGetAttr->Header.Size  = sizeof (P9TGetAttr);
-  TxGetAttr->Header.Id    = Tgetattr;
-  TxGetAttr->Header.Tag   = Volume->Tag;
-  TxGetAttr->Fid          = IFile->Fid;
-  TxGetAttr->RequestMask  = P9_GETATTR_ALL;
-
-  RxGetAttr = AllocateZeroPool (sizeof (P9RGetAttr));
-  if (RxGetAttr == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  Status = DoP9 (
-    Volume,
-    TxGetAttr,
-    sizeof (P9TGetAttr),
-    RxGetAttr,
-    sizeof (P9RGetAttr)
-    );
-  if (EFI_ERROR (Status)) {
-    goto Exit;
-  }
-
-  if (RxGetAttr->Header.Id != Rgetattr) {
-    Status = P9Error (RxGetAttr, sizeof (P9RGetAttr));
-    goto Exit;
-  }
-
   Size = SIZE_OF_EFI_FILE_INFO;
   Size += StrSize (IFile->FileName);
 
   if (IFile->FileInfo == NULL) {
     IFile->FileInfo = AllocateZeroPool (Size);
     if (IFile->FileInfo == NULL) {
-      Status = EFI_OUT_OF_RESOURCES;
-      goto Exit;
+      return EFI_OUT_OF_RESOURCES;
     }
   }
 
@@ -148,16 +121,31 @@ P9GetAttr (
   FileInfo->Attribute                    = S_ISDIR (RxGetAttr->Mode) ? EFI_FILE_DIRECTORY : EFI_FILE_ARCHIVE;
   StrCpyS (FileInfo->FileName, StrLen (IFile->FileName) + 1, IFile->FileName);
 
-  Status = EFI_SUCCESS;
+  return EFI_SUCCESS;
+}
 
-Exit:
-  if (TxGetAttr != NULL) {
-    FreePool (TxGetAttr);
-  }
+EFI_STATUS
+P9GetAttr (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *IFile
+  )
+{
+  EFI_STATUS                    Status;
+  P9RGetAttr                    RxGetAttr;
 
-  if (RxGetAttr != NULL) {
-    FreePool (RxGetAttr);
+  Status = P9Rpc (
+    Volume,
+    Tgetattr,
+    &RxGetAttr,
+    sizeof (P9RGetAttr),
+    NULL,
+    0,
+    IFile->Fid,
+    (UINT64)P9_GETATTR_ALL
+    );
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
 
-  return Status;
+  return P9ParseGetAttr (IFile, &RxGetAttr);
 }
@@ -0,0 +1,362 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+/**
+
+  Sends the messages of a pipelined handshake without waiting for replies.
+
+  Tversion and Tattach, and with Prefetch also Tstatfs and a Tgetattr of the
+  root, are sent back to back. This relies on the server handling the
+  messages of a connection in order.
+
+  @param  Volume                - The 9P volume. Volume->MSize is the proposed
+                                  msize.
+  @param  Root                  - The root file. Root->Fid is the fid to
+                                  attach.
+  @param  UNameStr              - Access user name.
+  @param  ANameStr              - Exported directory path.
+  @param  Prefetch              - Whether to also fetch the file system info
+                                  and the attributes of the root.
+  @param  Handshake             - The handshake to pass to P9HandshakeFinish.
+
+  @retval EFI_SUCCESS           - The handshake is sent.
+  @return Others                - The handshake could not be sent.
+
+**/
+EFI_STATUS
+P9HandshakeStart (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *Root,
+  IN CHAR8              *UNameStr,
+  IN CHAR8              *ANameStr,
+  IN BOOLEAN            Prefetch,
+  OUT P9_HANDSHAKE      **Handshake
+  )
+{
+  EFI_STATUS                    Status;
+  P9_HANDSHAKE                  *Pending;
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+  UINT8                         *TxData;
+  UINT8                         *TxBuffer;
+  UINTN                         TxBufferSize;
+  UINTN                         Index;
+
+  *Handshake = NULL;
+
+  TxBufferSize = P9_HANDSHAKE_TX_SIZE + AsciiStrLen (UNameStr) + AsciiStrLen (ANameStr);
+  Pending = AllocateZeroPool (sizeof (P9_HANDSHAKE) + TxBufferSize);
+  if (Pending == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Pending->Root     = Root;
+  Pending->UNameStr = UNameStr;
+  Pending->ANameStr = ANameStr;
+  Pending->Prefetch = Prefetch;
+  Pending->Count    = Prefetch ? P9_HANDSHAKE_MAX : P9_HANDSHAKE_ATTACH + 1;
+
+  TxBuffer = P9_HANDSHAKE_TX_BUFFER (Pending);
+  TxData   = TxBuffer;
+  Status = P9EncodeMessage (
+             TxData,
+             TxBufferSize,
+             Tversion,
+             P9_NOTAG,
+             &Pending->TxDataSize[P9_HANDSHAKE_VERSION],
+             Volume->MSize,
+             P9_VERSION
+             );
+  Pending->TxData[P9_HANDSHAKE_VERSION] = TxData;
+  TxData += Pending->TxDataSize[P9_HANDSHAKE_VERSION];
+
+  if (!EFI_ERROR (Status)) {
+    Status = P9EncodeMessage (
+               TxData,
+               TxBuffer + TxBufferSize - TxData,
+               Tattach,
+               P9GetTag (Volume),
+               &Pending->TxDataSize[P9_HANDSHAKE_ATTACH],
+               Root->Fid,
+               P9_NOFID,
+               UNameStr,
+               ANameStr
+               );
+    Pending->TxData[P9_HANDSHAKE_ATTACH] = TxData;
+    TxData += Pending->TxDataSize[P9_HANDSHAKE_ATTACH];
+  }
+
+  if (!EFI_ERROR (Status) && Prefetch) {
+    Status = P9EncodeMessage (
+               TxData,
+               TxBuffer + TxBufferSize - TxData,
+               Tstatfs,
+               P9GetTag (Volume),
+               &Pending->TxDataSize[P9_HANDSHAKE_STATFS],
+               Root->Fid
+               );
+    Pending->TxData[P9_HANDSHAKE_STATFS] = TxData;
+    TxData += Pending->TxDataSize[P9_HANDSHAKE_STATFS];
+
+    if (!EFI_ERROR (Status)) {
+      Status = P9EncodeMessage (
+                 TxData,
+                 TxBuffer + TxBufferSize - TxData,
+                 Tgetattr,
+                 P9GetTag (Volume),
+                 &Pending->TxDataSize[P9_HANDSHAKE_GETATTR],
+                 Root->Fid,
+                 (UINT64)P9_GETATTR_ALL
+                 );
+      Pending->TxData[P9_HANDSHAKE_GETATTR] = TxData;
+    }
+  }
+
+  if (EFI_ERROR (Status)) {
+    FreePool (Pending);
+    return Status;
+  }
+
+  Pending->Start = P9GetTick ();
+  for (Pending->Sent = 0; Pending->Sent < Pending->Count; Pending->Sent++) {
+    Index = Pending->Sent;
+
+    Pending->Requests[Index].Tag        = ((P9Header *)Pending->TxData[Index])->Tag;
+    Pending->Requests[Index].RxData     = Pending->RxData[Index];
+    Pending->Requests[Index].RxDataSize = P9_HANDSHAKE_RX_SIZE;
+
+    Fragment.FragmentLength = (UINT32)Pending->TxDataSize[Index];
+    Fragment.FragmentBuffer = Pending->TxData[Index];
+
+    Status = P9SendRequest (Volume, &Pending->Requests[Index], &Fragment, 1);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+      break;
+    }
+  }
+
+  if (EFI_ERROR (Status)) {
+    for (Index = 0; Index < Pending->Sent; Index++) {
+      P9WaitRequest (Volume, &Pending->Requests[Index]);
+    }
+    FreePool (Pending);
+    return Status;
+  }
+
+  *Handshake = Pending;
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Collects the replies of a handshake sent by P9HandshakeStart and attaches
+  the root.
+
+  If the server picked an msize too small for the messages already sent, or
+  refused the attach, the handshake falls back to a sequential Tversion,
+  which resets the session, followed by Tattach. The handshake is freed
+  unless EFI_NOT_READY is returned.
+
+  @param  Volume                - The 9P volume. Volume->MSize is set to the
+                                  negotiated msize.
+  @param  Handshake             - The handshake from P9HandshakeStart.
+  @param  Wait                  - Whether to block until all replies arrive.
+
+  @retval EFI_SUCCESS           - The root is attached.
+  @retval EFI_NOT_READY         - Wait is FALSE and replies are outstanding.
+  @return Others                - The handshake failed.
+
+**/
+EFI_STATUS
+P9HandshakeFinish (
+  IN P9_VOLUME          *Volume,
+  IN P9_HANDSHAKE       *Handshake,
+  IN BOOLEAN            Wait
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_STATUS                    RequestStatus[P9_HANDSHAKE_MAX];
+  P9_IFILE                      *Root;
+  UINT32                        MSize;
+  UINTN                         Index;
+  BOOLEAN                       IsFallback;
+
+  if (!Wait) {
+    for (Index = 0; Index < Handshake->Count; Index++) {
+      while (!Handshake->Requests[Index].IsDone) {
+        Status = P9Dispatch (Volume, FALSE);
+        //
+        // An overdue request is left to P9WaitRequest below to be flushed.
+        //
+        if (Status == EFI_NOT_READY && P9GetTick () < Handshake->Requests[Index].Deadline) {
+          return EFI_NOT_READY;
+        }
+        if (EFI_ERROR (Status)) {
+          break;
+        }
+      }
+      if (Index == P9_HANDSHAKE_VERSION && !Handshake->IsTimed) {
+        Volume->Rtt = P9GetTick () - Handshake->Start;
+        Handshake->IsTimed = TRUE;
+      }
+    }
+  }
+
+  for (Index = 0; Index < Handshake->Count; Index++) {
+    RequestStatus[Index] = P9WaitRequest (Volume, &Handshake->Requests[Index]);
+    if (Index == P9_HANDSHAKE_VERSION && !Handshake->IsTimed) {
+      Volume->Rtt = P9GetTick () - Handshake->Start;
+      Handshake->IsTimed = TRUE;
+    }
+  }
+
+  Root = Handshake->Root;
+
+  Status = RequestStatus[P9_HANDSHAKE_VERSION];
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  Status = P9CheckMessage (
+             Tversion,
+             Handshake->RxData[P9_HANDSHAKE_VERSION],
+             Handshake->Requests[P9_HANDSHAKE_VERSION].RxLength
+             );
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  Status = P9ParseVersion ((P9RVersion *)Handshake->RxData[P9_HANDSHAKE_VERSION], &MSize);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  Status = RequestStatus[P9_HANDSHAKE_ATTACH];
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  IsFallback = EFI_ERROR (
+                 P9CheckMessage (
+                   Tattach,
+                   Handshake->RxData[P9_HANDSHAKE_ATTACH],
+                   Handshake->Requests[P9_HANDSHAKE_ATTACH].RxLength
+                   )
+                 );
+  for (Index = 0; Index < Handshake->Count; Index++) {
+    if (Handshake->TxDataSize[Index] > MSize) {
+      IsFallback = TRUE;
+    }
+  }
+
+  if (IsFallback) {
+    DEBUG ((DEBUG_INFO, "%a:%d: Falling back to a sequential handshake\n", __func__, __LINE__));
+    MSize = Volume->MSize;
+    Status = P9Version (Volume, &MSize);
+    if (EFI_ERROR (Status)) {
+      goto Exit;
+    }
+
+    Volume->MSize = MSize;
+    Status = P9Attach (Volume, Root->Fid, P9_NOFID, Handshake->UNameStr, Handshake->ANameStr, Root);
+    goto Exit;
+  }
+
+  Volume->MSize = MSize;
+  CopyMem (&Root->Qid, &((P9RAttach *)Handshake->RxData[P9_HANDSHAKE_ATTACH])->Qid, QID_SIZE);
+
+  //
+  // The prefetched replies only warm the caches, so their failures are not
+  // reported.
+  //
+  if (Handshake->Prefetch) {
+    Index = P9_HANDSHAKE_STATFS;
+    if (!EFI_ERROR (RequestStatus[Index]) &&
+        !EFI_ERROR (P9CheckMessage (Tstatfs, Handshake->RxData[Index], Handshake->Requests[Index].RxLength))) {
+      P9ParseStatfs (Volume, Root->Fid, (P9RStatfs *)Handshake->RxData[Index]);
+    }
+
+    Index = P9_HANDSHAKE_GETATTR;
+    if (!EFI_ERROR (RequestStatus[Index]) &&
+        !EFI_ERROR (P9CheckMessage (Tgetattr, Handshake->RxData[Index], Handshake->Requests[Index].RxLength))) {
+      P9ParseGetAttr (Root, (P9RGetAttr *)Handshake->RxData[Index]);
+    }
+  }
+
+  Status = EFI_SUCCESS;
+
+Exit:
+  FreePool (Handshake);
+
+  return Status;
+}
+
+/**
+
+  Drops a handshake sent by P9HandshakeStart without collecting its replies.
+  The TCP instance of the volume must have been reset, so that the requests
+  complete at once.
+
+  @param  Volume                - The 9P volume.
+  @param  Handshake             - The handshake from P9HandshakeStart.
+
+**/
+VOID
+P9HandshakeCancel (
+  IN P9_VOLUME          *Volume,
+  IN P9_HANDSHAKE       *Handshake
+  )
+{
+  UINTN                         Index;
+
+  for (Index = 0; Index < Handshake->Sent; Index++) {
+    P9WaitRequest (Volume, &Handshake->Requests[Index]);
+  }
+
+  FreePool (Handshake);
+}
+
+/**
+
+  Negotiates the protocol and attaches the root of the volume in one flight.
+
+  @param  Volume                - The 9P volume. Volume->MSize is the proposed
+                                  msize on input and the negotiated one on
+                                  output.
+  @param  Root                  - The root file. Root->Fid is the fid to
+                                  attach.
+  @param  UNameStr              - Access user name.
+  @param  ANameStr              - Exported directory path.
+  @param  Prefetch              - Whether to also fetch the file system info
+                                  and the attributes of the root.
+
+  @retval EFI_SUCCESS           - The root is attached.
+  @return Others                - The handshake failed.
+
+**/
+EFI_STATUS
+P9Handshake (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *Root,
+  IN CHAR8              *UNameStr,
+  IN CHAR8              *ANameStr,
+  IN BOOLEAN            Prefetch
+  )
+{
+  EFI_STATUS                    Status;
+  P9_HANDSHAKE                  *Handshake;
+
+  Status = P9HandshakeStart (Volume, Root, UNameStr, ANameStr, Prefetch, &Handshake);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return P9HandshakeFinish (Volume, Handshake, TRUE);
+}
@@ -0,0 +1,89 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+typedef struct {
+  P9_REQUEST                Request;
+  P9TGetAttr                TxGetAttr;
+  P9RGetAttr                RxGetAttr;
+} P9_KEEPALIVE_PRIVATE_DATA;
+
+/**
+
+  Keeps an idle connection warm. When nothing was sent on the connection for
+  P9_KEEPALIVE_IDLE ticks, a Tgetattr of the root mode is queued. Its reply is
+  collected by the reactor like that of any asynchronous request.
+
+  @param  Volume                - The primary 9P volume or one of its stripe
+                                  connections.
+
+  @retval EFI_SUCCESS           - A keepalive is queued, or none is needed.
+  @return Others                - The keepalive could not be sent.
+
+**/
+EFI_STATUS
+P9KeepAlive (
+  IN P9_VOLUME          *Volume
+  )
+{
+  EFI_STATUS                    Status;
+  P9_KEEPALIVE_PRIVATE_DATA     *KeepAlive;
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+  UINTN                         TxSize;
+
+  if (!Volume->IsConfigured || Volume->Root == NULL ||
+      P9GetTick () - Volume->LastActivity < P9_KEEPALIVE_IDLE) {
+    return EFI_SUCCESS;
+  }
+
+  if (Volume->KeepAliveToken.Event == NULL) {
+    Status = gBS->CreateEvent (0, 0, NULL, NULL, &Volume->KeepAliveToken.Event);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  } else if (!EFI_ERROR (gBS->CheckEvent (Volume->KeepAliveToken.Event)) &&
+             EFI_ERROR (Volume->KeepAliveToken.Status)) {
+    //
+    // The connection is not failed over from here; the next request does
+    // that.
+    //
+    DEBUG ((DEBUG_INFO, "%a:%d: Last keepalive: %r\n", __func__, __LINE__, Volume->KeepAliveToken.Status));
+  }
+
+  KeepAlive = (P9_KEEPALIVE_PRIVATE_DATA *)P9AllocateRequest (Volume, sizeof (P9_KEEPALIVE_PRIVATE_DATA));
+  if (KeepAlive == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  P9EncodeMessage (
+    &KeepAlive->TxGetAttr,
+    sizeof (P9TGetAttr),
+    Tgetattr,
+    P9GetTag (Volume),
+    &TxSize,
+    Volume->Root->Fid,
+    (UINT64)P9_GETATTR_MODE
+    );
+
+  KeepAlive->Request.Tag            = KeepAlive->TxGetAttr.Header.Tag;
+  KeepAlive->Request.RxData         = &KeepAlive->RxGetAttr;
+  KeepAlive->Request.RxDataSize     = sizeof (P9RGetAttr);
+  KeepAlive->Request.Token          = &Volume->KeepAliveToken;
+
+  Fragment.FragmentLength = (UINT32)TxSize;
+  Fragment.FragmentBuffer = &KeepAlive->TxGetAttr;
+
+  Status = P9SendRequest (Volume, &KeepAlive->Request, &Fragment, 1);
+  if (EFI_ERROR (Status)) {
+    P9FreeRequest (Volume, &KeepAlive->Request);
+    return Status;
+  }
+
+  return EFI_SUCCESS;
+}
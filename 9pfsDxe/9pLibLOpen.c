@@ -15,54 +15,24 @@ P9LOpen (
   )
 {
   EFI_STATUS                    Status;
-  P9TLOpen                      *TxOpen;
-  P9RLOpen                      *RxOpen;
+  P9RLOpen                      RxOpen;
 
-  TxOpen = AllocateZeroPool (sizeof (P9TLOpen));
-  if (TxOpen == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  TxOpen->Header.Size = sizeof (P9TLOpen);
-  TxOpen->Header.Id   = Tlopen;
-  TxOpen->Header.Tag  = Volume->Tag;
-  TxOpen->Fid         = IFile->Fid;
-  TxOpen->Flags       = IFile->Flags;
-
-  RxOpen = AllocateZeroPool (sizeof (P9RLOpen));
-  if (RxOpen == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  Status = DoP9 (
+  Status = P9Rpc (
     Volume,
-    TxOpen,
-    sizeof (P9TLOpen),
-    RxOpen,
-    sizeof (P9RLOpen)
+    Tlopen,
+    &RxOpen,
+    sizeof (P9RLOpen),
+    NULL,
+    0,
+    IFile->Fid,
+    IFile->Flags
     );
   if (EFI_ERROR (Status)) {
-    goto Exit;
+    return Status;
   }
 
-  if (RxOpen->Header.Id != Rlopen) {
-    Status = P9Error (RxOpen, sizeof (P9RLOpen));
-    goto Exit;
-  }
-
-  CopyMem (&IFile->Qid, &RxOpen->Qid, QID_SIZE);
-  IFile->IoUnit = RxOpen->IoUnit;
-
-Exit:
-  if (TxOpen != NULL) {
-    FreePool (TxOpen);
-  }
-
-  if (RxOpen != NULL) {
-    FreePool (RxOpen);
-  }
+  CopyMem (&IFile->Qid, &RxOpen.Qid, QID_SIZE);
+  IFile->IoUnit = RxOpen.IoUnit;
 
-  return Status;
+  return EFI_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,466 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+//
+// Layout of a T-message and of its R-message after the header, one
+// character per field:
+//
+//   1, 2, 4, 8 - integer of that many bytes
+//   Q          - qid
+//   s          - string, size[2] followed by the bytes
+//   w          - walk names, nwname[2] followed by nwname strings
+//   W          - walk qids, nwqid[2] followed by nwqid qids
+//   D          - data, count[4] followed by count bytes; always last
+//
+typedef struct {
+  UINT8                     Id;
+  CONST CHAR8               *TxFormat;
+  CONST CHAR8               *RxFormat;
+} P9_MESSAGE_SCHEMA;
+
+STATIC CONST P9_MESSAGE_SCHEMA mP9Messages[] = {
+  { Tstatfs,   "4",    "448888882"                },
+  { Tlopen,    "44",   "Q4"                       },
+  { Treadlink, "4",    "s"                        },
+  { Tgetattr,  "48",   "8Q444888888888888888"     },
+  { Treaddir,  "484",  "D"                        },
+  { Tfsync,    "44",   ""                         },
+  { Tversion,  "4s",   "4s"                       },
+  { Tattach,   "44ss", "Q"                        },
+  { Tflush,    "2",    ""                         },
+  { Twalk,     "44w",  "W"                        },
+  { Tread,     "484",  "D"                        },
+  { Twrite,    "48D",  "4"                        },
+  { Tclunk,    "4",    ""                         },
+};
+
+/**
+
+  Finds the schema of a T-message.
+
+**/
+CONST P9_MESSAGE_SCHEMA *
+P9GetMessageSchema (
+  IN UINT8              Id
+  )
+{
+  UINTN                         Index;
+
+  for (Index = 0; Index < ARRAY_SIZE (mP9Messages); Index++) {
+    if (mP9Messages[Index].Id == Id) {
+      return &mP9Messages[Index];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+
+  Serializes a T-message into Buffer from the arguments its schema lists.
+
+  Integers of 8 bytes are passed as UINT64 and smaller ones as UINT32.
+  Strings are passed as NUL-terminated CHAR8 strings, walk names as a CHAR16
+  path of which the first P9_MAX_WELEM names are sent in UTF-8, as by
+  P9CountWalkNames(). Data is passed as its UINT32 count only: it is not
+  copied, but is to follow the message in a fragment of its own, and is
+  counted in the size in the header.
+
+  @param  Buffer                - Buffer receiving the message.
+  @param  BufferSize            - Size of Buffer.
+  @param  Id                    - Type of the T-message.
+  @param  Tag                   - Tag of the message.
+  @param  Size                  - Gets the number of bytes written.
+  @param  Args                  - The fields of the message.
+
+  @retval EFI_SUCCESS           - The message is in Buffer.
+  @retval EFI_UNSUPPORTED       - Id has no schema.
+  @retval EFI_BUFFER_TOO_SMALL  - The message does not fit in Buffer.
+
+**/
+EFI_STATUS
+P9EncodeMessageV (
+  OUT VOID              *Buffer,
+  IN UINTN              BufferSize,
+  IN UINT8              Id,
+  IN UINT16             Tag,
+  OUT UINTN             *Size,
+  IN VA_LIST            Args
+  )
+{
+  CONST P9_MESSAGE_SCHEMA       *Schema;
+  CONST CHAR8                   *Format;
+  UINT8                         *Message;
+  UINTN                         Offset;
+  UINTN                         Length;
+  UINTN                         DataSize;
+  UINT32                        Value;
+  UINT64                        Value64;
+  CHAR8                         *String;
+  CHAR16                        *Name;
+  UINTN                         NameSize;
+  UINT16                        Count;
+
+  Schema = P9GetMessageSchema (Id);
+  if (Schema == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (BufferSize < sizeof (P9Header)) {
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  Message  = Buffer;
+  Offset   = sizeof (P9Header);
+  DataSize = 0;
+  for (Format = Schema->TxFormat; *Format != '\0'; Format++) {
+    switch (*Format) {
+      case '1':
+      case '2':
+      case '4':
+        Length = *Format - '0';
+        Value  = VA_ARG (Args, UINT32);
+        if (BufferSize - Offset < Length) {
+          return EFI_BUFFER_TOO_SMALL;
+        }
+        if (Length == 1) {
+          Message[Offset] = (UINT8)Value;
+        } else if (Length == 2) {
+          WriteUnaligned16 ((UINT16 *)&Message[Offset], (UINT16)Value);
+        } else {
+          WriteUnaligned32 ((UINT32 *)&Message[Offset], Value);
+        }
+        Offset += Length;
+        break;
+
+      case '8':
+        Value64 = VA_ARG (Args, UINT64);
+        if (BufferSize - Offset < sizeof (UINT64)) {
+          return EFI_BUFFER_TOO_SMALL;
+        }
+        WriteUnaligned64 ((UINT64 *)&Message[Offset], Value64);
+        Offset += sizeof (UINT64);
+        break;
+
+      case 's':
+        String = VA_ARG (Args, CHAR8 *);
+        Length = AsciiStrLen (String);
+        if (Length > MAX_UINT16 || BufferSize - Offset < sizeof (UINT16) + Length) {
+          return EFI_BUFFER_TOO_SMALL;
+        }
+        WriteUnaligned16 ((UINT16 *)&Message[Offset], (UINT16)Length);
+        CopyMem (&Message[Offset + sizeof (UINT16)], String, Length);
+        Offset += sizeof (UINT16) + Length;
+        break;
+
+      case 'w':
+        Name  = VA_ARG (Args, CHAR16 *);
+        Count = P9CountWalkNames (Name);
+        if (BufferSize - Offset < sizeof (UINT16)) {
+          return EFI_BUFFER_TOO_SMALL;
+        }
+        WriteUnaligned16 ((UINT16 *)&Message[Offset], Count);
+        Offset += sizeof (UINT16);
+        for (Name = (Name == NULL) ? NULL : P9SkipNames (Name, 0); Count > 0; Count--) {
+          Length   = P9NameLength (Name);
+          NameSize = P9Utf8Size (Name, Length);
+          if (NameSize > MAX_UINT16 || BufferSize - Offset < sizeof (UINT16) + NameSize) {
+            return EFI_BUFFER_TOO_SMALL;
+          }
+          WriteUnaligned16 ((UINT16 *)&Message[Offset], (UINT16)NameSize);
+          Offset += sizeof (UINT16);
+          Offset += P9EncodeUtf8 (Name, Length, (CHAR8 *)&Message[Offset]);
+          Name = P9SkipNames (Name + Length, 0);
+        }
+        break;
+
+      case 'D':
+        DataSize = VA_ARG (Args, UINT32);
+        if (BufferSize - Offset < sizeof (UINT32)) {
+          return EFI_BUFFER_TOO_SMALL;
+        }
+        WriteUnaligned32 ((UINT32 *)&Message[Offset], (UINT32)DataSize);
+        Offset += sizeof (UINT32);
+        break;
+
+      default:
+        ASSERT (FALSE);
+        return EFI_UNSUPPORTED;
+    }
+  }
+
+  if (Offset + DataSize > MAX_UINT32) {
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  WriteUnaligned32 (&((P9Header *)Message)->Size, (UINT32)(Offset + DataSize));
+  ((P9Header *)Message)->Id = Id;
+  WriteUnaligned16 (&((P9Header *)Message)->Tag, Tag);
+  *Size = Offset;
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Serializes a T-message into Buffer, as P9EncodeMessageV().
+
+**/
+EFI_STATUS
+EFIAPI
+P9EncodeMessage (
+  OUT VOID              *Buffer,
+  IN UINTN              BufferSize,
+  IN UINT8              Id,
+  IN UINT16             Tag,
+  OUT UINTN             *Size,
+  ...
+  )
+{
+  EFI_STATUS                    Status;
+  VA_LIST                       Args;
+
+  VA_START (Args, Size);
+  Status = P9EncodeMessageV (Buffer, BufferSize, Id, Tag, Size, Args);
+  VA_END (Args);
+
+  return Status;
+}
+
+/**
+
+  Checks that a reply to a T-message is well formed, so that its fields can
+  be read in place. Every counted field must lie within the Length bytes
+  received, which must be the whole message.
+
+  @param  Id                    - Type of the T-message answered.
+  @param  Data                  - The reply. A trailing data field may have
+                                  been received elsewhere.
+  @param  Length                - Number of bytes received.
+
+  @retval EFI_SUCCESS           - Data is the R-message of Id.
+  @retval EFI_DEVICE_ERROR      - The reply is truncated or malformed, or
+                                  of another type.
+  @return Others                - The error returned by the server.
+
+**/
+EFI_STATUS
+P9CheckMessage (
+  IN UINT8              Id,
+  IN VOID               *Data,
+  IN UINTN              Length
+  )
+{
+  CONST P9_MESSAGE_SCHEMA       *Schema;
+  CONST CHAR8                   *Format;
+  UINT8                         *Message;
+  P9Header                      *Header;
+  UINTN                         Offset;
+  UINTN                         Size;
+
+  Schema = P9GetMessageSchema (Id);
+  if (Schema == NULL || Length < sizeof (P9Header)) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  Message = Data;
+  Header  = Data;
+  if (ReadUnaligned32 (&Header->Size) != Length) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  if (Header->Id == Rlerror) {
+    if (Length != sizeof (P9RLError)) {
+      return EFI_DEVICE_ERROR;
+    }
+    return P9Error (Data, Length);
+  }
+
+  if (Header->Id != Id + 1) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  Offset = sizeof (P9Header);
+  for (Format = Schema->RxFormat; *Format != '\0'; Format++) {
+    switch (*Format) {
+      case '1':
+      case '2':
+      case '4':
+      case '8':
+        Size = *Format - '0';
+        break;
+
+      case 'Q':
+        Size = QID_SIZE;
+        break;
+
+      case 's':
+      case 'W':
+      case 'D':
+        Size = (*Format == 'D') ? sizeof (UINT32) : sizeof (UINT16);
+        if (Length - Offset < Size) {
+          return EFI_DEVICE_ERROR;
+        }
+        if (*Format == 's') {
+          Size += ReadUnaligned16 ((UINT16 *)&Message[Offset]);
+        } else if (*Format == 'W') {
+          Size += QID_SIZE * (UINTN)ReadUnaligned16 ((UINT16 *)&Message[Offset]);
+        } else {
+          Size += ReadUnaligned32 ((UINT32 *)&Message[Offset]);
+        }
+        break;
+
+      default:
+        ASSERT (FALSE);
+        return EFI_DEVICE_ERROR;
+    }
+
+    if (Length - Offset < Size) {
+      return EFI_DEVICE_ERROR;
+    }
+    Offset += Size;
+  }
+
+  if (Offset != Length) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Takes Size bytes from the message buffer of a volume. Buffers are taken
+  and released in stack order, so that the messages of a failover nested in
+  a call keep clear of the messages of the call.
+
+  @param  Volume                - The 9P volume.
+  @param  Size                  - Number of bytes.
+
+  @return The buffer, or NULL if the message buffer is full.
+
+**/
+VOID *
+P9ReserveMessage (
+  IN P9_VOLUME          *Volume,
+  IN UINTN              Size
+  )
+{
+  VOID                          *Buffer;
+
+  Size = ALIGN_VALUE (Size, 8);
+  if (Size > P9_MESSAGE_BUFFER_SIZE - Volume->MessageBufferUsed) {
+    return NULL;
+  }
+
+  Buffer = &Volume->MessageBuffer[Volume->MessageBufferUsed];
+  Volume->MessageBufferUsed += Size;
+
+  return Buffer;
+}
+
+/**
+
+  Releases a buffer from P9ReserveMessage, together with every buffer taken
+  after it.
+
+  @param  Volume                - The 9P volume.
+  @param  Buffer                - The buffer.
+
+**/
+VOID
+P9ReleaseMessage (
+  IN P9_VOLUME          *Volume,
+  IN VOID               *Buffer
+  )
+{
+  Volume->MessageBufferUsed = (UINT8 *)Buffer - Volume->MessageBuffer;
+}
+
+/**
+
+  Sends a T-message built from its schema and waits for the reply.
+
+  The message is serialized into the message buffer of the volume. The reply
+  is received into RxData, then any data field of it into Payload, and is
+  checked against the schema before it is returned.
+
+  @param  Volume                - The 9P volume.
+  @param  Id                    - Type of the T-message.
+  @param  RxData                - Buffer receiving the reply, or NULL when
+                                  the reply has no fields. It must be large
+                                  enough for an Rlerror.
+  @param  RxDataSize            - Size of RxData.
+  @param  Payload               - Buffer receiving the data of the reply, or
+                                  NULL.
+  @param  PayloadSize           - Size of Payload.
+  @param  ...                   - The fields of the message, as for
+                                  P9EncodeMessageV().
+
+  @retval EFI_SUCCESS           - RxData holds the R-message of Id.
+  @retval EFI_OUT_OF_RESOURCES  - The message buffer is full.
+  @return Others                - The request failed, or the server returned
+                                  an error.
+
+**/
+EFI_STATUS
+EFIAPI
+P9Rpc (
+  IN P9_VOLUME          *Volume,
+  IN UINT8              Id,
+  OUT VOID              *RxData OPTIONAL,
+  IN UINTN              RxDataSize,
+  OUT VOID              *Payload OPTIONAL,
+  IN UINTN              PayloadSize,
+  ...
+  )
+{
+  EFI_STATUS                    Status;
+  VA_LIST                       Args;
+  P9RLError                     RxError;
+  UINT8                         *TxData;
+  UINTN                         TxDataSize;
+  UINTN                         RxLength;
+
+  if (RxData == NULL) {
+    RxData     = &RxError;
+    RxDataSize = sizeof (P9RLError);
+  }
+
+  ASSERT (RxDataSize >= sizeof (P9RLError));
+
+  TxData = &Volume->MessageBuffer[Volume->MessageBufferUsed];
+  VA_START (Args, PayloadSize);
+  Status = P9EncodeMessageV (
+             TxData,
+             P9_MESSAGE_BUFFER_SIZE - Volume->MessageBufferUsed,
+             Id,
+             (Id == Tversion) ? P9_NOTAG : Volume->Tag,
+             &TxDataSize,
+             Args
+             );
+  VA_END (Args);
+  if (EFI_ERROR (Status)) {
+    return (Status == EFI_BUFFER_TOO_SMALL) ? EFI_OUT_OF_RESOURCES : Status;
+  }
+
+  TxData = P9ReserveMessage (Volume, TxDataSize);
+  if (TxData == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = DoP9 (Volume, TxData, TxDataSize, RxData, RxDataSize, Payload, PayloadSize, &RxLength);
+  P9ReleaseMessage (Volume, TxData);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return P9CheckMessage (Id, RxData, RxLength);
+}
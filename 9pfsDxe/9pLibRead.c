@@ -8,171 +8,285 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 #include "9pLib.h"
 
-VOID
-EFIAPI
-TxReadCallback (
-  IN EFI_EVENT  Event,
-  IN VOID       *Context
+EFI_STATUS
+P9LRead (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *IFile,
+  IN OUT UINT32         *Count,
+  OUT VOID              *Data
   )
 {
-  P9_MESSAGE_PRIVATE_DATA  *Read;
+  EFI_STATUS                    Status;
+  P9RRead                       RxRead;
 
-  Read = (P9_MESSAGE_PRIVATE_DATA *)Context;
-  Read->IsTxDone = TRUE;
-  gBS->CloseEvent (Read->TxIoToken.CompletionToken.Event);
-}
+  Status = P9Rpc (
+    Volume,
+    Tread,
+    &RxRead,
+    sizeof (P9RRead),
+    Data,
+    *Count,
+    IFile->Fid,
+    IFile->Position,
+    *Count
+    );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
+    return Status;
+  }
 
-VOID
-EFIAPI
-RxReadCallback (
-  IN EFI_EVENT  Event,
-  IN VOID       *Context
-  )
-{
-  P9_MESSAGE_PRIVATE_DATA  *Read;
+  *Count = RxRead.Count;
+  IFile->Position += RxRead.Count;
 
-  Read = (P9_MESSAGE_PRIVATE_DATA *)Context;
-  Read->IsRxDone = TRUE;
+  return EFI_SUCCESS;
 }
 
+typedef struct {
+  P9_REQUEST                Request;
+  P9TRead                   TxRead;
+  P9RRead                   RxRead;
+  P9_VOLUME                 *Connection;
+} P9_READ_PRIVATE_DATA;
+
+/**
+
+  Returns the fid of IFile on the stripe connection Index, walking to and
+  opening the file on that connection the first time it is used.
+
+**/
 EFI_STATUS
-P9LRead (
+P9GetStripeFid (
   IN P9_VOLUME          *Volume,
   IN OUT P9_IFILE       *IFile,
-  IN OUT UINT32         *Count,
-  OUT VOID              *Data
+  IN UINTN              Index,
+  OUT UINT32            *Fid
   )
 {
   EFI_STATUS                    Status;
-  P9_MESSAGE_PRIVATE_DATA       *Read;
-  EFI_TCP4_PROTOCOL             *Tcp4;
-  P9TRead                       *TxRead;
-  P9RRead                       *RxRead;
-  UINTN                         RxReadSize;
-  VOID                          *CurrentRxRead;
-  INTN                          CurrentRxReadSize;
-  UINT32                        CurrentDataLength;
-  BOOLEAN                       HasMoreData;
-
-  Tcp4 = Volume->Tcp4;
-
-  Read = AllocateZeroPool (sizeof (P9_MESSAGE_PRIVATE_DATA));
-  if (Read == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
+  P9_VOLUME                     *Stripe;
+  P9_IFILE                      *StripeIFile;
+
+  if (IFile->StripeFid[Index] != 0) {
+    *Fid = IFile->StripeFid[Index];
+    return EFI_SUCCESS;
   }
 
-  Status = gBS->CreateEvent(
-      EVT_NOTIFY_SIGNAL,
-      TPL_CALLBACK,
-      TxReadCallback,
-      Read,
-      &Read->TxIoToken.CompletionToken.Event
-      );
-  if (EFI_ERROR (Status)) {
-    goto Exit;
+  if (IFile->Path == NULL) {
+    return EFI_NOT_FOUND;
   }
 
-  Status = gBS->CreateEvent(
-      EVT_NOTIFY_SIGNAL,
-      TPL_CALLBACK,
-      RxReadCallback,
-      Read,
-      &Read->RxIoToken.CompletionToken.Event
-      );
-  if (EFI_ERROR (Status)) {
-    goto Exit;
+  //
+  // Stripe connections only attach the first export.
+  //
+  if (IFile->Root != Volume->Root) {
+    return EFI_UNSUPPORTED;
   }
 
-  TxRead = AllocateZeroPool (sizeof (P9TRead));
-  if (TxRead == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
+  Stripe = Volume->Stripes[Index];
+  StripeIFile = P9AllocateObject (&Volume->FileSlab);
+  if (StripeIFile == NULL) {
+    return EFI_OUT_OF_RESOURCES;
   }
+  ZeroMem (StripeIFile, sizeof (P9_IFILE));
 
-  TxRead->Header.Size = sizeof (P9TRead);
-  TxRead->Header.Id   = Tread;
-  TxRead->Header.Tag  = Volume->Tag;
-  TxRead->Fid         = IFile->Fid;
-  TxRead->Offset      = IFile->Position;
-  TxRead->Count       = *Count;
-
-  Read->IsTxDone = FALSE;
-  Status = TransmitTcp4 (
-      Tcp4,
-      &Read->TxIoToken,
-      TxRead,
-      sizeof (P9TRead)
-      );
+  Status = P9Walk (Stripe, Stripe->Root, StripeIFile, IFile->Path, TRUE);
   if (EFI_ERROR (Status)) {
     goto Exit;
   }
 
-  while (!Read->IsTxDone) {
-    Tcp4->Poll (Tcp4);
-  }
-
-  RxReadSize = sizeof (P9RRead) + *Count;
-  RxRead = AllocateZeroPool (RxReadSize);
-  if (RxRead == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
+  StripeIFile->Flags = O_RDONLY;
+  Status = P9LOpen (Stripe, StripeIFile);
+  if (EFI_ERROR (Status)) {
+    P9ClunkFid (Stripe, StripeIFile->Fid);
     goto Exit;
   }
 
-  CurrentRxRead = RxRead;
-  CurrentRxReadSize = *Count;
-  HasMoreData = TRUE;
-  while (HasMoreData == TRUE) {
-    Read->IsRxDone = FALSE;
-    Status = ReceiveTcp4 (
-        Tcp4,
-        &Read->RxIoToken,
-        CurrentRxRead,
-        P9_MSIZE
-        );
-    if (EFI_ERROR (Status)) {
-      DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
-      goto Exit;
-    }
+  IFile->StripeFid[Index] = StripeIFile->Fid;
+  *Fid = StripeIFile->Fid;
 
-    while (!Read->IsRxDone) {
-      Tcp4->Poll (Tcp4);
-    }
-    CurrentDataLength = Read->RxIoToken.Packet.RxData->DataLength;
-    CurrentRxRead = (UINT8 *)CurrentRxRead + CurrentDataLength;
-    if (CurrentDataLength < CurrentRxReadSize) {
-      HasMoreData = TRUE;
-      CurrentRxReadSize -= CurrentDataLength;
-    } else {
-      HasMoreData = FALSE;
+Exit:
+  P9FreeObject (&Volume->FileSlab, StripeIFile);
+
+  return Status;
+}
+
+/**
+
+  Reads from IFile at Offset, striping the data across the connections of
+  the volume.
+
+  The range is cut into msize-bound Tread requests that are dealt round-robin
+  to the primary connection and the stripe connections, with up to
+  P9_READ_PIPELINE_DEPTH of them in flight on each. Stripe connections on
+  which the file can not be opened are left out.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The file to read.
+  @param  Offset                - File offset to read at.
+  @param  Count                 - On input, bytes to read. On output, bytes
+                                  read contiguously from Offset.
+  @param  Data                  - Buffer receiving the data.
+
+  @retval EFI_SUCCESS           - The data up to Count or end of file was read.
+  @return Others                - A request failed.
+
+**/
+EFI_STATUS
+P9LReadStriped (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *IFile,
+  IN UINT64             Offset,
+  IN OUT UINTN          *Count,
+  OUT VOID              *Data
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_STATUS                    ReadStatus;
+  P9_VOLUME                     *Connections[P9_MAX_CONNECTIONS];
+  UINT32                        Fids[P9_MAX_CONNECTIONS];
+  UINTN                         ConnectionCount;
+  P9_READ_PRIVATE_DATA          *Slots[P9_MAX_CONNECTIONS * P9_READ_PIPELINE_DEPTH];
+  P9_READ_PRIVATE_DATA          *Slot;
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+  P9_VOLUME                     *Connection;
+  UINT32                        MaxCount;
+  UINT32                        Chunk;
+  UINTN                         SlotCount;
+  UINTN                         Index;
+  UINTN                         Total;
+  UINTN                         Sent;
+  UINTN                         Received;
+  UINTN                         Head;
+  UINTN                         InFlight;
+  UINTN                         Next;
+  UINTN                         TxSize;
+
+  Total  = *Count;
+  *Count = 0;
+
+  Connections[0]  = Volume;
+  Fids[0]         = IFile->Fid;
+  ConnectionCount = 1;
+  MaxCount        = Volume->MSize - sizeof (P9RRead);
+  for (Index = 0; Index < Volume->StripeCount; Index++) {
+    Status = P9GetStripeFid (Volume, IFile, Index, &Fids[ConnectionCount]);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_INFO, "%a:%d: Stripe %d: %r\n", __func__, __LINE__, (UINT32)Index, Status));
+      continue;
     }
+    Connections[ConnectionCount] = Volume->Stripes[Index];
+    MaxCount = MIN (MaxCount, Volume->Stripes[Index]->MSize - sizeof (P9RRead));
+    ConnectionCount++;
   }
 
-  if (RxRead->Header.Id != Rread) {
-    Status = P9Error (RxRead, RxReadSize);
-    goto Exit;
+  if (IFile->IoUnit != 0 && IFile->IoUnit < MaxCount) {
+    MaxCount = IFile->IoUnit;
   }
 
-  CopyMem (Data, (VOID *)RxRead->Data, RxRead->Count);
-  *Count = RxRead->Count;
-  IFile->Position += RxRead->Count;
+  //
+  // Slots are taken from the request slab when first used.
+  //
+  SlotCount = ConnectionCount * P9_READ_PIPELINE_DEPTH;
+  ZeroMem (Slots, sizeof (Slots));
 
-  Status = EFI_SUCCESS;
+  ReadStatus = EFI_SUCCESS;
+  Sent       = 0;
+  Received   = Total;
+  Head       = 0;
+  InFlight   = 0;
+  Next       = 0;
+  for (;;) {
+    //
+    // Fill the pipeline. Slots are used as a ring, oldest request at Head.
+    //
+    while (ReadStatus == EFI_SUCCESS && Sent < Received && InFlight < SlotCount) {
+      Slot = Slots[(Head + InFlight) % SlotCount];
+      if (Slot == NULL) {
+        Slot = (P9_READ_PRIVATE_DATA *)P9AllocateRequest (Volume, sizeof (P9_READ_PRIVATE_DATA));
+        if (Slot == NULL) {
+          ReadStatus = EFI_OUT_OF_RESOURCES;
+          Received = MIN (Received, Sent);
+          break;
+        }
+        Slots[(Head + InFlight) % SlotCount] = Slot;
+      }
+      Connection = Connections[Next];
+      Chunk      = (UINT32)MIN ((UINTN)MaxCount, Total - Sent);
 
-Exit:
-  gBS->CloseEvent (Read->RxIoToken.CompletionToken.Event);
+      P9EncodeMessage (
+        &Slot->TxRead,
+        sizeof (P9TRead),
+        Tread,
+        P9GetTag (Connection),
+        &TxSize,
+        Fids[Next],
+        Offset + Sent,
+        Chunk
+        );
 
-  if (Read != NULL) {
-    FreePool (Read);
-  }
+      //
+      // The data is received in place, where the chunk goes in Data.
+      //
+      Slot->Request.Tag           = Slot->TxRead.Header.Tag;
+      Slot->Request.RxData        = &Slot->RxRead;
+      Slot->Request.RxDataSize    = sizeof (P9RRead);
+      Slot->Request.RxPayload     = (UINT8 *)Data + Sent;
+      Slot->Request.RxPayloadSize = Chunk;
+      Slot->Connection            = Connection;
+
+      Fragment.FragmentLength     = (UINT32)TxSize;
+      Fragment.FragmentBuffer     = &Slot->TxRead;
+
+      Status = P9SendRequest (Connection, &Slot->Request, &Fragment, 1);
+      if (EFI_ERROR (Status)) {
+        DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+        ReadStatus = Status;
+        Received = MIN (Received, Sent);
+        break;
+      }
+
+      Sent += Chunk;
+      InFlight++;
+      Next = (Next + 1) % ConnectionCount;
+    }
+
+    if (InFlight == 0) {
+      break;
+    }
+
+    //
+    // Retire the oldest request.
+    //
+    Slot = Slots[Head];
+    Status = P9WaitRequest (Slot->Connection, &Slot->Request);
+    Head = (Head + 1) % SlotCount;
+    InFlight--;
 
-  if (TxRead != NULL) {
-    FreePool (TxRead);
+    if (!EFI_ERROR (Status)) {
+      Status = P9CheckMessage (Tread, &Slot->RxRead, Slot->Request.RxLength);
+    }
+
+    if (EFI_ERROR (Status)) {
+      ReadStatus = Status;
+      Received = MIN (Received, Slot->TxRead.Offset - Offset);
+    } else {
+      Chunk = Slot->RxRead.Count;
+      //
+      // A short read marks the end of the file.
+      //
+      if (Chunk < Slot->TxRead.Count) {
+        Received = MIN (Received, Slot->TxRead.Offset - Offset + Chunk);
+      }
+    }
   }
 
-  if (RxRead != NULL) {
-    FreePool (RxRead);
+  *Count = Received;
+
+  for (Head = 0; Head < SlotCount; Head++) {
+    if (Slots[Head] != NULL) {
+      P9FreeRequest (Volume, &Slots[Head]->Request);
+    }
   }
 
-  return Status;
-}
\ No newline at end of file
+  return ReadStatus;
+}
@@ -8,6 +8,29 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 #include "9pLib.h"
 
+//
+// Size of a Twalk of one name. A name converted back from UCS-2 may be
+// longer than it came, as bytes that are not UTF-8 become U+FFFD.
+//
+#define P9_TWALK_NAME_SIZE  (sizeof (P9TWalk) + sizeof (UINT16) + P9_MAX_FLEN * 3)
+
+//
+// The attributes of an entry of the last Treaddir reply, at Offset in the
+// reply, fetched ahead along with those of the entries that follow it. The
+// entry is walked to Fid, which is clunked once Rgetattr is in RxData.
+//
+struct _P9_DIR_PREFETCH {
+  P9_REQUEST                Request;
+  UINT32                    Offset;
+  UINT32                    Fid;
+  UINT16                    NWName;
+  BOOLEAN                   IsWalked;
+  EFI_STATUS                Status;
+  UINT8                     TxData[P9_TWALK_NAME_SIZE];
+  UINT8                     RxData[sizeof (P9RGetAttr)];
+  P9RLError                 RxClunk;
+};
+
 EFI_STATUS
 P9LReadDir (
   IN P9_VOLUME          *Volume,
@@ -18,59 +41,545 @@ P9LReadDir (
   )
 {
   EFI_STATUS                    Status;
-  P9TReadDir                    *TxReadDir;
-  P9RReadDir                    *RxReadDir;
-  UINTN                         RxReadDirSize;
+  P9RReadDir                    RxReadDir;
 
-  TxReadDir = AllocateZeroPool (sizeof (P9TReadDir));
-  if (TxReadDir == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
+  Status = P9Rpc (
+    Volume,
+    Treaddir,
+    &RxReadDir,
+    sizeof (P9RReadDir),
+    Data,
+    *Count,
+    IFile->Fid,
+    Offset,
+    *Count
+    );
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
 
-  TxReadDir->Header.Size = sizeof (P9TReadDir);
-  TxReadDir->Header.Id   = Treaddir;
-  TxReadDir->Header.Tag  = Volume->Tag;
-  TxReadDir->Fid         = IFile->Fid;
-  TxReadDir->Offset      = Offset;
-  TxReadDir->Count       = *Count;
+  *Count = RxReadDir.Count;
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Starts enumerating an open directory from the server. The listing is
+  recorded on the way, to be cached once the end is reached.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The open directory.
+  @param  Reader                - Gets the state of the enumeration.
+
+  @retval EFI_SUCCESS           - The enumeration is started.
+  @retval EFI_OUT_OF_RESOURCES  - The state could not be allocated.
 
-  RxReadDirSize = sizeof (P9RReadDir) + *Count;
-  RxReadDir = AllocateZeroPool (RxReadDirSize);
-  if (RxReadDir == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
+**/
+EFI_STATUS
+P9OpenDirReader (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  OUT P9_DIR_READER     **Reader
+  )
+{
+  P9_DIR_READER                 *NewReader;
+
+  NewReader = AllocateZeroPool (sizeof (P9_DIR_READER));
+  if (NewReader == NULL) {
+    return EFI_OUT_OF_RESOURCES;
   }
 
-  Status = DoP9 (
-    Volume,
-    TxReadDir,
-    sizeof (P9TReadDir),
-    RxReadDir,
-    RxReadDirSize
-    );
+  NewReader->BufferSize = Volume->MSize - sizeof (P9RReadDir);
+  if (IFile->IoUnit != 0 && IFile->IoUnit < NewReader->BufferSize) {
+    NewReader->BufferSize = IFile->IoUnit;
+  }
+
+  NewReader->Buffer   = AllocatePool (NewReader->BufferSize);
+  NewReader->Prefetch = AllocateZeroPool (sizeof (P9_DIR_PREFETCH) * P9_READDIR_PIPELINE_DEPTH);
+  NewReader->Entry    = AllocateZeroPool (sizeof (P9_IFILE));
+  NewReader->Pending  = AllocateZeroPool (sizeof (P9_DIR_SNAPSHOT));
+  if (NewReader->Buffer == NULL || NewReader->Prefetch == NULL ||
+      NewReader->Entry == NULL || NewReader->Pending == NULL) {
+    P9CloseDirReader (NewReader);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  //
+  // The file info of every entry is decoded into the same buffer.
+  //
+  NewReader->Entry->FileInfo = AllocatePool (SIZE_OF_EFI_FILE_INFO + (P9_MAX_FLEN + 1) * sizeof (CHAR16));
+  NewReader->Entry->FileName = AllocatePool ((P9_MAX_FLEN + 1) * sizeof (CHAR16));
+  if (NewReader->Entry->FileInfo == NULL || NewReader->Entry->FileName == NULL) {
+    P9CloseDirReader (NewReader);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  NewReader->Entry->Signature = P9_IFILE_SIGNATURE;
+  NewReader->Entry->Volume    = Volume;
+  NewReader->Entry->Root      = IFile->Root;
+
+  NewReader->IsRoot = (BOOLEAN)(IFile->Qid.Path == IFile->Root->Qid.Path);
+
+  NewReader->Pending->RefCount = 1;
+  CopyMem (&NewReader->Pending->Qid, &IFile->Qid, QID_SIZE);
+
+  *Reader = NewReader;
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Returns the entry at Offset in the last Treaddir reply, or NULL if the
+  reply does not hold the whole entry.
+
+**/
+STATIC
+P9DirEnt *
+P9GetDirEntry (
+  IN P9_DIR_READER      *Reader,
+  IN UINT32             Offset
+  )
+{
+  P9DirEnt                      *DirEnt;
+
+  DirEnt = (P9DirEnt *)(Reader->Buffer + Offset);
+  if (Reader->Count - Offset < sizeof (P9DirEnt) ||
+      Reader->Count - Offset - sizeof (P9DirEnt) < DirEnt->Name.Size) {
+    return NULL;
+  }
+
+  return DirEnt;
+}
+
+/**
+
+  Tells whether a directory entry is returned. "." and ".." are left out of
+  the root, like FAT does, and so are names too long for a file info.
+
+**/
+STATIC
+BOOLEAN
+P9IsDirEntryListed (
+  IN P9_DIR_READER      *Reader,
+  IN P9DirEnt           *DirEnt
+  )
+{
+  if (DirEnt->Name.Size > P9_MAX_FLEN) {
+    return FALSE;
+  }
+
+  if (Reader->IsRoot && DirEnt->Name.Size == 1 && DirEnt->Name.String[0] == '.') {
+    return FALSE;
+  }
+
+  if (Reader->IsRoot && DirEnt->Name.Size == 2 && DirEnt->Name.String[0] == '.' && DirEnt->Name.String[1] == '.') {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+
+  Sends the message in the transmit buffer of a prefetch slot.
+
+**/
+STATIC
+EFI_STATUS
+P9SendPrefetch (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_DIR_PREFETCH *Slot,
+  IN UINTN              TxSize,
+  OUT VOID              *RxData,
+  IN UINTN              RxDataSize
+  )
+{
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+
+  Slot->Request.Tag        = ((P9Header *)Slot->TxData)->Tag;
+  Slot->Request.RxData     = RxData;
+  Slot->Request.RxDataSize = RxDataSize;
+
+  Fragment.FragmentLength = (UINT32)TxSize;
+  Fragment.FragmentBuffer = Slot->TxData;
+
+  return P9SendRequest (Volume, &Slot->Request, &Fragment, 1);
+}
+
+/**
+
+  Waits for the reply to the message sent from a prefetch slot.
+
+**/
+STATIC
+EFI_STATUS
+P9WaitPrefetch (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_DIR_PREFETCH *Slot,
+  IN UINT8              Id
+  )
+{
+  EFI_STATUS                    Status;
+
+  Status = P9WaitRequest (Volume, &Slot->Request);
   if (EFI_ERROR (Status)) {
-    goto Exit;
+    return Status;
   }
 
-  if (RxReadDir->Header.Id != Rreaddir) {
-    Status = P9Error (RxReadDir, RxReadDirSize);
-    goto Exit;
+  return P9CheckMessage (Id, Slot->Request.RxData, Slot->Request.RxLength);
+}
+
+/**
+
+  Fetches the attributes of the entries of the last Treaddir reply from
+  Reader->Next on, up to P9_READDIR_PIPELINE_DEPTH of them.
+
+  The entries are walked to from a clone of the directory. The Twalks are
+  all sent before the first reply is waited for, and so are the Tgetattrs
+  and the Tclunks that follow, so that a batch of entries costs three round
+  trips rather than three per entry.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The open directory.
+  @param  Reader                - The state of the enumeration.
+
+  @retval EFI_SUCCESS           - The slots of the entries are filled in,
+                                  each with the status of its own requests.
+  @return Others                - The directory could not be cloned.
+
+**/
+STATIC
+EFI_STATUS
+P9PrefetchDirEntries (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  IN OUT P9_DIR_READER  *Reader
+  )
+{
+  EFI_STATUS                    Status;
+  P9_IFILE                      Dir;
+  P9_DIR_PREFETCH               *Slot;
+  P9DirEnt                      *DirEnt;
+  P9RWalk                       *RxWalk;
+  CHAR16                        *Name;
+  UINT32                        Offset;
+  UINTN                         Count;
+  UINTN                         Index;
+  UINTN                         TxSize;
+
+  Reader->PrefetchCount = 0;
+  Reader->PrefetchNext  = 0;
+
+  Status = P9Walk (Volume, IFile, &Dir, L".", FALSE);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // The name of each entry is converted in the file name buffer of Entry,
+  // which the entry decoded next overwrites anyway.
+  //
+  Name  = Reader->Entry->FileName;
+  Count = 0;
+  for (Offset = Reader->Next; Count < P9_READDIR_PIPELINE_DEPTH; Offset += sizeof (P9DirEnt) + DirEnt->Name.Size) {
+    DirEnt = P9GetDirEntry (Reader, Offset);
+    if (DirEnt == NULL) {
+      break;
+    }
+
+    if (!P9IsDirEntryListed (Reader, DirEnt)) {
+      continue;
+    }
+
+    Slot = &Reader->Prefetch[Count++];
+    Slot->Offset   = Offset;
+    Slot->Fid      = GetFid ();
+    Slot->IsWalked = FALSE;
+
+    P9StringToUnicodeStrS (&DirEnt->Name, Name, P9_MAX_FLEN + 1);
+    Slot->NWName = P9CountWalkNames (Name);
+    Slot->Status = P9EncodeMessage (
+                     Slot->TxData,
+                     sizeof (Slot->TxData),
+                     Twalk,
+                     P9GetTag (Volume),
+                     &TxSize,
+                     Dir.Fid,
+                     Slot->Fid,
+                     Name
+                     );
+    if (!EFI_ERROR (Slot->Status)) {
+      Slot->Status = P9SendPrefetch (Volume, Slot, TxSize, Slot->RxData, sizeof (Slot->RxData));
+    }
+  }
+
+  for (Index = 0; Index < Count; Index++) {
+    Slot = &Reader->Prefetch[Index];
+    if (EFI_ERROR (Slot->Status)) {
+      continue;
+    }
+
+    RxWalk = (P9RWalk *)Slot->RxData;
+    Slot->Status = P9WaitPrefetch (Volume, Slot, Twalk);
+    if (!EFI_ERROR (Slot->Status)) {
+      //
+      // A walk that stops early does not create the fid.
+      //
+      if (RxWalk->NWQid != Slot->NWName) {
+        Slot->Status = EFI_NOT_FOUND;
+        continue;
+      }
+
+      Slot->IsWalked = TRUE;
+      P9EncodeMessage (
+        Slot->TxData,
+        sizeof (Slot->TxData),
+        Tgetattr,
+        P9GetTag (Volume),
+        &TxSize,
+        Slot->Fid,
+        (UINT64)P9_GETATTR_ALL
+        );
+      Slot->Status = P9SendPrefetch (Volume, Slot, TxSize, Slot->RxData, sizeof (Slot->RxData));
+    }
+  }
+
+  for (Index = 0; Index < Count; Index++) {
+    Slot = &Reader->Prefetch[Index];
+    if (Slot->IsWalked && !EFI_ERROR (Slot->Status)) {
+      Slot->Status = P9WaitPrefetch (Volume, Slot, Tgetattr);
+    }
+  }
+
+  //
+  // The clunks are only sent once the attributes are in, and the replies
+  // go to RxClunk, so that an error does not overwrite them.
+  //
+  for (Index = 0; Index < Count; Index++) {
+    Slot = &Reader->Prefetch[Index];
+    if (Slot->IsWalked) {
+      P9EncodeMessage (Slot->TxData, sizeof (Slot->TxData), Tclunk, P9GetTag (Volume), &TxSize, Slot->Fid);
+      if (EFI_ERROR (P9SendPrefetch (Volume, Slot, TxSize, &Slot->RxClunk, sizeof (Slot->RxClunk)))) {
+        Slot->IsWalked = FALSE;
+      }
+    }
+  }
+
+  for (Index = 0; Index < Count; Index++) {
+    Slot = &Reader->Prefetch[Index];
+    if (Slot->IsWalked) {
+      P9WaitPrefetch (Volume, Slot, Tclunk);
+      Slot->IsWalked = FALSE;
+    }
+  }
+
+  //
+  // The clone is kept for the next batch when the directory has a path.
+  //
+  if (IFile->Path == NULL ||
+      EFI_ERROR (P9CacheFid (Volume, IFile->Root->Fid, Dir.Fid, IFile->Path, StrLen (IFile->Path), &Dir.Qid))) {
+    P9ClunkFid (Volume, Dir.Fid);
   }
 
-  CopyMem (Data, (VOID *)RxReadDir->Data, RxReadDir->Count);
-  *Count = RxReadDir->Count;
+  Reader->PrefetchCount = Count;
+
+  return EFI_SUCCESS;
+}
+
+/**
 
-  Status = EFI_SUCCESS;
+  Decodes a directory entry into the file info of Reader->Entry. An entry
+  removed since it was read is described by its name and type only.
 
-Exit:
-  if (TxReadDir != NULL) {
-    FreePool (TxReadDir);
+**/
+EFI_STATUS
+P9DecodeDirEntry (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  IN OUT P9_DIR_READER  *Reader,
+  IN P9DirEnt           *DirEnt
+  )
+{
+  EFI_STATUS                    Status;
+  P9_IFILE                      *Entry;
+  EFI_FILE_INFO                 *FileInfo;
+  P9_DIR_PREFETCH               *Slot;
+
+  if (Reader->PrefetchNext == Reader->PrefetchCount ||
+      Reader->Prefetch[Reader->PrefetchNext].Offset != Reader->Next) {
+    Status = P9PrefetchDirEntries (Volume, IFile, Reader);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  ASSERT (Reader->PrefetchNext < Reader->PrefetchCount);
+  Slot = &Reader->Prefetch[Reader->PrefetchNext++];
+
+  Entry    = Reader->Entry;
+  FileInfo = Entry->FileInfo;
+  P9StringToUnicodeStrS (&DirEnt->Name, Entry->FileName, P9_MAX_FLEN + 1);
+
+  Status = Slot->Status;
+  if (!EFI_ERROR (Status)) {
+    Status = P9ParseGetAttr (Entry, (P9RGetAttr *)Slot->RxData);
   }
 
-  if (RxReadDir != NULL) {
-    FreePool (RxReadDir);
+  if (Status == EFI_NOT_FOUND) {
+    ZeroMem (FileInfo, SIZE_OF_EFI_FILE_INFO);
+    FileInfo->Size      = SIZE_OF_EFI_FILE_INFO + StrSize (Entry->FileName);
+    FileInfo->Attribute = (DirEnt->Qid.Type & QTDir) ? EFI_FILE_DIRECTORY : EFI_FILE_ARCHIVE;
+    StrCpyS (FileInfo->FileName, P9_MAX_FLEN + 1, Entry->FileName);
+    Status = EFI_SUCCESS;
   }
 
   return Status;
 }
+
+/**
+
+  Returns the next entry of a directory being enumerated, reading the next
+  batch of entries when the last one is used up. The entry stays the next
+  one until P9NextDirEntry() is called. "." and ".." are left out of the
+  root, like FAT does.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The open directory.
+  @param  Reader                - The state of the enumeration.
+  @param  FileInfo              - Gets the file info of the entry, or NULL
+                                  at the end of the directory.
+
+  @retval EFI_SUCCESS           - FileInfo is set.
+  @return Others                - The directory could not be read.
+
+**/
+EFI_STATUS
+P9PeekDirEntry (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  IN OUT P9_DIR_READER  *Reader,
+  OUT EFI_FILE_INFO     **FileInfo
+  )
+{
+  EFI_STATUS                    Status;
+  P9DirEnt                      *DirEnt;
+  UINT32                        Size;
+
+  while (!Reader->HasEntry) {
+    if (Reader->Next >= Reader->Count) {
+      if (Reader->IsEnd) {
+        *FileInfo = NULL;
+        return EFI_SUCCESS;
+      }
+
+      Reader->Count = Reader->BufferSize;
+      Status = P9LReadDir (Volume, IFile, Reader->Cookie, &Reader->Count, Reader->Buffer);
+      if (EFI_ERROR (Status)) {
+        Reader->Count = 0;
+        return Status;
+      }
+      Reader->Next          = 0;
+      Reader->PrefetchCount = 0;
+      Reader->PrefetchNext  = 0;
+
+      if (Reader->Count == 0) {
+        Reader->IsEnd = TRUE;
+        if (Reader->Pending != NULL) {
+          P9CacheDirSnapshot (Volume, Reader->Pending);
+          Reader->Pending = NULL;
+        }
+      }
+      continue;
+    }
+
+    DirEnt = P9GetDirEntry (Reader, Reader->Next);
+    if (DirEnt == NULL) {
+      //
+      // A reply that does not hold a whole entry would be asked for again.
+      //
+      if (Reader->Next == 0) {
+        return EFI_DEVICE_ERROR;
+      }
+      Reader->Next = Reader->Count;
+      continue;
+    }
+    Size = sizeof (P9DirEnt) + DirEnt->Name.Size;
+
+    if (P9IsDirEntryListed (Reader, DirEnt)) {
+      Status = P9DecodeDirEntry (Volume, IFile, Reader, DirEnt);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+      Reader->HasEntry = TRUE;
+    }
+
+    Reader->Next  += Size;
+    Reader->Cookie = DirEnt->Offset;
+  }
+
+  *FileInfo = Reader->Entry->FileInfo;
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Moves past the entry returned by P9PeekDirEntry(), recording it in the
+  listing. A listing that grows too large is given up, and the rest of the
+  directory is only streamed.
+
+  @param  Reader                - The state of the enumeration.
+
+**/
+VOID
+P9NextDirEntry (
+  IN OUT P9_DIR_READER  *Reader
+  )
+{
+  EFI_STATUS                    Status;
+
+  if (Reader->Pending != NULL) {
+    Status = P9AppendDirEntry (Reader->Pending, Reader->Entry->FileInfo);
+    if (EFI_ERROR (Status)) {
+      P9ReleaseDirSnapshot (Reader->Pending);
+      Reader->Pending = NULL;
+    }
+  }
+
+  Reader->HasEntry = FALSE;
+}
+
+/**
+
+  Ends the enumeration of a directory.
+
+  @param  Reader                - The state of the enumeration. It is freed.
+
+**/
+VOID
+P9CloseDirReader (
+  IN P9_DIR_READER      *Reader
+  )
+{
+  if (Reader->Buffer != NULL) {
+    FreePool (Reader->Buffer);
+  }
+  if (Reader->Prefetch != NULL) {
+    FreePool (Reader->Prefetch);
+  }
+  if (Reader->Entry != NULL) {
+    if (Reader->Entry->FileInfo != NULL) {
+      FreePool (Reader->Entry->FileInfo);
+    }
+    if (Reader->Entry->FileName != NULL) {
+      FreePool (Reader->Entry->FileName);
+    }
+    FreePool (Reader->Entry);
+  }
+  if (Reader->Pending != NULL) {
+    P9ReleaseDirSnapshot (Reader->Pending);
+  }
+  FreePool (Reader);
+}
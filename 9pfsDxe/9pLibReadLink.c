@@ -8,71 +8,199 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 #include "9pLib.h"
 
+/**
+
+  Finds the cached target of a symbolic link. The target is only used while
+  the qid version of the link is the one it was read at.
+
+  @param  Volume                - The 9P volume.
+  @param  LinkQid               - The qid of the link.
+  @param  Target                - Gets the target.
+  @param  TargetLength          - Maximum length of the target in Target.
+
+  @retval TRUE                  - Target holds the target of the link.
+  @retval FALSE                 - The link has to be read.
+
+**/
+BOOLEAN
+P9LookupLink (
+  IN P9_VOLUME          *Volume,
+  IN Qid                *LinkQid,
+  OUT CHAR16            *Target,
+  IN UINTN              TargetLength
+  )
+{
+  P9_CACHED_LINK                *Entry;
+  UINTN                         Index;
+
+  for (Index = 0; Index < P9_LINK_CACHE_SIZE; Index++) {
+    Entry = &Volume->LinkCache[Index];
+    if (Entry->Target != NULL &&
+        Entry->Qid.Path == LinkQid->Path &&
+        Entry->Qid.Version == LinkQid->Version &&
+        StrLen (Entry->Target) <= TargetLength) {
+      StrCpyS (Target, TargetLength + 1, Entry->Target);
+      Entry->LastUsed = P9GetTick ();
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+
+  Keeps the target of a symbolic link, replacing an older target of the same
+  link or else the target used least recently.
+
+**/
+VOID
+P9CacheLink (
+  IN P9_VOLUME          *Volume,
+  IN Qid                *LinkQid,
+  IN CHAR16             *Target
+  )
+{
+  P9_CACHED_LINK                *Entry;
+  P9_CACHED_LINK                *Victim;
+  UINTN                         Index;
+
+  Victim = &Volume->LinkCache[0];
+  for (Index = 0; Index < P9_LINK_CACHE_SIZE; Index++) {
+    Entry = &Volume->LinkCache[Index];
+    if (Entry->Target == NULL || Entry->Qid.Path == LinkQid->Path) {
+      Victim = Entry;
+      break;
+    }
+    if (Entry->LastUsed < Victim->LastUsed) {
+      Victim = Entry;
+    }
+  }
+
+  if (Victim->Target != NULL) {
+    FreePool (Victim->Target);
+  }
+
+  Victim->Target = AllocateCopyPool (StrSize (Target), Target);
+  CopyMem (&Victim->Qid, LinkQid, QID_SIZE);
+  Victim->LastUsed = P9GetTick ();
+}
+
+/**
+
+  Reads the target of the symbolic link Fid refers to, from the link cache
+  when the link did not change since it was last read.
+
+  @param  Volume                - The 9P volume.
+  @param  Fid                   - The fid of the link.
+  @param  LinkQid               - The qid of the link.
+  @param  Target                - Gets the target, as sent by the server.
+  @param  TargetLength          - Maximum length of the target in Target.
+
+  @retval EFI_SUCCESS           - Target holds the target of the link.
+  @return Others                - The link could not be read.
+
+**/
 EFI_STATUS
-P9LReadLink (
+P9ReadLinkFid (
   IN P9_VOLUME          *Volume,
-  IN OUT P9_IFILE       *IFile
+  IN UINT32             Fid,
+  IN Qid                *LinkQid,
+  OUT CHAR16            *Target,
+  IN UINTN              TargetLength
   )
 {
   EFI_STATUS                    Status;
-  P9TReadLink                   *TxReadLink;
   P9RReadLink                   *RxReadLink;
   UINTN                         RxReadLinkSize;
-  UINTN                         PathLength;
 
-  TxReadLink = AllocateZeroPool (sizeof (P9TReadLink));
-  if (TxReadLink == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
+  if (P9LookupLink (Volume, LinkQid, Target, TargetLength)) {
+    return EFI_SUCCESS;
   }
 
-  TxReadLink->Header.Size = sizeof (P9TReadLink);
-  TxReadLink->Header.Id   = Treadlink;
-  TxReadLink->Header.Tag  = Volume->Tag;
-  TxReadLink->Fid         = IFile->Fid;
-
   RxReadLinkSize = sizeof (P9RReadLink) + P9_MAX_PATH;
-  RxReadLink = AllocateZeroPool (RxReadLinkSize);
+  RxReadLink = P9ReserveMessage (Volume, RxReadLinkSize);
   if (RxReadLink == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
+    return EFI_OUT_OF_RESOURCES;
   }
 
-  Status = DoP9 (
-    Volume,
-    TxReadLink,
-    sizeof (P9TReadLink),
-    RxReadLink,
-    RxReadLinkSize
-    );
+  Status = P9Rpc (Volume, Treadlink, RxReadLink, RxReadLinkSize, NULL, 0, Fid);
   if (EFI_ERROR (Status)) {
     goto Exit;
   }
 
-  if (RxReadLink->Header.Id != Rreadlink) {
-    Status = P9Error (RxReadLink, RxReadLinkSize);
+  Status = P9StringToUnicodeStrS (&RxReadLink->Target, Target, TargetLength + 1);
+  if (EFI_ERROR (Status)) {
     goto Exit;
   }
 
-  PathLength = RxReadLink->Target.Size;
-  AsciiStrnToUnicodeStrS (
-    RxReadLink->Target.String,
-    RxReadLink->Target.Size,
-    IFile->SymLinkTarget,
-    P9_MAX_PATH,
-    &PathLength
-    );
-
-  Status = EFI_SUCCESS;
+  P9CacheLink (Volume, LinkQid, Target);
 
 Exit:
-  if (TxReadLink != NULL) {
-    FreePool (TxReadLink);
+  P9ReleaseMessage (Volume, RxReadLink);
+
+  return Status;
+}
+
+/**
+
+  Reads the target of an open symbolic link into IFile->SymLinkTarget, which
+  is sized to the target.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The open link.
+
+  @retval EFI_SUCCESS           - IFile->SymLinkTarget holds the target.
+  @return Others                - The link could not be read.
+
+**/
+EFI_STATUS
+P9LReadLink (
+  IN P9_VOLUME          *Volume,
+  IN OUT P9_IFILE       *IFile
+  )
+{
+  EFI_STATUS                    Status;
+  CHAR16                        *Target;
+
+  Target = Volume->LinkTarget;
+  Status = P9ReadLinkFid (Volume, IFile->Fid, &IFile->Qid, Target, P9_MAX_PATH);
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
 
-  if (RxReadLink != NULL) {
-    FreePool (RxReadLink);
+  if (IFile->SymLinkTarget != NULL) {
+    FreePool (IFile->SymLinkTarget);
   }
 
-  return Status;
+  IFile->SymLinkTarget = AllocateCopyPool (StrSize (Target), Target);
+  if (IFile->SymLinkTarget == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Empties the link cache of a connection. A reconnected volume may be served
+  by another replica, whose qids are unrelated.
+
+  @param  Volume                - The 9P volume.
+
+**/
+VOID
+P9ResetLinkCache (
+  IN P9_VOLUME          *Volume
+  )
+{
+  UINTN                         Index;
+
+  for (Index = 0; Index < P9_LINK_CACHE_SIZE; Index++) {
+    if (Volume->LinkCache[Index].Target != NULL) {
+      FreePool (Volume->LinkCache[Index].Target);
+    }
+  }
+
+  ZeroMem (Volume->LinkCache, sizeof (Volume->LinkCache));
 }
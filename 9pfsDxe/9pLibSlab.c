@@ -0,0 +1,126 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+//
+// The start of every page of a slab, linking the pages to be freed.
+//
+typedef struct _P9_SLAB_PAGE P9_SLAB_PAGE;
+
+struct _P9_SLAB_PAGE {
+  P9_SLAB_PAGE              *Next;
+};
+
+#define P9_SLAB_PAGE_HEADER_SIZE  ALIGN_VALUE (sizeof (P9_SLAB_PAGE), 8)
+
+/**
+
+  Prepares an empty slab of objects of ObjectSize bytes. No page is
+  allocated until the first object is.
+
+  @param  Slab                  - The slab.
+  @param  ObjectSize            - Size of the objects.
+
+**/
+VOID
+P9InitSlab (
+  OUT P9_SLAB           *Slab,
+  IN UINTN              ObjectSize
+  )
+{
+  ASSERT (ObjectSize <= EFI_PAGE_SIZE - P9_SLAB_PAGE_HEADER_SIZE);
+
+  Slab->ObjectSize = ALIGN_VALUE (MAX (ObjectSize, sizeof (VOID *)), 8);
+  Slab->FreeList   = NULL;
+  Slab->Pages      = NULL;
+}
+
+/**
+
+  Takes an object from a slab, carving a new page into objects when none is
+  free. The object is not zeroed.
+
+  @param  Slab                  - The slab.
+
+  @return The object, or NULL if no page could be allocated.
+
+**/
+VOID *
+P9AllocateObject (
+  IN OUT P9_SLAB        *Slab
+  )
+{
+  P9_SLAB_PAGE                  *Page;
+  UINT8                         *Object;
+  UINTN                         Offset;
+  VOID                          *Result;
+
+  if (Slab->FreeList == NULL) {
+    Page = AllocatePages (1);
+    if (Page == NULL) {
+      return NULL;
+    }
+    Page->Next  = Slab->Pages;
+    Slab->Pages = Page;
+
+    for (Offset = P9_SLAB_PAGE_HEADER_SIZE;
+         Offset + Slab->ObjectSize <= EFI_PAGE_SIZE;
+         Offset += Slab->ObjectSize) {
+      Object = (UINT8 *)Page + Offset;
+      *(VOID **)Object = Slab->FreeList;
+      Slab->FreeList   = Object;
+    }
+  }
+
+  Result         = Slab->FreeList;
+  Slab->FreeList = *(VOID **)Result;
+
+  return Result;
+}
+
+/**
+
+  Returns an object to the slab it was taken from.
+
+  @param  Slab                  - The slab.
+  @param  Object                - The object.
+
+**/
+VOID
+P9FreeObject (
+  IN OUT P9_SLAB        *Slab,
+  IN VOID               *Object
+  )
+{
+  *(VOID **)Object = Slab->FreeList;
+  Slab->FreeList   = Object;
+}
+
+/**
+
+  Frees the pages of a slab. No object of the slab may be in use.
+
+  @param  Slab                  - The slab.
+
+**/
+VOID
+P9DestroySlab (
+  IN OUT P9_SLAB        *Slab
+  )
+{
+  P9_SLAB_PAGE                  *Page;
+
+  while (Slab->Pages != NULL) {
+    Page        = Slab->Pages;
+    Slab->Pages = Page->Next;
+    FreePages (Page, 1);
+  }
+
+  Slab->FreeList = NULL;
+}
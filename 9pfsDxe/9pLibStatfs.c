@@ -8,78 +8,110 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 #include "9pLib.h"
 
+/**
+
+  Stores an Rstatfs reply in the file system info of Volume.
+
+  @param  Volume                - The 9P volume.
+  @param  Fid                   - The fid the Tstatfs was sent for.
+  @param  RxStatfs              - The reply.
+
+  @retval EFI_SUCCESS           - The file system info is updated.
+  @retval EFI_OUT_OF_RESOURCES  - Can not allocate the file system info.
+
+**/
 EFI_STATUS
-P9Statfs (
-  IN P9_VOLUME          *Volume
+P9ParseStatfs (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid,
+  IN P9RStatfs          *RxStatfs
   )
 {
-  EFI_STATUS                    Status;
-  P9TStatfs                     *TxStatfs;
-  P9RStatfs                     *RxStatfs;
   UINTN                         Size;
   EFI_FILE_SYSTEM_INFO          *FileSystemInfo;
 
-  TxStatfs = AllocateZeroPool (sizeof (P9TStatfs));
-  if (TxStatfs == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  TxStatfs->Header.Size  = sizeof (P9TStatfs);
-  TxStatfs->Header.Id    = Tstatfs;
-  TxStatfs->Header.Tag   = Volume->Tag;
-  TxStatfs->Fid          = Volume->Root->Fid;
-
-  RxStatfs = AllocateZeroPool (sizeof (P9RStatfs));
-  if (RxStatfs == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  Status = DoP9 (
-    Volume,
-    TxStatfs,
-    sizeof (P9TStatfs),
-    RxStatfs,
-    sizeof (P9RStatfs)
-    );
-  if (EFI_ERROR (Status)) {
-    goto Exit;
-  }
-
-  if (RxStatfs->Header.Id != Rstatfs) {
-    Status = P9Error (RxStatfs, sizeof (P9RStatfs));
-    goto Exit;
-  }
-
   Size = SIZE_OF_EFI_FILE_SYSTEM_INFO + StrSize (P9_VOLUME_LABEL);
   if (Volume->FileSystemInfo == NULL) {
     Volume->FileSystemInfo = AllocateZeroPool (Size);
     if (Volume->FileSystemInfo == NULL) {
-      Status = EFI_OUT_OF_RESOURCES;
-      goto Exit;
+      return EFI_OUT_OF_RESOURCES;
     }
   }
 
   FileSystemInfo = Volume->FileSystemInfo;
 
   FileSystemInfo->Size        = Size;
-  FileSystemInfo->ReadOnly    = TRUE; // XXX: Currently read-only.
+  FileSystemInfo->ReadOnly    = FALSE;
   FileSystemInfo->VolumeSize  = RxStatfs->BSize * RxStatfs->Blocks;
   FileSystemInfo->FreeSpace   = RxStatfs->BSize * RxStatfs->BFree;
   FileSystemInfo->BlockSize   = RxStatfs->BSize;
   StrCpyS (FileSystemInfo->VolumeLabel, StrSize (P9_VOLUME_LABEL), P9_VOLUME_LABEL);
 
-  Status = EFI_SUCCESS;
+  Volume->FileSystemInfoFid = Fid;
+  Volume->FileSystemInfoAt  = P9GetTick ();
 
-Exit:
-  if (TxStatfs != NULL) {
-    FreePool (TxStatfs);
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+P9Statfs (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid
+  )
+{
+  EFI_STATUS                    Status;
+  P9RStatfs                     RxStatfs;
+
+  Status = P9Rpc (Volume, Tstatfs, &RxStatfs, sizeof (P9RStatfs), NULL, 0, Fid);
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
 
-  if (RxStatfs != NULL) {
-    FreePool (RxStatfs);
+  return P9ParseStatfs (Volume, Fid, &RxStatfs);
+}
+
+/**
+
+  Makes sure the file system info of Volume describes the export of Fid and
+  is not older than P9_STATFS_CACHE_TTL, sending a Tstatfs otherwise.
+
+  @param  Volume                - The 9P volume.
+  @param  Fid                   - The root fid of the export.
+
+  @retval EFI_SUCCESS           - Volume->FileSystemInfo is up to date.
+  @return Others                - The file system info could not be read.
+
+**/
+EFI_STATUS
+P9LookupStatfs (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid
+  )
+{
+  if (Volume->FileSystemInfo != NULL &&
+      Volume->FileSystemInfoFid == Fid &&
+      P9GetTick () - Volume->FileSystemInfoAt < P9_STATFS_CACHE_TTL) {
+    return EFI_SUCCESS;
   }
 
-  return Status;
+  return P9Statfs (Volume, Fid);
+}
+
+/**
+
+  Drops the file system info of a volume. A reconnected volume may be served
+  by another replica.
+
+  @param  Volume                - The 9P volume.
+
+**/
+VOID
+P9ResetStatfsCache (
+  IN P9_VOLUME          *Volume
+  )
+{
+  if (Volume->FileSystemInfo != NULL) {
+    FreePool (Volume->FileSystemInfo);
+    Volume->FileSystemInfo = NULL;
+  }
 }
@@ -8,6 +8,33 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 #include "9pLib.h"
 
+/**
+
+  Checks the version in an Rversion message against P9_VERSION.
+
+  @param  RxVersion             - The reply, checked by P9CheckMessage().
+  @param  MSize                 - The msize chosen by the server.
+
+  @retval EFI_SUCCESS           - The server accepted the version.
+  @retval EFI_UNSUPPORTED       - The server speaks another version.
+
+**/
+EFI_STATUS
+P9ParseVersion (
+  IN P9RVersion         *RxVersion,
+  OUT UINT32            *MSize
+  )
+{
+  if (RxVersion->Version.Size != AsciiStrLen (P9_VERSION) ||
+      AsciiStrnCmp (RxVersion->Version.String, P9_VERSION, RxVersion->Version.Size) != 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  *MSize = RxVersion->MSize;
+
+  return EFI_SUCCESS;
+}
+
 EFI_STATUS
 P9Version (
   IN P9_VOLUME          *Volume,
@@ -15,66 +42,29 @@ P9Version (
   )
 {
   EFI_STATUS                    Status;
-  UINTN                         VersionSize;
-  CHAR8                         *VersionString;
-  UINTN                         TxVersionSize;
-  UINTN                         RxVersionSize;
-  P9TVersion                    *TxVersion;
-  P9RVersion                    *RxVersion;
+  UINT8                         RxVersion[P9_VERSION_REPLY_SIZE];
+  UINT64                        Start;
 
-  VersionString = P9_VERSION;
-  VersionSize = AsciiStrLen (VersionString);
-  TxVersionSize = sizeof (P9TVersion) + sizeof (CHAR8) * VersionSize;
-  TxVersion = AllocateZeroPool (TxVersionSize);
-  if (TxVersion == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  TxVersion->Header.Size = TxVersionSize;
-  TxVersion->Header.Id = Tversion;
-  TxVersion->Header.Tag = P9_NOTAG;
-  TxVersion->MSize = *MSize;
-  AsciiStrToP9StringS (VersionString, &TxVersion->Version, VersionSize);
-
-  RxVersionSize = TxVersionSize;
-  RxVersion = AllocateZeroPool (RxVersionSize);
-  if (RxVersion == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  Status = DoP9 (
+  Start = P9GetTick ();
+  Status = P9Rpc (
     Volume,
-    TxVersion,
-    TxVersionSize,
+    Tversion,
     RxVersion,
-    RxVersionSize
+    sizeof (RxVersion),
+    NULL,
+    0,
+    *MSize,
+    P9_VERSION
     );
   if (EFI_ERROR (Status)) {
-    goto Exit;
+    return Status;
   }
 
-  if (RxVersion->Header.Id != Rversion) {
-    Status = P9Error (RxVersion, sizeof (RxVersionSize));
-    goto Exit;
-  }
-
-  if (AsciiStrnCmp (TxVersion->Version.String, RxVersion->Version.String, TxVersion->Version.Size) != 0) {
-    Status = EFI_UNSUPPORTED;
-    goto Exit;
-  }
-
-  *MSize = RxVersion->MSize;
-
-Exit:
-  if (TxVersion != NULL) {
-    FreePool (TxVersion);
-  }
-
-  if (RxVersion != NULL) {
-    FreePool (RxVersion);
-  }
+  //
+  // Tversion is the first round trip on the connection and carries no
+  // server-side work, so it is a clean sample of the network RTT.
+  //
+  Volume->Rtt = P9GetTick () - Start;
 
-  return Status;
-}
\ No newline at end of file
+  return P9ParseVersion ((P9RVersion *)RxVersion, MSize);
+}
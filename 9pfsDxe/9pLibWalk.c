@@ -8,192 +8,918 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 #include "9pLib.h"
 
-CHAR16 *
-P9GetNextNameComponent (
-  IN CHAR16   *Path,
-  OUT CHAR16  *Name
+//
+// Size of a buffer receiving an Rwalk of up to P9_MAX_WELEM qids.
+//
+#define P9_RWALK_MAX_SIZE   (sizeof (P9RWalk) + QID_SIZE * P9_MAX_WELEM)
+
+//
+// A walk to the parent directory of a file, sent along with the walk to the
+// file. The names walked and the Twalk are held in the message buffer of
+// the volume, from Names on, until the walk is finished.
+//
+typedef struct {
+  P9_REQUEST                Request;
+  CHAR16                    *Names;
+  UINT16                    NWName;
+  UINT32                    NewFid;
+  UINT8                     RxWalk[P9_RWALK_MAX_SIZE];
+} P9_PARENT_WALK;
+
+/**
+
+  Returns the length of a name of Path, which ends at a separator.
+
+**/
+UINTN
+P9NameLength (
+  IN CHAR16             *Path
   )
 {
-  while (*Path != 0 && *Path != PATH_NAME_SEPARATOR) {
-    *Name++ = *Path++;
+  UINTN       Length;
+
+  Length = 0;
+  while (Path[Length] != L'\0' && Path[Length] != PATH_NAME_SEPARATOR) {
+    Length++;
   }
-  *Name = L'\0';
+
+  return Length;
+}
+
+/**
+
+  Skips Count names of a path of names separated by backslashes. "." names
+  are skipped without being counted.
+
+  @param  Path                  - The path.
+  @param  Count                 - Number of names to skip.
+
+  @return The rest of the path, without leading separators.
+
+**/
+CHAR16 *
+P9SkipNames (
+  IN CHAR16             *Path,
+  IN UINTN              Count
+  )
+{
+  UINTN       Length;
 
   while (*Path == PATH_NAME_SEPARATOR) {
     Path++;
   }
 
+  while (*Path != L'\0') {
+    Length = P9NameLength (Path);
+    if (!(Length == 1 && Path[0] == L'.')) {
+      if (Count == 0) {
+        break;
+      }
+      Count--;
+    }
+
+    Path += Length;
+    while (*Path == PATH_NAME_SEPARATOR) {
+      Path++;
+    }
+  }
+
   return Path;
 }
 
+/**
+
+  Counts the names of Path a Twalk carries: the first P9_MAX_WELEM names,
+  "." names left out.
+
+  @param  Path                  - Names separated by backslashes, or NULL.
+
+  @return The number of names.
+
+**/
+UINT16
+P9CountWalkNames (
+  IN CHAR16             *Path
+  )
+{
+  CHAR16                        *End;
+  CHAR16                        *Name;
+  UINT16                        Count;
+
+  if (Path == NULL) {
+    return 0;
+  }
+
+  End   = P9SkipNames (Path, P9_MAX_WELEM);
+  Count = 0;
+  for (Name = P9SkipNames (Path, 0); Name < End; Name = P9SkipNames (Name + P9NameLength (Name), 0)) {
+    Count++;
+  }
+
+  return Count;
+}
+
+/**
+
+  Walks Fid to NewFid through the first P9_MAX_WELEM names of Path in one
+  round trip.
+
+  @param  Volume                - The 9P volume.
+  @param  Fid                   - The fid to walk from.
+  @param  NewFid                - The fid to walk to.
+  @param  Path                  - Names separated by backslashes. NULL or a
+                                  path without names clones Fid.
+  @param  NewQid                - The qid of the last name walked. Not set
+                                  by a clone.
+  @param  Walked                - Optional number of names walked.
+
+  @retval EFI_SUCCESS           - NewFid refers to the file.
+  @retval EFI_NOT_FOUND         - A name other than the first was not found.
+                                  NewQid and Walked tell how far the walk
+                                  got.
+  @return Others                - The walk failed.
+
+**/
 EFI_STATUS
 DoP9Walk (
   IN P9_VOLUME          *Volume,
   IN UINT32             Fid,
   IN UINT32             NewFid,
   IN CHAR16             *Path,
-  OUT Qid               *NewQid
+  OUT Qid               *NewQid,
+  OUT UINTN             *Walked OPTIONAL
   )
 {
   EFI_STATUS                    Status;
-  UINTN                         PathSize;
+  UINT8                         RxBuffer[P9_RWALK_MAX_SIZE];
+  P9RWalk                       *RxWalk;
   UINT16                        NWName;
-  P9TWalk                       *TxWalk;
+
+  RxWalk = (P9RWalk *)RxBuffer;
+  NWName = P9CountWalkNames (Path);
+
+  Status = P9Rpc (
+    Volume,
+    Twalk,
+    RxBuffer,
+    sizeof (RxBuffer),
+    NULL,
+    0,
+    Fid,
+    NewFid,
+    Path
+    );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (RxWalk->NWQid > NWName) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  if (RxWalk->NWQid != 0) {
+    CopyMem (NewQid, &RxWalk->WQid[RxWalk->NWQid - 1], QID_SIZE);
+  }
+
+  if (Walked != NULL) {
+    *Walked = RxWalk->NWQid;
+  }
+
+  //
+  // A walk that stops early does not create NewFid.
+  //
+  if (RxWalk->NWQid != NWName) {
+    return EFI_NOT_FOUND;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Hands out a new fid of a directory. A clone kept in the fid cache is used
+  when one is ready, Dir is cloned otherwise. Either way another clone is
+  started in the background, so that the root and the current directory,
+  which are opened again and again, are cloned off the critical path.
+
+  @param  Volume                - The 9P volume.
+  @param  Dir                   - The directory.
+  @param  NewIFile              - Receives the fid and the qid.
+
+  @retval EFI_SUCCESS           - NewIFile->Fid refers to Dir.
+  @return Others                - The clone failed.
+
+**/
+EFI_STATUS
+P9CloneDirectory (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *Dir,
+  OUT P9_IFILE          *NewIFile
+  )
+{
+  EFI_STATUS                    Status;
+  P9_CACHED_FID                 *Entry;
+  UINT32                        NewFid;
+
+  Entry = NULL;
+  if (Dir->Path != NULL) {
+    Entry = P9LookupFid (Volume, Dir->Root->Fid, Dir->Path, StrLen (Dir->Path));
+  }
+
+  if (Entry != NULL) {
+    P9TakeCachedFid (Entry, &NewIFile->Fid, &NewIFile->Qid);
+  } else {
+    NewFid = GetFid ();
+    Status = DoP9Walk (Volume, Dir->Fid, NewFid, NULL, NULL, NULL);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+    NewIFile->Fid = NewFid;
+    //
+    // A clone returns no qid.
+    //
+    CopyMem (&NewIFile->Qid, &Dir->Qid, QID_SIZE);
+  }
+
+  if (Dir->Path != NULL && (Dir->Qid.Type & QTDir) != 0) {
+    P9CacheClone (Volume, Dir->Root->Fid, Dir->Fid, Dir->Path, &Dir->Qid);
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Starts walking to the parent directory of the file a walk goes to, so that
+  the directory is cached by P9FinishParentWalk() for walks to its other
+  files. The walk shares the round trip of the walk to the file.
+
+  @param  Volume                - The 9P volume.
+  @param  Fid                   - The fid the walk to the file starts from.
+  @param  Path                  - The names walked to the file.
+
+  @return The pending walk, or NULL if it was not sent.
+
+**/
+P9_PARENT_WALK *
+P9StartParentWalk (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid,
+  IN CHAR16             *Path
+  )
+{
+  EFI_STATUS                    Status;
+  P9_PARENT_WALK                *Walk;
+  CHAR16                        *Names;
+  CHAR16                        *Last;
+  EFI_TCP4_FRAGMENT_DATA        Fragment;
+  UINT8                         *TxData;
+  VOID                          *TxWalk;
   UINTN                         TxWalkSize;
-  P9RWalk                       *RxWalk;
-  UINTN                         RxWalkSize;
 
-  PathSize = (Path == NULL) ? 0 : StrLen (Path);
-  NWName = (PathSize == 0) ? 0 : 1;
+  //
+  // Only a parent that one message reaches is walked to.
+  //
+  if (*P9SkipNames (Path, P9_MAX_WELEM + 1) != L'\0') {
+    return NULL;
+  }
 
-  TxWalkSize = sizeof (P9TWalk) + sizeof (P9String) * NWName + sizeof (CHAR8) * PathSize;
+  Names = P9ReserveMessage (Volume, StrSize (Path));
+  if (Names == NULL) {
+    return NULL;
+  }
 
-  TxWalk = AllocateZeroPool (TxWalkSize);
-  if (TxWalk == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
+  StrCpyS (Names, StrLen (Path) + 1, Path);
+  for (Last = Names + StrLen (Names); Last > Names && *Last != PATH_NAME_SEPARATOR; Last--) {
   }
+  *Last = L'\0';
 
-  TxWalk->Header.Size   = TxWalkSize;
-  TxWalk->Header.Id     = Twalk;
-  TxWalk->Header.Tag    = Volume->Tag;
-  TxWalk->Fid           = Fid;
-  TxWalk->NewFid        = NewFid;
-  TxWalk->NWName        = NWName;
-  if (NWName != 0) {
-    UnicodeStrToP9StringS (Path, &TxWalk->WName[0], PathSize);
+  Walk = (P9_PARENT_WALK *)P9AllocateRequest (Volume, sizeof (P9_PARENT_WALK));
+  if (Walk == NULL) {
+    goto Exit;
   }
 
-  RxWalkSize = sizeof (P9RWalk) + sizeof (Qid) * NWName;
-  RxWalk = AllocateZeroPool (RxWalkSize);
-  if (RxWalk == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
+  Walk->NWName = P9CountWalkNames (Names);
+  if (Walk->NWName == 0) {
     goto Exit;
   }
 
-  Status = DoP9 (
-    Volume,
-    TxWalk,
-    TxWalkSize,
-    RxWalk,
-    RxWalkSize
-    );
+  TxData = &Volume->MessageBuffer[Volume->MessageBufferUsed];
+  Walk->NewFid = GetFid ();
+  Status = P9EncodeMessage (
+             TxData,
+             P9_MESSAGE_BUFFER_SIZE - Volume->MessageBufferUsed,
+             Twalk,
+             P9GetTag (Volume),
+             &TxWalkSize,
+             Fid,
+             Walk->NewFid,
+             Names
+             );
   if (EFI_ERROR (Status)) {
     goto Exit;
   }
 
-  if (RxWalk->Header.Id != Rwalk) {
-    Status = P9Error (RxWalk, RxWalkSize);
+  TxWalk = P9ReserveMessage (Volume, TxWalkSize);
+  if (TxWalk == NULL) {
     goto Exit;
   }
 
-  if (NWName != 0) {
-    CopyMem (NewQid, &RxWalk->WQid[0], QID_SIZE);
+  Walk->Names              = Names;
+  Walk->Request.Tag        = ((P9Header *)TxWalk)->Tag;
+  Walk->Request.RxData     = Walk->RxWalk;
+  Walk->Request.RxDataSize = sizeof (Walk->RxWalk);
+
+  Fragment.FragmentLength = (UINT32)TxWalkSize;
+  Fragment.FragmentBuffer = TxWalk;
+
+  Status = P9SendRequest (Volume, &Walk->Request, &Fragment, 1);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
   }
 
+  return Walk;
+
 Exit:
-  if (TxWalk != NULL) {
-    FreePool (TxWalk);
+  P9ReleaseMessage (Volume, Names);
+  if (Walk != NULL) {
+    P9FreeRequest (Volume, &Walk->Request);
   }
 
-  if (RxWalk != NULL) {
-    FreePool (RxWalk);
+  return NULL;
+}
+
+/**
+
+  Waits for a walk started by P9StartParentWalk() and caches the parent
+  directory it reached.
+
+  @param  Volume                - The 9P volume.
+  @param  Walk                  - The pending walk. It is freed.
+  @param  RootFid               - The root fid of the export.
+  @param  Path                  - Absolute path of the parent directory.
+  @param  PathLength            - Length of the path in Path.
+
+**/
+VOID
+P9FinishParentWalk (
+  IN P9_VOLUME          *Volume,
+  IN P9_PARENT_WALK     *Walk,
+  IN UINT32             RootFid,
+  IN CHAR16             *Path,
+  IN UINTN              PathLength
+  )
+{
+  EFI_STATUS                    Status;
+  P9RWalk                       *RxWalk;
+
+  RxWalk = (P9RWalk *)Walk->RxWalk;
+  Status = P9WaitRequest (Volume, &Walk->Request);
+  P9ReleaseMessage (Volume, Walk->Names);
+  if (!EFI_ERROR (Status)) {
+    Status = P9CheckMessage (Twalk, RxWalk, Walk->Request.RxLength);
+  }
+
+  if (!EFI_ERROR (Status) && RxWalk->NWQid == Walk->NWName) {
+    Status = P9CacheFid (Volume, RootFid, Walk->NewFid, Path, PathLength, &RxWalk->WQid[Walk->NWName - 1]);
+    if (EFI_ERROR (Status)) {
+      P9ClunkFid (Volume, Walk->NewFid);
+    }
+  }
+
+  P9FreeRequest (Volume, &Walk->Request);
+}
+
+/**
+
+  Walks to the file at FullPath from the deepest directory on the path that
+  has a fid: Dir, a cached directory or the root.
+
+  @param  Volume                - The 9P volume.
+  @param  Root                  - The root directory of the export.
+  @param  Dir                   - A directory to walk from when FullPath is
+                                  under it.
+  @param  FullPath              - Absolute path as built by P9BuildPath().
+  @param  NewIFile              - Gets the fid and the qid of the file.
+  @param  LastQid               - The qid of the last file walked, when the
+                                  walk stopped early.
+  @param  WalkedLength          - Length of the part of FullPath walked.
+
+  @retval EFI_SUCCESS           - NewIFile refers to the file.
+  @return Others                - The walk failed. No fid is left behind.
+
+**/
+EFI_STATUS
+P9WalkPath (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *Root,
+  IN P9_IFILE           *Dir,
+  IN CHAR16             *FullPath,
+  OUT P9_IFILE          *NewIFile,
+  OUT Qid               *LastQid,
+  OUT UINTN             *WalkedLength
+  )
+{
+  EFI_STATUS      Status;
+  CHAR16          *Names;
+  CHAR16          *End;
+  P9_IFILE        *Start;
+  P9_CACHED_FID   *Entry;
+  P9_PARENT_WALK  *ParentWalk;
+  UINTN           Length;
+  UINTN           Walked;
+  UINT32          Fid;
+  UINT32          NewFid;
+
+  *WalkedLength = StrLen (FullPath);
+  SetMem (LastQid, QID_SIZE, 0);
+
+  Start  = Root;
+  Length = 0;
+  if (Dir != Root && Dir->Path != NULL) {
+    Length = StrLen (Dir->Path);
+    if (StrnCmp (FullPath, Dir->Path, Length) == 0 &&
+        (FullPath[Length] == L'\0' || FullPath[Length] == PATH_NAME_SEPARATOR)) {
+      Start = Dir;
+    } else {
+      Length = 0;
+    }
+  }
+
+  Fid   = Start->Fid;
+  Entry = P9LookupAncestorFid (Volume, Root->Fid, FullPath);
+  if (Entry != NULL && StrLen (Entry->Path) > Length) {
+    Fid    = Entry->Fid;
+    Length = StrLen (Entry->Path);
+  } else {
+    Entry = NULL;
+  }
+
+  Names = P9SkipNames (FullPath + Length, 0);
+  if (*Names == L'\0') {
+    // Nothing left to walk.
+    if (Entry != NULL) {
+      P9TakeCachedFid (Entry, &NewIFile->Fid, &NewIFile->Qid);
+      return EFI_SUCCESS;
+    }
+    return P9CloneDirectory (Volume, Start, NewIFile);
+  }
+
+  ParentWalk = NULL;
+  if (StrLen (Names) != P9NameLength (Names)) {
+    ParentWalk = P9StartParentWalk (Volume, Fid, Names);
+  }
+
+  NewFid = GetFid ();
+  Walked = 0;
+  Status = P9WalkFid (Volume, Fid, NewFid, Names, LastQid, &Walked);
+
+  if (ParentWalk != NULL) {
+    for (Length = StrLen (FullPath); FullPath[Length] != PATH_NAME_SEPARATOR; Length--) {
+    }
+    P9FinishParentWalk (Volume, ParentWalk, Root->Fid, FullPath, Length);
+  }
+
+  if (EFI_ERROR (Status)) {
+    End = Names;
+    if (Walked != 0) {
+      for (End = P9SkipNames (Names, Walked); End[-1] == PATH_NAME_SEPARATOR; End--) {
+      }
+    }
+    *WalkedLength = (UINTN)(End - FullPath);
+    return Status;
+  }
+
+  NewIFile->Fid = NewFid;
+  CopyMem (&NewIFile->Qid, LastQid, QID_SIZE);
+
+  return EFI_SUCCESS;
+}
+
+//
+// Depth of the walks P9ResolvePath makes to resolve names followed by "..",
+// which may themselves lead through links with ".." in their targets.
+//
+STATIC UINTN  mResolveDepth = 0;
+
+/**
+
+  Returns the offset in Path of the first ".." name that follows another
+  name of Path, or 0 if there is none. Such a ".." can only be collapsed
+  once the name before it is known not to be a symbolic link.
+
+**/
+STATIC
+UINTN
+P9FindLinkParent (
+  IN CHAR16             *Path
+  )
+{
+  CHAR16      *Name;
+  UINTN       Length;
+  BOOLEAN     HasName;
+
+  HasName = FALSE;
+  for (Name = Path; *Name != L'\0'; Name += Length) {
+    while (*Name == PATH_NAME_SEPARATOR) {
+      Name++;
+    }
+
+    Length = P9NameLength (Name);
+    if (Length == 2 && Name[0] == L'.' && Name[1] == L'.') {
+      if (HasName) {
+        return (UINTN)(Name - Path);
+      }
+    } else if (Length > 0 && !(Length == 1 && Name[0] == L'.')) {
+      HasName = TRUE;
+    }
+  }
+
+  return 0;
+}
+
+/**
+
+  Builds the absolute path of Path relative to Base, a path without links.
+
+  "." and ".." are resolved on the client, but a ".." after a name only
+  once the name is known not to be a link: the path up to the name is
+  walked first, following links, and the rest of Path is applied to the
+  resolved path. "dir\link\..\x" is thus "x" next to the target of the
+  link, not "dir\x". The directory walked to is left in the fid cache.
+
+  @param  Volume                - The 9P volume.
+  @param  Root                  - The root of the export.
+  @param  Base                  - Absolute path Path is relative to.
+  @param  Path                  - The path.
+  @param  FullPath              - Gets the absolute path, from pool.
+  @param  IsResolved            - Set to TRUE when links were resolved.
+
+  @retval EFI_SUCCESS           - FullPath is built.
+  @retval EFI_NOT_FOUND         - A name before ".." does not exist, or the
+                                  links nest too deeply.
+  @return Others                - The path could not be built.
+
+**/
+STATIC
+EFI_STATUS
+P9ResolvePath (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *Root,
+  IN CHAR16             *Base,
+  IN CHAR16             *Path,
+  OUT CHAR16            **FullPath,
+  IN OUT BOOLEAN        *IsResolved
+  )
+{
+  EFI_STATUS      Status;
+  P9_IFILE        Parent;
+  CHAR16          *Resolved;
+  CHAR16          *Prefix;
+  UINTN           Split;
+
+  *FullPath = NULL;
+  Resolved  = NULL;
+  for (;;) {
+    Split = P9FindLinkParent (Path);
+    if (Split == 0) {
+      break;
+    }
+
+    if (mResolveDepth == P9_MAX_SYMLINKS) {
+      Status = EFI_NOT_FOUND;
+      goto Exit;
+    }
+
+    Prefix = P9ReserveMessage (Volume, (Split + 1) * sizeof (CHAR16));
+    if (Prefix == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto Exit;
+    }
+    CopyMem (Prefix, Path, Split * sizeof (CHAR16));
+    Prefix[Split] = L'\0';
+
+    ZeroMem (&Parent, sizeof (P9_IFILE));
+    Parent.Root = Root;
+    Parent.Path = P9BuildPath (Base, Prefix);
+    P9ReleaseMessage (Volume, Prefix);
+    if (Parent.Path == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto Exit;
+    }
+
+    mResolveDepth++;
+    Status = P9Walk (Volume, Root, &Parent, Parent.Path, TRUE);
+    mResolveDepth--;
+    if (EFI_ERROR (Status)) {
+      FreePool (Parent.Path);
+      goto Exit;
+    }
+
+    if ((Parent.Qid.Type & QTDir) == 0 ||
+        EFI_ERROR (P9CacheFid (Volume, Root->Fid, Parent.Fid, Parent.Path, StrLen (Parent.Path), &Parent.Qid))) {
+      P9ClunkFid (Volume, Parent.Fid);
+    }
+
+    if (Resolved != NULL) {
+      FreePool (Resolved);
+    }
+    Resolved    = Parent.Path;
+    Base        = Resolved;
+    Path       += Split;
+    *IsResolved = TRUE;
+  }
+
+  *FullPath = P9BuildPath (Base, Path);
+  Status = (*FullPath == NULL) ? EFI_OUT_OF_RESOURCES : EFI_SUCCESS;
+
+Exit:
+  if (Resolved != NULL) {
+    FreePool (Resolved);
   }
 
   return Status;
 }
 
+/**
+
+  Walks to a file relative to an open file, following symbolic links on the
+  way when asked to. A link whose target is absolute is resolved from the
+  root of the export, as the root of the server is not reachable.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The file the path is relative to.
+  @param  NewIFile              - Gets the fid and the qid of the file. When
+                                  links were followed, its path is replaced
+                                  by the resolved one.
+  @param  Path                  - Path of the file.
+  @param  Follow                - Whether symbolic links are followed,
+                                  including the file itself.
+
+  @retval EFI_SUCCESS           - NewIFile refers to the file.
+  @retval EFI_NOT_FOUND         - The file does not exist, or more than
+                                  P9_MAX_SYMLINKS links were followed.
+  @return Others                - The walk failed.
+
+**/
 EFI_STATUS
 P9Walk (
   IN P9_VOLUME          *Volume,
   IN P9_IFILE           *IFile,
   OUT P9_IFILE          *NewIFile,
-  IN CHAR16             *Path
+  IN CHAR16             *Path,
+  IN BOOLEAN            Follow
   )
 {
-  EFI_STATUS  Status;
-  CHAR16      ComponentName[P9_MAX_PATH];
-  UINTN       PathLen;
-  CHAR16      *Next;
-  UINT32      Fid;
-  UINT32      NewFid;
-  Qid         NewQid;
+  EFI_STATUS      Status;
+  CHAR16          *FullPath;
+  CHAR16          *Target;
+  CHAR16          *Resolved;
+  CHAR16          *Rest;
+  CHAR16          *Link;
+  P9_IFILE        *Dir;
+  UINTN           Links;
+  UINTN           Length;
+  UINTN           Parent;
+  UINTN           ResolvedSize;
+  UINT32          LinkFid;
+  BOOLEAN         HasLinkFid;
+  BOOLEAN         IsResolved;
+  Qid             LinkQid;
 
-  PathLen = StrLen (Path);
-  if (PathLen == 0) {
+  if (StrLen (Path) == 0) {
     return EFI_INVALID_PARAMETER;
   }
 
   // Root directory.
   if (StrCmp (Path, L"\\") == 0) {
-    NewFid = GetFid ();
-    ZeroMem (&NewQid, QID_SIZE);
-    Status = DoP9Walk (Volume, Volume->Root->Fid, NewFid, NULL, &NewQid);
-    if (EFI_ERROR (Status)) {
-      goto Exit;
-    }
-    NewIFile->Fid = NewFid;
-    CopyMem (&NewIFile->Qid, &NewQid, QID_SIZE);
-    return EFI_SUCCESS;
+    return P9CloneDirectory (Volume, IFile->Root, NewIFile);
   }
 
+
   // Current directory.
   if (StrCmp (Path, L".") == 0) {
-    NewFid = GetFid ();
-    ZeroMem (&NewQid, QID_SIZE);
-    Status = DoP9Walk (Volume, IFile->Fid, NewFid, NULL, &NewQid);
-    if (EFI_ERROR (Status)) {
-      goto Exit;
-    }
-    NewIFile->Fid = NewFid;
-    CopyMem (&NewIFile->Qid, &NewQid, QID_SIZE);
-    return EFI_SUCCESS;
+    return P9CloneDirectory (Volume, IFile, NewIFile);
   }
 
   if (Path[0] == PATH_NAME_SEPARATOR) {
     // Absolute path.
-    Fid = Volume->Root->Fid;
-    Path++;
-    PathLen--;
+    Dir = IFile->Root;
+    while (*Path == PATH_NAME_SEPARATOR) {
+      Path++;
+    }
   } else {
     // Relative path.
-    Fid = IFile->Fid;
+    Dir = IFile;
   }
 
   // Parent of the root directory does not exist.
-  if (Fid == Volume->Root->Fid && StrnCmp (Path, L"..", 2) == 0) {
-    Status = EFI_NOT_FOUND;
-    goto Exit;
+  if (Dir == IFile->Root && StrnCmp (Path, L"..", 2) == 0) {
+    return EFI_NOT_FOUND;
   }
 
-  // Start at current location.
-  Next = Path;
-  for (;;) {
-    // Get the next component name.
-    Path = Next;
-    Next = P9GetNextNameComponent (Path, ComponentName);
-    // If end of the file name, we're done
-    if (ComponentName[0] == L'\0') {
-      break;
-    }
-    // If "dot", then current.
-    if (StrCmp (ComponentName, L".") == 0) {
+  //
+  // "." and ".." are resolved on the client, so that the server is sent a
+  // single walk from the deepest directory on the path that has a fid.
+  //
+  IsResolved = FALSE;
+  Status = P9ResolvePath (Volume, IFile->Root, Dir->Path, Path, &FullPath, &IsResolved);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // Link targets are read into a buffer of the volume. It is free again by
+  // the time P9ResolvePath() walks on, so nested walks may use it too.
+  //
+  Target     = Volume->LinkTarget;
+  Links      = 0;
+  while (TRUE) {
+    Status = P9WalkPath (Volume, IFile->Root, Dir, FullPath, NewIFile, &LinkQid, &Length);
+    if (!EFI_ERROR (Status)) {
+      if (!Follow || (NewIFile->Qid.Type & QTSymLink) == 0) {
+        break;
+      }
+      CopyMem (&LinkQid, &NewIFile->Qid, QID_SIZE);
+      LinkFid       = NewIFile->Fid;
+      HasLinkFid    = TRUE;
+      NewIFile->Fid = 0;
+    } else if (Follow && (LinkQid.Type & QTSymLink) != 0) {
+      //
+      // The walk stopped at a link to a directory.
+      //
+      HasLinkFid = FALSE;
+      Status     = EFI_SUCCESS;
+    } else if (Status == EFI_NOT_FOUND && Volume->Config.IgnoreCase) {
+      //
+      // The name may exist in another case. Each correction makes the name
+      // exact, so the walk gets further every time.
+      //
+      Status = P9FixNameCase (Volume, IFile->Root, FullPath, Length);
+      if (EFI_ERROR (Status)) {
+        goto Exit;
+      }
+      IsResolved = TRUE;
       continue;
+    } else {
+      goto Exit;
     }
 
-    NewFid = GetFid ();
-    SetMem (&NewQid, QID_SIZE, 0);
-    Status = DoP9Walk (Volume, Fid, NewFid, ComponentName, &NewQid);
+    if (Links++ == P9_MAX_SYMLINKS) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: Too many links: %s\n", __func__, __LINE__, FullPath));
+      Status = EFI_NOT_FOUND;
+    }
+
+    if (Status == EFI_SUCCESS && !HasLinkFid && !P9LookupLink (Volume, &LinkQid, Target, P9_MAX_PATH)) {
+      //
+      // The link is only walked to when its target is not cached. Its path
+      // is put in Target until the target is read over it.
+      //
+      if (Length > P9_MAX_PATH) {
+        Status = EFI_NOT_FOUND;
+        goto Exit;
+      }
+      CopyMem (Target, FullPath, Length * sizeof (CHAR16));
+      Target[Length] = L'\0';
+      LinkFid = GetFid ();
+      Status = P9WalkFid (Volume, IFile->Root->Fid, LinkFid, Target, &LinkQid, NULL);
+      if (EFI_ERROR (Status)) {
+        goto Exit;
+      }
+      HasLinkFid = TRUE;
+    }
+
+    if (HasLinkFid) {
+      if (!EFI_ERROR (Status)) {
+        Status = P9ReadLinkFid (Volume, LinkFid, &LinkQid, Target, P9_MAX_PATH);
+      }
+      P9ClunkFid (Volume, LinkFid);
+    }
+
+    if (EFI_ERROR (Status)) {
+      goto Exit;
+    }
+
+    if (Target[0] == L'\0') {
+      Status = EFI_NOT_FOUND;
+      goto Exit;
+    }
+
+    for (Link = Target; *Link != L'\0'; Link++) {
+      if (*Link == L'/') {
+        *Link = PATH_NAME_SEPARATOR;
+      }
+    }
+
+    //
+    // A relative target is resolved from the directory of the link, and
+    // the rest of the path from the target.
+    //
+    Rest = P9SkipNames (FullPath + Length, 0);
+    for (Parent = Length; Parent > 0 && FullPath[Parent] != PATH_NAME_SEPARATOR; Parent--) {
+    }
+    FullPath[Parent == 0 ? 1 : Parent] = L'\0';
+
+    ResolvedSize = StrLen (Target) + StrLen (Rest) + 2;
+    Resolved = AllocatePool (ResolvedSize * sizeof (CHAR16));
+    if (Resolved == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto Exit;
+    }
+    StrCpyS (Resolved, ResolvedSize, Target);
+    if (*Rest != L'\0') {
+      StrCatS (Resolved, ResolvedSize, L"\\");
+      StrCatS (Resolved, ResolvedSize, Rest);
+    }
+
+    Status = P9ResolvePath (Volume, IFile->Root, FullPath, Resolved, &Link, &IsResolved);
+    FreePool (Resolved);
     if (EFI_ERROR (Status)) {
       goto Exit;
     }
-    Fid = NewFid;
+
+    FreePool (FullPath);
+    FullPath   = Link;
+    Dir        = IFile->Root;
+    IsResolved = TRUE;
   }
 
-  NewIFile->Fid = NewFid;
-  CopyMem (&NewIFile->Qid, &NewQid, QID_SIZE);
-  Status = EFI_SUCCESS;
+  //
+  // Replays and stripe connections walk the resolved path, without
+  // following the links or correcting the case again.
+  //
+  if (IsResolved && NewIFile->Path != NULL) {
+    FreePool (NewIFile->Path);
+    NewIFile->Path = FullPath;
+    FullPath = NULL;
+  }
 
 Exit:
+  if (FullPath != NULL) {
+    FreePool (FullPath);
+  }
+
   return Status;
 }
+
+/**
+
+  Walks Path from Fid to NewFid, P9_MAX_WELEM names per message, walking
+  NewFid in place after the first message, so that no intermediate fid is
+  left behind. An empty path or "\" clones Fid.
+
+  @param  Volume                - The 9P volume.
+  @param  Fid                   - The fid to walk from.
+  @param  NewFid                - The fid to walk to. It must not be in use.
+  @param  Path                  - Path relative to Fid. A leading separator
+                                  is ignored.
+  @param  NewQid                - The qid of the file walked to.
+  @param  Walked                - Optional number of names walked.
+
+  @retval EFI_SUCCESS           - NewFid refers to the file.
+  @retval EFI_NOT_FOUND         - A name was not found. NewQid and Walked
+                                  tell how far the walk got.
+  @return Others                - The walk failed. NewFid is not in use.
+
+**/
+EFI_STATUS
+P9WalkFid (
+  IN P9_VOLUME          *Volume,
+  IN UINT32             Fid,
+  IN UINT32             NewFid,
+  IN CHAR16             *Path,
+  OUT Qid               *NewQid,
+  OUT UINTN             *Walked OPTIONAL
+  )
+{
+  EFI_STATUS  Status;
+  CHAR16      *Next;
+  BOOLEAN     IsWalked;
+  UINTN       Count;
+  UINTN       Total;
+
+  //
+  // A clone returns no qid, NewQid is left as it is.
+  //
+  IsWalked = FALSE;
+  Total    = 0;
+  do {
+    Next  = P9SkipNames (Path, P9_MAX_WELEM);
+    Count = 0;
+    Status = DoP9Walk (Volume, IsWalked ? NewFid : Fid, NewFid, Path, NewQid, &Count);
+    Total += Count;
+    if (Walked != NULL) {
+      *Walked = Total;
+    }
+    if (EFI_ERROR (Status)) {
+      if (IsWalked) {
+        P9ClunkFid (Volume, NewFid);
+      }
+      return Status;
+    }
+    IsWalked = TRUE;
+    Path = Next;
+  } while (*Path != L'\0');
+
+  return EFI_SUCCESS;
+}
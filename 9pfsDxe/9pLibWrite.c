@@ -0,0 +1,516 @@
+/** @file
+  9P library.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pLib.h"
+
+typedef struct {
+  P9_REQUEST                Request;
+  P9TWrite                  TxWrite;
+  P9RWrite                  RxWrite;
+  P9_WRITE_BATCH            *Batch;
+  BOOLEAN                   IsData;
+} P9_WRITE_PRIVATE_DATA;
+
+//
+// Twrites queued for an asynchronous WriteEx() or FlushEx(). The batch
+// holds one reference for each request in flight and one for the caller
+// until P9EndWriteBatch; the token is completed when the last is dropped.
+// Buffer is a write-back buffer handed over to the batch, freed with it.
+// DataOffset and DataSize locate the caller's data, and DataWritten is
+// what is reported in the token's BufferSize.
+//
+struct _P9_WRITE_BATCH {
+  P9_IFILE                  *IFile;
+  EFI_FILE_IO_TOKEN         *Token;
+  UINTN                     Pending;
+  EFI_STATUS                Status;
+  UINT8                     *Buffer;
+  BOOLEAN                   HasData;
+  UINT64                    DataOffset;
+  UINTN                     DataSize;
+  UINTN                     DataWritten;
+  BOOLEAN                   Fsync;
+};
+
+/**
+
+  Writes Data to IFile at Offset.
+
+  The data is cut into msize-bound Twrite requests and up to
+  P9_WRITE_PIPELINE_DEPTH of them are kept in flight. Each request is sent as
+  a header fragment followed by a fragment pointing into Data, so the payload
+  is never copied.
+
+  If the connection is lost, the volume fails over with P9Reconnect() and
+  the requests that were not answered are sent again once.
+
+  @param  Volume                - The 9P volume.
+  @param  IFile                 - The file to write.
+  @param  Offset                - File offset to write at.
+  @param  Count                 - On input, bytes to write. On output, bytes
+                                  written contiguously from Offset.
+  @param  Data                  - The data to write.
+
+  @retval EFI_SUCCESS           - All the data was written.
+  @return Others                - A request failed or the server wrote short.
+
+**/
+EFI_STATUS
+P9LWrite (
+  IN P9_VOLUME          *Volume,
+  IN P9_IFILE           *IFile,
+  IN UINT64             Offset,
+  IN OUT UINTN          *Count,
+  IN VOID               *Data
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_STATUS                    WriteStatus;
+  P9_WRITE_PRIVATE_DATA         *Slots[P9_WRITE_PIPELINE_DEPTH];
+  P9_WRITE_PRIVATE_DATA         *Slot;
+  EFI_TCP4_FRAGMENT_DATA        Fragments[2];
+  UINT32                        MaxCount;
+  UINT32                        Chunk;
+  UINTN                         Total;
+  UINTN                         Sent;
+  UINTN                         Written;
+  UINTN                         Head;
+  UINTN                         InFlight;
+  BOOLEAN                       IsRetried;
+  UINTN                         TxSize;
+
+  Total  = *Count;
+  *Count = 0;
+
+  //
+  // Slots are taken from the request slab when first used.
+  //
+  ZeroMem (Slots, sizeof (Slots));
+
+  MaxCount = Volume->MSize - sizeof (P9TWrite);
+  if (IFile->IoUnit != 0 && IFile->IoUnit < MaxCount) {
+    MaxCount = IFile->IoUnit;
+  }
+
+  WriteStatus = EFI_SUCCESS;
+  Sent        = 0;
+  Written     = Total;
+  Head        = 0;
+  InFlight    = 0;
+  IsRetried   = FALSE;
+  for (;;) {
+    //
+    // Fill the pipeline. Slots are used as a ring, oldest request at Head.
+    //
+    while (WriteStatus == EFI_SUCCESS && Sent < Written && InFlight < P9_WRITE_PIPELINE_DEPTH) {
+      Slot  = Slots[(Head + InFlight) % P9_WRITE_PIPELINE_DEPTH];
+      if (Slot == NULL) {
+        Slot = (P9_WRITE_PRIVATE_DATA *)P9AllocateRequest (Volume, sizeof (P9_WRITE_PRIVATE_DATA));
+        if (Slot == NULL) {
+          WriteStatus = EFI_OUT_OF_RESOURCES;
+          Written = MIN (Written, Sent);
+          break;
+        }
+        Slots[(Head + InFlight) % P9_WRITE_PIPELINE_DEPTH] = Slot;
+      }
+      Chunk = (UINT32)MIN ((UINTN)MaxCount, Total - Sent);
+
+      P9EncodeMessage (
+        &Slot->TxWrite,
+        sizeof (P9TWrite),
+        Twrite,
+        P9GetTag (Volume),
+        &TxSize,
+        IFile->Fid,
+        Offset + Sent,
+        Chunk
+        );
+
+      Slot->Request.Tag         = Slot->TxWrite.Header.Tag;
+      Slot->Request.RxData      = &Slot->RxWrite;
+      Slot->Request.RxDataSize  = sizeof (P9RWrite);
+
+      Fragments[0].FragmentLength = (UINT32)TxSize;
+      Fragments[0].FragmentBuffer = &Slot->TxWrite;
+      Fragments[1].FragmentLength = Chunk;
+      Fragments[1].FragmentBuffer = (UINT8 *)Data + Sent;
+
+      Status = P9SendRequest (Volume, &Slot->Request, Fragments, 2);
+      if (EFI_ERROR (Status)) {
+        DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+        WriteStatus = Status;
+        Written = MIN (Written, Sent);
+        break;
+      }
+
+      Sent += Chunk;
+      InFlight++;
+    }
+
+    if (InFlight == 0) {
+      //
+      // After a failover, send again from the first request not answered.
+      //
+      if (IsRetried || !P9IsConnectionLost (WriteStatus) || EFI_ERROR (P9Reconnect (Volume))) {
+        break;
+      }
+
+      MaxCount    = (UINT32)MIN (MaxCount, Volume->MSize - sizeof (P9TWrite));
+      IsRetried   = TRUE;
+      WriteStatus = EFI_SUCCESS;
+      Sent        = Written;
+      Written     = Total;
+      continue;
+    }
+
+    //
+    // Retire the oldest request.
+    //
+    Slot = Slots[Head];
+    Status = P9WaitRequest (Volume, &Slot->Request);
+    Head = (Head + 1) % P9_WRITE_PIPELINE_DEPTH;
+    InFlight--;
+
+    if (!EFI_ERROR (Status)) {
+      Status = P9CheckMessage (Twrite, &Slot->RxWrite, Slot->Request.RxLength);
+    }
+
+    if (EFI_ERROR (Status)) {
+      WriteStatus = Status;
+      Written = MIN (Written, Slot->TxWrite.Offset - Offset);
+    } else if (Slot->RxWrite.Count < Slot->TxWrite.Count) {
+      Written = MIN (Written, Slot->TxWrite.Offset - Offset + Slot->RxWrite.Count);
+    }
+  }
+
+  if (!EFI_ERROR (WriteStatus) && Written < Total) {
+    WriteStatus = EFI_DEVICE_ERROR;
+  }
+
+  *Count = Written;
+
+  for (Head = 0; Head < P9_WRITE_PIPELINE_DEPTH; Head++) {
+    if (Slots[Head] != NULL) {
+      P9FreeRequest (Volume, &Slots[Head]->Request);
+    }
+  }
+
+  return WriteStatus;
+}
+
+/**
+
+  Starts a batch of asynchronous writes completing Token. The batch is taken
+  from the request slab of the volume.
+
+  @param  IFile                 - The file to write.
+  @param  Token                 - The token to complete, with an event.
+
+  @return The batch, or NULL if it could not be allocated.
+
+**/
+P9_WRITE_BATCH *
+P9StartWriteBatch (
+  IN P9_IFILE           *IFile,
+  IN EFI_FILE_IO_TOKEN  *Token
+  )
+{
+  P9_WRITE_BATCH                *Batch;
+
+  ASSERT (sizeof (P9_WRITE_BATCH) <= P9_REQUEST_OBJECT_SIZE);
+
+  Batch = P9AllocateObject (&IFile->Volume->RequestSlab);
+  if (Batch == NULL) {
+    return NULL;
+  }
+
+  ZeroMem (Batch, sizeof (P9_WRITE_BATCH));
+  Batch->IFile   = IFile;
+  Batch->Token   = Token;
+  Batch->Pending = 1;
+  Batch->Status  = EFI_SUCCESS;
+  IFile->PendingWrites++;
+
+  return Batch;
+}
+
+/**
+
+  Records a write of the batch that failed or was cut short at Offset.
+
+**/
+STATIC
+VOID
+P9FailWrite (
+  IN OUT P9_WRITE_BATCH *Batch,
+  IN BOOLEAN            IsData,
+  IN UINT64             Offset,
+  IN EFI_STATUS         Status
+  )
+{
+  if (!EFI_ERROR (Batch->Status)) {
+    Batch->Status = Status;
+  }
+
+  if (IsData && Offset - Batch->DataOffset < Batch->DataWritten) {
+    Batch->DataWritten = (UINTN)(Offset - Batch->DataOffset);
+  }
+}
+
+/**
+
+  Drops a reference to the batch. The last one sends Tfsync if the batch
+  asked for it and the writes succeeded, or else completes the token, and
+  frees the batch.
+
+**/
+STATIC
+VOID
+P9ReleaseWriteBatch (
+  IN OUT P9_WRITE_BATCH *Batch
+  )
+{
+  EFI_STATUS                    Status;
+  P9_IFILE                      *IFile;
+  EFI_FILE_IO_TOKEN             *Token;
+
+  if (--Batch->Pending != 0) {
+    return;
+  }
+
+  IFile = Batch->IFile;
+  Token = Batch->Token;
+  if (Batch->HasData) {
+    Token->BufferSize = Batch->DataWritten;
+
+    //
+    // A write that came up short moves the position back to the end of the
+    // bytes written, unless another call has moved it since.
+    //
+    if (Batch->DataWritten < Batch->DataSize &&
+        IFile->Position == Batch->DataOffset + Batch->DataSize) {
+      IFile->Position = Batch->DataOffset + Batch->DataWritten;
+    }
+  }
+
+  Status = Batch->Status;
+  if (!EFI_ERROR (Status) && Batch->Fsync) {
+    //
+    // Tfsync goes out only once the data is written, and its reply
+    // completes the token.
+    //
+    Status = P9Fsync (IFile->Volume, IFile, Token);
+    if (!EFI_ERROR (Status)) {
+      Token = NULL;
+    }
+  }
+
+  if (Token != NULL) {
+    Token->Status = Status;
+    gBS->SignalEvent (Token->Event);
+  }
+
+  IFile->PendingWrites--;
+  if (Batch->Buffer != NULL) {
+    FreePool (Batch->Buffer);
+  }
+  P9FreeObject (&IFile->Volume->RequestSlab, Batch);
+}
+
+/**
+
+  Completes one Twrite of a batch.
+
+**/
+STATIC
+VOID
+P9WriteNotify (
+  IN P9_VOLUME          *Volume,
+  IN P9_REQUEST         *Request,
+  IN EFI_STATUS         Status
+  )
+{
+  P9_WRITE_PRIVATE_DATA         *Write;
+
+  Write = (P9_WRITE_PRIVATE_DATA *)Request;
+  if (EFI_ERROR (Status)) {
+    P9FailWrite (Write->Batch, Write->IsData, Write->TxWrite.Offset, Status);
+  } else if (Write->RxWrite.Count < Write->TxWrite.Count) {
+    P9FailWrite (Write->Batch, Write->IsData, Write->TxWrite.Offset + Write->RxWrite.Count, EFI_DEVICE_ERROR);
+  }
+
+  P9ReleaseWriteBatch (Write->Batch);
+}
+
+/**
+
+  Queues Twrites of Data at Offset on a batch without waiting for them.
+
+  The data is sent in place, so it must stay valid until the token of the
+  batch is signaled. An owned buffer is handed over to the batch and freed
+  with it; otherwise Data is the caller's and the bytes written from it are
+  reported in the token's BufferSize. Requests are not sent again after a
+  failover; they complete with the error instead.
+
+  @param  Batch                 - The write batch.
+  @param  Offset                - File offset to write at.
+  @param  Count                 - Bytes to write.
+  @param  Data                  - The data to write.
+  @param  IsOwned               - Whether Data is a pool buffer to hand over.
+
+  @retval EFI_SUCCESS           - The requests are queued.
+  @return Others                - A request could not be sent. The ones
+                                  already queued still complete the batch.
+
+**/
+EFI_STATUS
+P9QueueWrite (
+  IN OUT P9_WRITE_BATCH *Batch,
+  IN UINT64             Offset,
+  IN UINTN              Count,
+  IN VOID               *Data,
+  IN BOOLEAN            IsOwned
+  )
+{
+  EFI_STATUS                    Status;
+  P9_VOLUME                     *Volume;
+  P9_IFILE                      *IFile;
+  P9_WRITE_PRIVATE_DATA         *Write;
+  EFI_TCP4_FRAGMENT_DATA        Fragments[2];
+  UINT32                        MaxCount;
+  UINT32                        Chunk;
+  UINTN                         Sent;
+  UINTN                         TxSize;
+
+  IFile  = Batch->IFile;
+  Volume = IFile->Volume;
+
+  if (IsOwned) {
+    ASSERT (Batch->Buffer == NULL);
+    Batch->Buffer = Data;
+  } else {
+    ASSERT (!Batch->HasData);
+    Batch->HasData     = TRUE;
+    Batch->DataOffset  = Offset;
+    Batch->DataSize    = Count;
+    Batch->DataWritten = Count;
+  }
+
+  MaxCount = Volume->MSize - sizeof (P9TWrite);
+  if (IFile->IoUnit != 0 && IFile->IoUnit < MaxCount) {
+    MaxCount = IFile->IoUnit;
+  }
+
+  for (Sent = 0; Sent < Count; Sent += Chunk) {
+    Chunk = (UINT32)MIN ((UINTN)MaxCount, Count - Sent);
+
+    Write = (P9_WRITE_PRIVATE_DATA *)P9AllocateRequest (Volume, sizeof (P9_WRITE_PRIVATE_DATA));
+    if (Write == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto Exit;
+    }
+
+    P9EncodeMessage (
+      &Write->TxWrite,
+      sizeof (P9TWrite),
+      Twrite,
+      P9GetTag (Volume),
+      &TxSize,
+      IFile->Fid,
+      Offset + Sent,
+      Chunk
+      );
+
+    Write->Request.Tag        = Write->TxWrite.Header.Tag;
+    Write->Request.RxData     = &Write->RxWrite;
+    Write->Request.RxDataSize = sizeof (P9RWrite);
+    Write->Request.Token      = Batch->Token;
+    Write->Request.Notify     = P9WriteNotify;
+    Write->Batch              = Batch;
+    Write->IsData             = !IsOwned;
+
+    Fragments[0].FragmentLength = (UINT32)TxSize;
+    Fragments[0].FragmentBuffer = &Write->TxWrite;
+    Fragments[1].FragmentLength = Chunk;
+    Fragments[1].FragmentBuffer = (UINT8 *)Data + Sent;
+
+    Status = P9SendRequest (Volume, &Write->Request, Fragments, 2);
+    if (EFI_ERROR (Status)) {
+      P9FreeRequest (Volume, &Write->Request);
+      goto Exit;
+    }
+
+    Batch->Pending++;
+  }
+
+  return EFI_SUCCESS;
+
+Exit:
+  DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+  P9FailWrite (Batch, !IsOwned, Offset + Sent, Status);
+
+  return Status;
+}
+
+/**
+
+  Drops the caller's reference to a batch. The token is completed once the
+  queued writes are answered, after Tfsync if Fsync is TRUE.
+
+  @param  Batch                 - The write batch.
+  @param  Status                - An error of the caller to report in the
+                                  token, or EFI_SUCCESS.
+  @param  Fsync                 - Whether to send Tfsync after the writes.
+
+**/
+VOID
+P9EndWriteBatch (
+  IN OUT P9_WRITE_BATCH *Batch,
+  IN EFI_STATUS         Status,
+  IN BOOLEAN            Fsync
+  )
+{
+  if (EFI_ERROR (Status) && !EFI_ERROR (Batch->Status)) {
+    Batch->Status = Status;
+  }
+  Batch->Fsync = Fsync;
+  P9ReleaseWriteBatch (Batch);
+}
+
+/**
+
+  Runs the reactor until the write batches of IFile are complete, so that
+  the file can be closed or written synchronously.
+
+  @param  IFile                 - The file handle.
+
+**/
+VOID
+P9WaitWrites (
+  IN P9_IFILE           *IFile
+  )
+{
+  EFI_STATUS                    Status;
+  P9_VOLUME                     *Volume;
+  BOOLEAN                       IsBusy;
+
+  Volume = IFile->Volume;
+  IsBusy = Volume->IsBusy;
+  Volume->IsBusy = TRUE;
+
+  while (IFile->PendingWrites != 0) {
+    Status = P9Dispatch (Volume, FALSE);
+    if (Status == EFI_NOT_READY) {
+      P9ExpireRequests (Volume);
+    } else if (EFI_ERROR (Status)) {
+      P9AbortRequests (Volume, Status);
+    }
+  }
+
+  Volume->IsBusy = IsBusy;
+}
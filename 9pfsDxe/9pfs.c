@@ -8,6 +8,9 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 **/
 
 #include "9pfs.h"
+#include "9pLib.h"
+
+EFI_EVENT mTickTimer = NULL;
 
 EFI_STATUS
 EFIAPI
@@ -123,6 +126,59 @@ P9CleanProtocol (
   }
 }
 
+/**
+
+  Tears down a stripe or racing connection and frees it.
+
+  @param  Stripe                - The connection.
+
+**/
+VOID
+P9CleanStripe (
+  IN P9_VOLUME  *Stripe
+  )
+{
+  if (Stripe->Tcp4 != NULL) {
+    Stripe->Tcp4->Configure (Stripe->Tcp4, NULL);
+  }
+
+  if (Stripe->PendingHandshake != NULL) {
+    P9HandshakeCancel (Stripe, Stripe->PendingHandshake);
+  }
+
+  if (Stripe->ConnectToken.CompletionToken.Event != NULL) {
+    gBS->CloseEvent (Stripe->ConnectToken.CompletionToken.Event);
+  }
+
+  P9AbortRequests (Stripe, EFI_ABORTED);
+  P9ResetFidCache (Stripe);
+  P9ResetLinkCache (Stripe);
+  P9ResetDirIndexes (Stripe);
+  if (Stripe->KeepAliveToken.Event != NULL) {
+    gBS->CloseEvent (Stripe->KeepAliveToken.Event);
+  }
+
+  P9CleanProtocol (Stripe);
+
+  if (Stripe->RxIoToken.CompletionToken.Event != NULL) {
+    gBS->CloseEvent (Stripe->RxIoToken.CompletionToken.Event);
+  }
+
+  if (Stripe->FileSystemInfo != NULL) {
+    FreePool (Stripe->FileSystemInfo);
+  }
+
+  if (Stripe->Root != NULL) {
+    if (Stripe->Root->FileInfo != NULL) {
+      FreePool (Stripe->Root->FileInfo);
+    }
+    FreePool (Stripe->Root);
+  }
+
+  P9DestroySlab (&Stripe->RequestSlab);
+  FreePool (Stripe);
+}
+
 /**
 
   Register Driver Binding protocol for this driver.
@@ -209,10 +265,13 @@ P9DriverBindingStart (
 
   @param  This                  - Protocol instance pointer.
   @param  ControllerHandle      - Handle of device to stop driver on.
-  @param  NumberOfChildren      - Not used.
-  @param  ChildHandleBuffer     - Not used.
+  @param  NumberOfChildren      - Number of exports in ChildHandleBuffer, or
+                                  0 to stop the volume itself.
+  @param  ChildHandleBuffer     - The handles of the exports to stop.
 
   @retval EFI_SUCCESS           - This driver is removed DeviceHandle.
+  @retval EFI_ACCESS_DENIED     - Files of the volume are still open.
+  @retval EFI_DEVICE_ERROR      - An export is still in use.
   @return other                 - This driver was not removed from this device.
 
 **/
@@ -269,6 +328,21 @@ P9EntryPoint (
               &g9pfsComponentName2
               );
   ASSERT_EFI_ERROR (Status);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  P9TickNotify,
+                  NULL,
+                  &mTickTimer
+                  );
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->SetTimer (mTickTimer, TimerPeriodic, P9_TICK_PERIOD);
+  }
+  ASSERT_EFI_ERROR (Status);
 
   return Status;
 }
@@ -381,9 +455,189 @@ P9Unload (
     FreePool (DeviceHandleBuffer);
   }
 
+  if (!EFI_ERROR (Status) && mTickTimer != NULL) {
+    gBS->CloseEvent (mTickTimer);
+    mTickTimer = NULL;
+  }
+
   return Status;
 }
 
+//
+// The part of the configuration that selects NICs. Supported() runs for
+// every controller on every connect, so it is read once, and again only
+// after a failed mount.
+//
+typedef struct {
+  EFI_IPv4_ADDRESS                StationAddr;
+  EFI_IPv4_ADDRESS                SubnetMask;
+  UINT32                          MacAddrSize;
+  EFI_MAC_ADDRESS                 MacAddr;
+} P9_NIC_SELECTOR;
+
+P9_NIC_SELECTOR mNicSelector;
+BOOLEAN         mIsNicSelectorRead = FALSE;
+
+//
+// The NIC bound when the configuration selects none, until it is stopped.
+//
+EFI_HANDLE      mFallbackNic = NULL;
+
+/**
+
+  Reads the NIC selector from the configuration, unless it was read before.
+
+  @retval EFI_SUCCESS           - mNicSelector is valid.
+  @return Others                - The configuration could not be read.
+
+**/
+EFI_STATUS
+P9ReadNicSelector (
+  VOID
+  )
+{
+  EFI_STATUS                      Status;
+  P9_CONFIG                       *Config;
+
+  if (mIsNicSelectorRead) {
+    return EFI_SUCCESS;
+  }
+
+  Config = AllocatePool (sizeof (P9_CONFIG));
+  if (Config == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = P9ReadConfig (Config);
+  if (!EFI_ERROR (Status)) {
+    CopyMem (&mNicSelector.StationAddr, &Config->StationAddr, sizeof (EFI_IPv4_ADDRESS));
+    CopyMem (&mNicSelector.SubnetMask, &Config->SubnetMask, sizeof (EFI_IPv4_ADDRESS));
+    mNicSelector.MacAddrSize = Config->MacAddrSize;
+    CopyMem (&mNicSelector.MacAddr, &Config->MacAddr, sizeof (EFI_MAC_ADDRESS));
+    mIsNicSelectorRead = TRUE;
+  }
+
+  FreePool (Config);
+
+  return Status;
+}
+
+/**
+
+  Makes the next P9IsNicSelected() read the configuration again.
+
+**/
+VOID
+P9ResetNicSelector (
+  VOID
+  )
+{
+  mIsNicSelectorRead = FALSE;
+}
+
+/**
+
+  Checks whether the NIC of ControllerHandle is the one the configuration
+  selects, so that TCP children and volumes are only created on that NIC.
+
+  With a configured MAC address only the NIC with that address is selected.
+  Otherwise a NIC that already has an IPv4 address is selected when the
+  address is in the subnet of StationAddr. Of the NICs without an address,
+  and of all NICs when the configuration can not be read, only the first
+  one found with a link is selected, so that a volume is not mounted on
+  every port.
+
+  @param  ControllerHandle      - Handle of the NIC.
+
+  @retval TRUE                  - The NIC is selected.
+  @retval FALSE                 - The NIC is not selected.
+
+**/
+BOOLEAN
+P9IsNicSelected (
+  IN EFI_HANDLE                   ControllerHandle
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_MAC_ADDRESS                 MacAddr;
+  UINTN                           MacAddrSize;
+  EFI_IP4_CONFIG2_PROTOCOL        *Ip4Config2;
+  EFI_IP4_CONFIG2_INTERFACE_INFO  *IfInfo;
+  UINTN                           IfInfoSize;
+  UINT32                          Mask;
+  BOOLEAN                         IsSelected;
+  BOOLEAN                         MediaPresent;
+
+  IfInfo     = NULL;
+  IsSelected = FALSE;
+
+  Status = P9ReadNicSelector ();
+  if (EFI_ERROR (Status)) {
+    goto Fallback;
+  }
+
+  if (mNicSelector.MacAddrSize != 0) {
+    Status = NetLibGetMacAddress (ControllerHandle, &MacAddr, &MacAddrSize);
+    IsSelected = (BOOLEAN)(!EFI_ERROR (Status) &&
+                           MacAddrSize == mNicSelector.MacAddrSize &&
+                           CompareMem (&MacAddr, &mNicSelector.MacAddr, MacAddrSize) == 0);
+    goto Exit;
+  }
+
+  Status = gBS->HandleProtocol (ControllerHandle, &gEfiIp4Config2ProtocolGuid, (VOID **)&Ip4Config2);
+  if (EFI_ERROR (Status)) {
+    goto Fallback;
+  }
+
+  IfInfoSize = 0;
+  Status = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypeInterfaceInfo, &IfInfoSize, NULL);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    goto Fallback;
+  }
+
+  IfInfo = AllocatePool (IfInfoSize);
+  if (IfInfo == NULL) {
+    goto Fallback;
+  }
+
+  Status = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypeInterfaceInfo, &IfInfoSize, IfInfo);
+  if (EFI_ERROR (Status) || EFI_IP4_EQUAL (&IfInfo->StationAddress, &mZeroIp4Addr)) {
+    goto Fallback;
+  }
+
+  Mask = EFI_IP4 (mNicSelector.SubnetMask);
+  IsSelected = (BOOLEAN)((EFI_IP4 (IfInfo->StationAddress) & Mask) == (EFI_IP4 (mNicSelector.StationAddr) & Mask));
+  goto Exit;
+
+Fallback:
+  //
+  // A NIC whose link can not be told is taken to have one.
+  //
+  if (mFallbackNic == NULL) {
+    Status = NetLibDetectMedia (ControllerHandle, &MediaPresent);
+    if (EFI_ERROR (Status) || MediaPresent) {
+      mFallbackNic = ControllerHandle;
+      DEBUG ((DEBUG_WARN, "%a:%d: No MacAddr, binding NIC %p only\n", __func__, __LINE__, ControllerHandle));
+    }
+  }
+
+  IsSelected = (BOOLEAN)(ControllerHandle == mFallbackNic);
+  if (!IsSelected && mFallbackNic != NULL) {
+    DEBUG ((DEBUG_WARN, "%a:%d: NIC %p left unbound, set MacAddr to choose it\n", __func__, __LINE__, ControllerHandle));
+  }
+
+Exit:
+  if (!IsSelected) {
+    DEBUG ((DEBUG_INFO, "%a:%d: Skipping NIC %p\n", __func__, __LINE__, ControllerHandle));
+  }
+
+  if (IfInfo != NULL) {
+    FreePool (IfInfo);
+  }
+
+  return IsSelected;
+}
+
 /**
 
   Test to see if this driver can add a file system to ControllerHandle.
@@ -416,8 +670,15 @@ P9DriverBindingSupported (
                   ControllerHandle,
                   EFI_OPEN_PROTOCOL_TEST_PROTOCOL
                   );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
 
-  return Status;
+  if (!P9IsNicSelected (ControllerHandle)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  return EFI_SUCCESS;
 }
 
 /**
@@ -450,6 +711,8 @@ P9DriverBindingStart (
   P9_SERVICE                      *P9Service;
   VOID                            *Interface;
 
+  Volume = NULL;
+
   Status = gBS->OpenProtocol (
     ControllerHandle,
     &g9pServiceBindingProtocolGuid,
@@ -522,6 +785,38 @@ P9DriverBindingStart (
   Volume->Service                    = P9Service;
   Volume->VolumeInterface.Revision   = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_REVISION;
   Volume->VolumeInterface.OpenVolume = P9OpenVolume;
+  InitializeListHead (&Volume->Requests);
+  InitializeListHead (&Volume->Files);
+  P9InitSlab (&Volume->FileSlab, sizeof (P9_IFILE));
+  P9InitSlab (&Volume->RequestSlab, P9_REQUEST_OBJECT_SIZE);
+  Volume->RxIoToken.Packet.RxData    = &Volume->RxData;
+
+  Status = gBS->CreateEvent (0, 0, NULL, NULL, &Volume->RxIoToken.CompletionToken.Event);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  P9ReactorTimer,
+                  Volume,
+                  &Volume->ReactorTimer
+                  );
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  P9MountTimer,
+                  Volume,
+                  &Volume->MountTimer
+                  );
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
 
   Status = gBS->InstallMultipleProtocolInterfaces (
                   &ControllerHandle,
@@ -533,14 +828,39 @@ P9DriverBindingStart (
     goto Exit;
   }
 
+  //
+  // The first export is served by the volume itself.
+  //
+  Status = P9InstallExports (Volume);
   if (EFI_ERROR (Status)) {
-    goto Exit;
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+  }
+
+  //
+  // A failed eager mount is retried by the first OpenVolume.
+  //
+  Status = P9EagerMount (Volume);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
   }
 
   return EFI_SUCCESS;
 
 Exit:
+  if (ControllerHandle == mFallbackNic) {
+    mFallbackNic = NULL;
+  }
+
   if (Volume != NULL) {
+    if (Volume->RxIoToken.CompletionToken.Event != NULL) {
+      gBS->CloseEvent (Volume->RxIoToken.CompletionToken.Event);
+    }
+    if (Volume->ReactorTimer != NULL) {
+      gBS->CloseEvent (Volume->ReactorTimer);
+    }
+    if (Volume->MountTimer != NULL) {
+      gBS->CloseEvent (Volume->MountTimer);
+    }
     FreePool (Volume);
   }
 
@@ -575,6 +895,58 @@ P9DriverBindingStop (
   P9_SERVICE                      *P9Service;
   EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *FileSystem;
   P9_VOLUME                       *Volume;
+  P9_EXPORT                       *Export;
+  BOOLEAN                         AllChildrenStopped;
+  UINTN                           Index;
+
+  //
+  // The further exports are children of the controller and are stopped in
+  // a pass of their own.
+  //
+  if (NumberOfChildren != 0) {
+    AllChildrenStopped = TRUE;
+    for (Index = 0; Index < NumberOfChildren; Index++) {
+      Status = gBS->OpenProtocol (
+        ChildHandleBuffer[Index],
+        &gEfiSimpleFileSystemProtocolGuid,
+        (VOID **)&FileSystem,
+        This->DriverBindingHandle,
+        ControllerHandle,
+        EFI_OPEN_PROTOCOL_GET_PROTOCOL
+        );
+      if (!EFI_ERROR (Status)) {
+        Export = EXPORT_FROM_VOL_INTERFACE (FileSystem);
+        Status = P9UninstallExport (Export);
+      }
+      if (EFI_ERROR (Status)) {
+        AllChildrenStopped = FALSE;
+      }
+    }
+
+    return AllChildrenStopped ? EFI_SUCCESS : EFI_DEVICE_ERROR;
+  }
+
+  Status = gBS->OpenProtocol (
+    ControllerHandle,
+    &gEfiSimpleFileSystemProtocolGuid,
+    (VOID **)&FileSystem,
+    This->DriverBindingHandle,
+    ControllerHandle,
+    EFI_OPEN_PROTOCOL_GET_PROTOCOL
+  );
+  if (!EFI_ERROR (Status)) {
+    Volume = VOLUME_FROM_VOL_INTERFACE (FileSystem);
+    //
+    // Handles left open hold objects of the file slab, so the volume
+    // cannot go away under them.
+    //
+    if (!IsListEmpty (&Volume->Files)) {
+      return EFI_ACCESS_DENIED;
+    }
+    if (EFI_ERROR (P9UninstallExports (Volume))) {
+      return EFI_DEVICE_ERROR;
+    }
+  }
 
   NicHandle = NetLibGetNicHandle (ControllerHandle, &gEfiTcp4ProtocolGuid);
   if (NicHandle != NULL) {
@@ -612,6 +984,34 @@ P9DriverBindingStop (
   );
   if (!EFI_ERROR (Status)) {
     Volume = VOLUME_FROM_VOL_INTERFACE (FileSystem);
+    if (Volume->ReactorTimer != NULL) {
+      gBS->CloseEvent (Volume->ReactorTimer);
+      Volume->ReactorTimer = NULL;
+    }
+    if (Volume->MountTimer != NULL) {
+      gBS->CloseEvent (Volume->MountTimer);
+      Volume->MountTimer = NULL;
+    }
+    if (Volume->Tcp4 != NULL) {
+      P9AbortRequests (Volume, EFI_ABORTED);
+    }
+    P9ResetFidCache (Volume);
+    P9ResetLinkCache (Volume);
+    P9ResetDirIndexes (Volume);
+    P9ResetDirCache (Volume);
+    P9ResetStatfsCache (Volume);
+    if (Volume->KeepAliveToken.Event != NULL) {
+      gBS->CloseEvent (Volume->KeepAliveToken.Event);
+      Volume->KeepAliveToken.Event = NULL;
+    }
+    while (Volume->StripeCount > 0) {
+      P9CleanStripe (Volume->Stripes[--Volume->StripeCount]);
+    }
+    while (Volume->RacerCount > 0) {
+      P9CleanStripe (Volume->Racers[--Volume->RacerCount]);
+    }
+    P9DestroySlab (&Volume->RequestSlab);
+    P9DestroySlab (&Volume->FileSlab);
     if (Volume->Handle != NULL) {
       Status = gBS->UninstallProtocolInterface (
         Volume->Handle,
@@ -621,5 +1021,12 @@ P9DriverBindingStop (
     }
   }
 
+  //
+  // Another NIC may be bound in place of a stopped fallback one.
+  //
+  if (!EFI_ERROR (Status) && ControllerHandle == mFallbackNic) {
+    mFallbackNic = NULL;
+  }
+
   return Status;
 }
@@ -15,13 +15,16 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #include <Guid/FileInfo.h>
 #include <Guid/FileSystemInfo.h>
 #include <Guid/FileSystemVolumeLabelInfo.h>
+#include <Protocol/Ip4Config2.h>
 #include <Protocol/ServiceBinding.h>
 #include <Protocol/Tcp4.h>
+#include <Protocol/UnicodeCollation.h>
 
 #include <Library/PcdLib.h>
 #include <Library/DebugLib.h>
 #include <Library/UefiLib.h>
 #include <Library/NetLib.h>
+#include <Library/DevicePathLib.h>
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
@@ -38,34 +41,317 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #define P9_VOLUME_SIGNATURE         SIGNATURE_32 ('9', 'f', 's', 'v')
 #define P9_SERVICE_SIGNATURE        SIGNATURE_32 ('9', 'p', 's', 'v')
 #define P9_IFILE_SIGNATURE          SIGNATURE_32 ('9', 'f', 's', 'i')
+#define P9_EXPORT_SIGNATURE         SIGNATURE_32 ('9', 'f', 's', 'e')
 
 #define P9_SERVICE_FROM_PROTOCOL(a)  CR (a, P9_SERVICE, ServiceBinding, P9_SERVICE_SIGNATURE)
 #define IFILE_FROM_FHAND(a)          CR (a, P9_IFILE, Handle, P9_IFILE_SIGNATURE)
 
 #define VOLUME_FROM_VOL_INTERFACE(a) CR (a, P9_VOLUME, VolumeInterface, P9_VOLUME_SIGNATURE);
+#define EXPORT_FROM_VOL_INTERFACE(a) CR (a, P9_EXPORT, VolumeInterface, P9_EXPORT_SIGNATURE);
+
+//
+// Size of the per-handle write-back buffer
+//
+#define P9_WRITE_BACK_SIZE      (P9_MSIZE * 4)
+
+//
+// Maximum number of TCP connections per volume
+//
+#define P9_MAX_CONNECTIONS      8
+
+//
+// Maximum number of replica servers raced when mounting a volume
+//
+#define P9_MAX_REPLICAS         4
+
+//
+// Maximum number of exported directories per volume
+//
+#define P9_MAX_EXPORTS          4
+
+//
+// Number of unopened directory fids kept per connection to walk from
+//
+#define P9_FID_CACHE_SIZE       16
+
+//
+// Number of symbolic link targets kept per connection
+//
+#define P9_LINK_CACHE_SIZE      8
+
+//
+// Maximum number of symbolic links followed by a single walk
+//
+#define P9_MAX_SYMLINKS         8
+
+//
+// Number of directories per connection whose names are indexed for
+// case-insensitive lookups
+//
+#define P9_DIR_INDEX_CACHE_SIZE 4
+
+//
+// Number of directory listings kept per volume
+//
+#define P9_DIR_CACHE_SIZE       8
+
+//
+// Time for which a directory listing is used without asking the server
+// whether the directory changed, in milliseconds
+//
+#define P9_DIR_CACHE_TTL        1000
+
+//
+// Time the file system info of a volume is answered from the cache before
+// Tstatfs is sent again, in milliseconds. It may be set in the build options.
+//
+#ifndef P9_STATFS_CACHE_TTL
+#define P9_STATFS_CACHE_TTL     1000
+#endif
+
+//
+// Size of the largest directory listing kept, in bytes. Larger directories
+// are read as they are enumerated, in constant memory.
+//
+#define P9_DIR_CACHE_MAX_SIZE   (256 * 1024)
+
+//
+// Size of the buffer of a volume that T-messages, and the replies to read
+// in place, are serialized into. It holds a Treadlink with its reply and
+// the messages of a failover nested in it.
+//
+#define P9_MESSAGE_BUFFER_SIZE  (16 * 1024)
+
+//
+// Period of the timer that completes asynchronous requests, in 100ns units
+//
+#define P9_REACTOR_PERIOD       100000
+
+//
+// Version of the packed Config variable
+//
+#define P9_CONFIG_VERSION       1
 
 //
 // Path name separator is back slash
 //
 #define PATH_NAME_SEPARATOR     L'\\'
 
+/* open-only flags */
+#define	O_RDONLY	0x0000		/* open for reading only */
+#define	O_WRONLY	0x0001		/* open for writing only */
+#define	O_RDWR		0x0002		/* open for reading and writing */
+#define	O_ACCMODE	0x0003		/* mask for above modes */
+
 typedef struct _P9_IFILE    P9_IFILE;
 typedef struct _P9_SERVICE  P9_SERVICE;
 typedef struct _P9_VOLUME   P9_VOLUME;
+typedef struct _P9_HANDSHAKE P9_HANDSHAKE;
+typedef struct _P9_EXPORT   P9_EXPORT;
+typedef struct _P9_WRITE_BATCH P9_WRITE_BATCH;
+typedef struct _P9_DIR_PREFETCH P9_DIR_PREFETCH;
+
+//
+// Progress of mounting a volume. Mounting may be started eagerly from
+// DriverBindingStart and advanced from a timer until OpenVolume needs it.
+// With several replica servers the volume is racing until the first of its
+// candidate connections has handshaken.
+//
+typedef enum {
+  P9MountIdle,
+  P9MountRacing,
+  P9MountConnecting,
+  P9MountConnected,
+  P9MountHandshaking,
+  P9MountStriping,
+  P9MountReady
+} P9_MOUNT_STATE;
+
+//
+// Layout of the Config variable. The fixed part is followed by the access
+// user name and the exported directory path as NUL-terminated CHAR8 strings.
+//
+#pragma pack(1)
+typedef struct {
+  UINT32                          Version;
+  EFI_IPv4_ADDRESS                StationAddr;
+  UINT16                          StationPort;
+  EFI_IPv4_ADDRESS                SubnetMask;
+  UINT32                          RemoteCount;
+  EFI_IPv4_ADDRESS                RemoteAddr[P9_MAX_REPLICAS];
+  UINT16                          RemotePort[P9_MAX_REPLICAS];
+  UINT32                          Connections;
+  UINT32                          Handshake;
+  UINT32                          EagerConnect;
+  UINT8                           IsTcpOptionSet;
+  EFI_TCP4_OPTION                 TcpOption;
+  UINT32                          MacAddrSize;
+  EFI_MAC_ADDRESS                 MacAddr;
+} P9_CONFIG_VARIABLE;
+
+//
+// Device path node that tells the handles of further exports apart.
+//
+typedef struct {
+  VENDOR_DEVICE_PATH              Vendor;
+  UINT32                          Index;
+} P9_EXPORT_DEVICE_PATH;
+#pragma pack()
 
+//
+// An unopened fid of a directory, kept to walk from and to hand out instead
+// of walking or cloning again. Path is absolute within the export whose
+// root has RootFid. While Token.Event is set, the fid is still being cloned
+// in the background and may not be used.
+//
+typedef struct {
+  UINT32                          RootFid;
+  UINT32                          Fid;
+  CHAR16                          *Path;
+  Qid                             Qid;
+  UINT64                          LastUsed;
+  EFI_FILE_IO_TOKEN               Token;
+} P9_CACHED_FID;
+
+//
+// The target of a symbolic link, as read by Treadlink. A link whose qid
+// version changed is read again.
+//
+typedef struct {
+  Qid                             Qid;
+  CHAR16                          *Target;
+  UINT64                          LastUsed;
+} P9_CACHED_LINK;
+
+//
+// The names of a directory, hashed by their upper case form, to find the
+// name of a file that was opened in another case without reading the
+// directory again. Names holds the names one after another, each
+// NUL-terminated; a used slot holds the offset of a name in Names plus one.
+// The index is read again when the qid version of the directory changed.
+//
+typedef struct {
+  UINT32                          RootFid;
+  CHAR16                          *Path;
+  Qid                             Qid;
+  UINT64                          LastUsed;
+  CHAR16                          *Names;
+  UINTN                           NamesLength;
+  UINTN                           NamesMax;
+  UINT32                          *Slots;
+  UINTN                           SlotCount;
+  UINTN                           NameCount;
+} P9_DIR_INDEX;
+
+//
+// The listing of a directory as returned by Read(), shared by the handles
+// that enumerate it. Entries holds an EFI_FILE_INFO per entry, each aligned
+// to 8 bytes. A listing is recorded while a handle reads the directory to
+// its end, unless it grows over P9_DIR_CACHE_MAX_SIZE. A handle keeps the
+// listing it started with until it starts over, so the listing is freed
+// with its last reference. The cached listing of a directory is replaced
+// when its qid version changed, which is only checked once P9_DIR_CACHE_TTL
+// passed since the last check.
+//
+typedef struct {
+  UINTN                           RefCount;
+  Qid                             Qid;
+  UINT64                          CheckedAt;
+  UINT64                          LastUsed;
+  UINT8                           *Entries;
+  UINTN                           Size;
+  UINTN                           MaxSize;
+} P9_DIR_SNAPSHOT;
+
+//
+// A cache of objects of one size, carved from pages. Free objects are linked
+// through their first bytes, so objects are taken and returned in constant
+// time without going through the pool allocator.
+//
+typedef struct {
+  UINTN                           ObjectSize;
+  VOID                            *FreeList;
+  VOID                            *Pages;
+} P9_SLAB;
+
+//
+// A directory being enumerated from the server. Buffer holds the reply to
+// the last Treaddir, whose entries are decoded one at a time into
+// Entry->FileInfo; Cookie is the offset of the next Treaddir. The
+// attributes of the entries are fetched ahead into Prefetch, of which
+// PrefetchNext is the slot of the next entry. The buffers are allocated
+// once per enumeration, not per entry.
+//
+typedef struct {
+  UINT8                           *Buffer;
+  UINT32                          BufferSize;
+  UINT32                          Count;
+  UINT32                          Next;
+  UINT64                          Cookie;
+  BOOLEAN                         IsEnd;
+  BOOLEAN                         IsRoot;
+  BOOLEAN                         HasEntry;
+  P9_DIR_PREFETCH                 *Prefetch;
+  UINTN                           PrefetchCount;
+  UINTN                           PrefetchNext;
+  P9_IFILE                        *Entry;
+  P9_DIR_SNAPSHOT                 *Pending;
+} P9_DIR_READER;
+
+//
+// Configuration of a volume, parsed once from the Config variable or from
+// the individual variables. AName holds ExportCount NUL-separated exported
+// directory paths, starting at ANameOffset.
+//
+typedef struct {
+  EFI_IPv4_ADDRESS                StationAddr;
+  UINT16                          StationPort;
+  EFI_IPv4_ADDRESS                SubnetMask;
+  UINT32                          RemoteCount;
+  EFI_IPv4_ADDRESS                RemoteAddr[P9_MAX_REPLICAS];
+  UINT16                          RemotePort[P9_MAX_REPLICAS];
+  CHAR8                           UName[P9_MAX_FLEN + 1];
+  CHAR8                           AName[P9_MAX_PATH + 1];
+  UINT32                          ExportCount;
+  UINT16                          ANameOffset[P9_MAX_EXPORTS];
+  EFI_TCP4_OPTION                 TcpOption;
+  BOOLEAN                         IsTcpOptionSet;
+  UINT32                          ConnectionCount;
+  UINT32                          Handshake;
+  BOOLEAN                         IsEager;
+  BOOLEAN                         IgnoreCase;
+  UINT32                          MacAddrSize;
+  EFI_MAC_ADDRESS                 MacAddr;
+} P9_CONFIG;
+
+//
+// An open file. The fields used by every read and write come first; names,
+// the symbolic link target and directory state are allocated apart, only
+// for the handles that need them.
+//
 struct _P9_IFILE {
   UINTN                           Signature;
-  EFI_FILE_PROTOCOL               Handle;
-  EFI_FILE_INFO                   *FileInfo;
   P9_VOLUME                       *Volume;
-  CHAR16                          FileName[P9_MAX_FLEN + 1];
+  P9_IFILE                        *Root;
   UINT32                          Fid;
   UINT32                          Flags;
   Qid                             Qid;
   UINT32                          IoUnit;
-  UINT64                          Position;
-  CHAR16                          SymLinkTarget[P9_MAX_PATH + 1];
   BOOLEAN                         IsOpened;
+  UINT64                          Position;
+  UINT32                          StripeFid[P9_MAX_CONNECTIONS - 1];
+  UINT8                           *WriteBack;
+  UINT64                          WriteBackOffset;
+  UINTN                           WriteBackLength;
+  UINTN                           PendingWrites;
+  EFI_FILE_PROTOCOL               Handle;
+  LIST_ENTRY                      Link;
+  EFI_FILE_INFO                   *FileInfo;
+  CHAR16                          *FileName;
+  CHAR16                          *Path;
+  CHAR16                          *SymLinkTarget;
+  P9_DIR_SNAPSHOT                 *Snapshot;
+  P9_DIR_READER                   *Reader;
 };
 
 struct _P9_SERVICE {
@@ -88,12 +374,63 @@ struct _P9_VOLUME {
   EFI_TCP4_PROTOCOL               *Tcp4;
   BOOLEAN                         IsConfigured;
   UINT32                          MSize;
+  UINT64                          Rtt;
   UINT16                          Tag;
   EFI_FILE_SYSTEM_INFO            *FileSystemInfo;
-  EFI_TCP4_IO_TOKEN               TxIoToken;
+  UINT32                          FileSystemInfoFid;
+  UINT64                          FileSystemInfoAt;
   EFI_TCP4_IO_TOKEN               RxIoToken;
-  BOOLEAN                         IsTxDone;
-  BOOLEAN                         IsRxDone;
+  EFI_TCP4_RECEIVE_DATA           RxData;
+  BOOLEAN                         IsRxPosted;
+  P9Header                        RxHeader;
+  UINTN                           RxHeaderLength;
+  LIST_ENTRY                      Requests;
+  UINT16                          NextTag;
+  BOOLEAN                         IsBusy;
+  EFI_EVENT                       ReactorTimer;
+  P9_VOLUME                       *Primary;
+  P9_VOLUME                       *Stripes[P9_MAX_CONNECTIONS - 1];
+  UINTN                           StripeCount;
+  BOOLEAN                         IsConfigLoaded;
+  P9_CONFIG                       Config;
+  P9_MOUNT_STATE                  MountState;
+  EFI_TCP4_CONNECTION_TOKEN       ConnectToken;
+  UINT64                          ConnectDeadline;
+  P9_HANDSHAKE                    *PendingHandshake;
+  EFI_EVENT                       MountTimer;
+  UINT32                          Replica;
+  P9_VOLUME                       *Racers[P9_MAX_REPLICAS];
+  UINTN                           RacerCount;
+  LIST_ENTRY                      Files;
+  BOOLEAN                         IsReconnecting;
+  UINT64                          LastActivity;
+  EFI_FILE_IO_TOKEN               KeepAliveToken;
+  P9_EXPORT                       *Exports[P9_MAX_EXPORTS - 1];
+  UINTN                           ExportCount;
+  P9_CACHED_FID                   FidCache[P9_FID_CACHE_SIZE];
+  P9_CACHED_LINK                  LinkCache[P9_LINK_CACHE_SIZE];
+  P9_DIR_INDEX                    DirIndex[P9_DIR_INDEX_CACHE_SIZE];
+  P9_DIR_SNAPSHOT                 *DirCache[P9_DIR_CACHE_SIZE];
+  P9_SLAB                         FileSlab;
+  P9_SLAB                         RequestSlab;
+  CHAR16                          LinkTarget[P9_MAX_PATH + 1];
+  UINTN                           MessageBufferUsed;
+  UINT8                           MessageBuffer[P9_MESSAGE_BUFFER_SIZE];
+};
+
+//
+// A further exported directory of a volume. It is installed as a file
+// system of its own on a child handle of the NIC, and its root is attached
+// on the connection of the volume when it is first opened.
+//
+struct _P9_EXPORT {
+  UINTN                           Signature;
+  EFI_HANDLE                      Handle;
+  EFI_DEVICE_PATH_PROTOCOL        *DevicePath;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL VolumeInterface;
+  P9_VOLUME                       *Volume;
+  UINT32                          Index;
+  P9_IFILE                        *Root;
 };
 
 //
@@ -383,6 +720,39 @@ P9Flush (
   IN EFI_FILE_PROTOCOL  *FHand
   );
 
+/**
+
+  Writes the data queued in the write-back buffer of the file handle.
+
+  @param  IFile                 - The file handle.
+
+  @retval EFI_SUCCESS           - The buffer is empty.
+  @return Others                - Writing the buffer failed.
+
+**/
+EFI_STATUS
+P9FlushWriteBack (
+  IN P9_IFILE           *IFile
+  );
+
+/**
+
+  Hands the write-back buffer of the file handle over to a write batch,
+  which writes it asynchronously.
+
+  @param  IFile                 - The file handle.
+  @param  Batch                 - The write batch.
+
+  @retval EFI_SUCCESS           - The buffer is empty or its writes are queued.
+  @return Others                - Queuing the writes failed.
+
+**/
+EFI_STATUS
+P9QueueWriteBack (
+  IN P9_IFILE           *IFile,
+  IN P9_WRITE_BATCH     *Batch
+  );
+
 /**
 
   Flushes & Closes the file handle.
@@ -417,6 +787,204 @@ P9OpenVolume (
   OUT EFI_FILE_PROTOCOL                **File
   );
 
+/**
+
+  Implements OpenVolume() of the Simple File System Protocol of a further
+  export.
+
+  @param  This                  - Calling context.
+  @param  File                  - the Root Directory of the export.
+
+  @retval EFI_SUCCESS           - Open the export successfully.
+  @return Others                - The volume could not be mounted or the
+                                  export could not be attached.
+
+**/
+EFI_STATUS
+EFIAPI
+P9OpenExport (
+  IN  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *This,
+  OUT EFI_FILE_PROTOCOL                **File
+  );
+
+/**
+
+  Installs a file system for each export of the configuration after the
+  first one, which is served by the volume itself.
+
+  @param  Volume                - The 9P volume.
+
+  @retval EFI_SUCCESS           - The exports are installed.
+  @return Others                - The configuration could not be read or an
+                                  export could not be installed.
+
+**/
+EFI_STATUS
+P9InstallExports (
+  IN P9_VOLUME  *Volume
+  );
+
+/**
+
+  Uninstalls one further export of a volume and frees it, unless its file
+  system is still in use.
+
+  @param  Export                - The export.
+
+  @retval EFI_SUCCESS           - The export is uninstalled.
+  @return Others                - The file system could not be uninstalled.
+
+**/
+EFI_STATUS
+P9UninstallExport (
+  IN P9_EXPORT  *Export
+  );
+
+/**
+
+  Uninstalls and frees the further exports of a volume that are not in use.
+
+  @param  Volume                - The 9P volume.
+
+  @retval EFI_SUCCESS           - All the exports are uninstalled.
+  @return Others                - An export is still in use.
+
+**/
+EFI_STATUS
+P9UninstallExports (
+  IN P9_VOLUME  *Volume
+  );
+
+/**
+
+  Reads the configuration from the Config variable when it is set, from the
+  individual variables otherwise.
+
+  @param  Config                - The configuration.
+
+  @retval EFI_SUCCESS             - The configuration is read.
+  @retval EFI_INCOMPATIBLE_VERSION - The Config variable has another version.
+  @return Others                  - The configuration is missing or malformed.
+
+**/
+EFI_STATUS
+P9ReadConfig (
+  OUT P9_CONFIG     *Config
+  );
+
+/**
+
+  Loads the configuration of a volume into Volume->Config with
+  P9ReadConfig(). The variables are read once and again only after a failed
+  mount.
+
+  @param  Volume                - The 9P volume.
+
+  @retval EFI_SUCCESS             - The configuration is loaded.
+  @retval EFI_INCOMPATIBLE_VERSION - The Config variable has another version.
+  @return Others                  - The configuration is missing or malformed.
+
+**/
+EFI_STATUS
+P9LoadConfig (
+  IN OUT P9_VOLUME  *Volume
+  );
+
+/**
+
+  Makes the next DriverBindingSupported() read the NIC selection from the
+  configuration again.
+
+**/
+VOID
+P9ResetNicSelector (
+  VOID
+  );
+
+/**
+
+  Starts mounting a volume in the background if the EagerConnect variable is
+  set. The mount is advanced by the mount timer of the volume.
+
+  @param  Volume                - The 9P volume.
+
+  @retval EFI_SUCCESS           - The mount is started, or eager mounting is
+                                  not enabled.
+  @return Others                - The mount could not be started.
+
+**/
+EFI_STATUS
+P9EagerMount (
+  IN P9_VOLUME  *Volume
+  );
+
+/**
+
+  Advances a pending mount from the mount timer of the volume.
+
+  @param  Event                 - The mount timer event.
+  @param  Context               - The 9P volume.
+
+**/
+VOID
+EFIAPI
+P9MountTimer (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  );
+
+/**
+
+  Re-establishes the connections of a mounted volume after its primary
+  connection was lost, trying the replica servers in turn starting with the
+  current one. The root is attached again and the fid of every open file is
+  walked to and opened again under the same number, so requests built before
+  the failure can be sent again unchanged. Requests still queued on the lost
+  connection complete with EFI_ABORTED.
+
+  @param  Volume                - The mounted primary 9P volume.
+
+  @retval EFI_SUCCESS           - The volume is connected again.
+  @retval EFI_UNSUPPORTED       - Volume is not a mounted primary volume.
+  @retval EFI_ALREADY_STARTED   - The volume is already reconnecting.
+  @return Others                - No server could be reached.
+
+**/
+EFI_STATUS
+P9Reconnect (
+  IN OUT P9_VOLUME  *Volume
+  );
+
+/**
+
+  Builds the absolute path of FileName opened relative to a file at BasePath.
+  "." and ".." components are resolved, so the result has the form
+  "\a\b", or "\" for the root.
+
+  @param  BasePath              - Absolute path of the starting file.
+  @param  FileName              - File name relative to BasePath.
+
+  @return The absolute path allocated from pool, or NULL.
+
+**/
+CHAR16 *
+P9BuildPath (
+  IN  CHAR16        *BasePath,
+  IN  CHAR16        *FileName
+  );
+
+/**
+
+  Tears down a stripe or racing connection and frees it.
+
+  @param  Stripe                - The connection.
+
+**/
+VOID
+P9CleanStripe (
+  IN P9_VOLUME  *Stripe
+  );
+
 //
 // Global Variables
 //
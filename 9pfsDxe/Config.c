@@ -0,0 +1,449 @@
+/** @file
+  Configuration of a 9P volume.
+
+Copyright (c) 2020, Akira Moroo. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "9pfs.h"
+#include "9pLib.h"
+
+//
+// Longest "a.b.c.d:port" string accepted in an address variable
+//
+#define P9_MAX_ADDR_LEN         21
+
+/**
+
+  Reads a variable holding a comma-separated list of IPv4 addresses, each of
+  the form "a.b.c.d" or "a.b.c.d:port".
+
+  @param  Name                  - Name of the variable.
+  @param  Addr                  - The parsed addresses.
+  @param  Port                  - The parsed ports, left unchanged for the
+                                  addresses without one. Optional.
+  @param  MaxCount              - Number of entries in Addr and Port.
+  @param  Count                 - Number of addresses read. Optional; when
+                                  NULL, exactly one address is accepted.
+
+  @retval EFI_SUCCESS           - The addresses are read.
+  @return Others                - The variable is missing or malformed.
+
+**/
+EFI_STATUS
+P9GetAddrVariable (
+  IN CHAR16                 *Name,
+  OUT EFI_IPv4_ADDRESS      *Addr,
+  OUT UINT16                *Port OPTIONAL,
+  IN UINT32                 MaxCount,
+  OUT UINT32                *Count OPTIONAL
+  )
+{
+  EFI_STATUS                Status;
+  CHAR16                    *Data;
+  UINTN                     DataSize;
+  CHAR16                    AddrStr[(P9_MAX_ADDR_LEN + 1) * P9_MAX_REPLICAS];
+  CHAR16                    *Ptr;
+  CHAR16                    *Next;
+  UINT32                    Index;
+
+  Status = GetVariable2 (Name, &g9pfsGuid, (VOID **)&Data, &DataSize);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %s: %r\n", __func__, __LINE__, Name, Status));
+    return Status;
+  }
+
+  Status = StrnCpyS (AddrStr, ARRAY_SIZE (AddrStr), Data, DataSize / sizeof (CHAR16));
+  FreePool (Data);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %s: %r\n", __func__, __LINE__, Name, Status));
+    return Status;
+  }
+
+  Ptr = AddrStr;
+  for (Index = 0; Ptr != NULL; Index++) {
+    if (Index == MaxCount || (Count == NULL && Index == 1)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %s: Too many addresses\n", __func__, __LINE__, Name));
+      return EFI_INVALID_PARAMETER;
+    }
+
+    Next = StrStr (Ptr, L",");
+    if (Next != NULL) {
+      *Next++ = L'\0';
+    }
+
+    Status = StrToIpv4Addr (Ptr, &Addr[Index], (Port == NULL) ? NULL : &Port[Index]);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %s: %r\n", __func__, __LINE__, Name, Status));
+      return Status;
+    }
+
+    Ptr = Next;
+  }
+
+  if (Count != NULL) {
+    *Count = Index;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Reads a CHAR8 string variable.
+
+  @param  Name                  - Name of the variable.
+  @param  String                - Buffer receiving the string.
+  @param  StringMax             - Size of String in characters.
+
+  @retval EFI_SUCCESS           - The string is read.
+  @return Others                - The variable is missing or too long.
+
+**/
+EFI_STATUS
+P9GetAsciiVariable (
+  IN CHAR16                 *Name,
+  OUT CHAR8                 *String,
+  IN UINTN                  StringMax
+  )
+{
+  EFI_STATUS                Status;
+  CHAR8                     *Data;
+  UINTN                     DataSize;
+
+  Status = GetVariable2 (Name, &g9pfsGuid, (VOID **)&Data, &DataSize);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %s: %r\n", __func__, __LINE__, Name, Status));
+    return Status;
+  }
+
+  Status = AsciiStrnCpyS (String, StringMax, Data, DataSize);
+  FreePool (Data);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %s: %r\n", __func__, __LINE__, Name, Status));
+  }
+
+  return Status;
+}
+
+/**
+
+  Reads an optional UINT32 variable.
+
+  @param  Name                  - Name of the variable.
+  @param  Value                 - The value, left unchanged when the variable
+                                  is missing or malformed.
+
+**/
+VOID
+P9GetUint32Variable (
+  IN CHAR16                 *Name,
+  IN OUT UINT32             *Value
+  )
+{
+  EFI_STATUS                Status;
+  UINT32                    *Data;
+  UINTN                     DataSize;
+
+  Status = GetVariable2 (Name, &g9pfsGuid, (VOID **)&Data, &DataSize);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  if (DataSize == sizeof (UINT32)) {
+    *Value = *Data;
+  } else {
+    DEBUG ((DEBUG_ERROR, "%a:%d: Ignoring malformed %s\n", __func__, __LINE__, Name));
+  }
+
+  FreePool (Data);
+}
+
+/**
+
+  Parses the packed Config variable.
+
+  @param  Data                  - Contents of the variable.
+  @param  DataSize              - Size of Data in bytes.
+  @param  Config                - The parsed configuration.
+
+  @retval EFI_SUCCESS             - The configuration is parsed.
+  @retval EFI_INCOMPATIBLE_VERSION - The variable has another version.
+  @retval EFI_VOLUME_CORRUPTED    - The variable is malformed.
+
+**/
+EFI_STATUS
+P9ParseConfigVariable (
+  IN P9_CONFIG_VARIABLE     *Data,
+  IN UINTN                  DataSize,
+  OUT P9_CONFIG             *Config
+  )
+{
+  EFI_STATUS                Status;
+  CHAR8                     *Strings;
+  UINTN                     StringsSize;
+  UINTN                     UNameLength;
+
+  if (DataSize < sizeof (UINT32)) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  if (Data->Version != P9_CONFIG_VERSION) {
+    return EFI_INCOMPATIBLE_VERSION;
+  }
+
+  if (DataSize < sizeof (P9_CONFIG_VARIABLE) ||
+      Data->RemoteCount == 0 || Data->RemoteCount > P9_MAX_REPLICAS) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  CopyMem (&Config->StationAddr, &Data->StationAddr, sizeof (EFI_IPv4_ADDRESS));
+  CopyMem (&Config->SubnetMask, &Data->SubnetMask, sizeof (EFI_IPv4_ADDRESS));
+  CopyMem (Config->RemoteAddr, Data->RemoteAddr, sizeof (Config->RemoteAddr));
+  CopyMem (Config->RemotePort, Data->RemotePort, sizeof (Config->RemotePort));
+  Config->StationPort     = Data->StationPort;
+  Config->RemoteCount     = Data->RemoteCount;
+  Config->ConnectionCount = Data->Connections;
+  Config->Handshake       = Data->Handshake;
+  Config->IsEager         = (BOOLEAN)(Data->EagerConnect != 0);
+  Config->IsTcpOptionSet  = (BOOLEAN)(Data->IsTcpOptionSet != 0);
+  CopyMem (&Config->TcpOption, &Data->TcpOption, sizeof (EFI_TCP4_OPTION));
+  Config->MacAddrSize     = MIN (Data->MacAddrSize, sizeof (EFI_MAC_ADDRESS));
+  CopyMem (&Config->MacAddr, &Data->MacAddr, sizeof (EFI_MAC_ADDRESS));
+
+  //
+  // Both strings must be NUL-terminated within the variable.
+  //
+  Strings     = (CHAR8 *)(Data + 1);
+  StringsSize = DataSize - sizeof (P9_CONFIG_VARIABLE);
+  UNameLength = AsciiStrnLenS (Strings, StringsSize);
+  if (UNameLength == StringsSize) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  Status = AsciiStrCpyS (Config->UName, P9_MAX_FLEN + 1, Strings);
+  if (EFI_ERROR (Status)) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  Status = AsciiStrnCpyS (
+    Config->AName,
+    P9_MAX_PATH + 1,
+    Strings + UNameLength + 1,
+    StringsSize - UNameLength - 1
+    );
+  if (EFI_ERROR (Status)) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Reads the configuration from the individual variables.
+
+  @param  Config                - The configuration.
+
+  @retval EFI_SUCCESS           - The configuration is read.
+  @return Others                - A required variable is missing or malformed.
+
+**/
+EFI_STATUS
+P9ReadConfigVariables (
+  OUT P9_CONFIG             *Config
+  )
+{
+  EFI_STATUS                Status;
+  EFI_TCP4_OPTION           *TcpOption;
+  UINTN                     TcpOptionSize;
+  UINT8                     *MacAddr;
+  UINTN                     MacAddrSize;
+  UINT32                    Connections;
+  UINT32                    EagerConnect;
+
+  Status = P9GetAddrVariable (L"StationAddr", &Config->StationAddr, &Config->StationPort, 1, NULL);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = P9GetAddrVariable (L"SubnetMask", &Config->SubnetMask, NULL, 1, NULL);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = P9GetAddrVariable (
+    L"RemoteAddr",
+    Config->RemoteAddr,
+    Config->RemotePort,
+    P9_MAX_REPLICAS,
+    &Config->RemoteCount
+    );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = P9GetAsciiVariable (L"UName", Config->UName, P9_MAX_FLEN + 1);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = P9GetAsciiVariable (L"AName", Config->AName, P9_MAX_PATH + 1);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // TcpOption is optional. Without it the TCP options are derived
+  // automatically, see P9TcpOption().
+  //
+  Status = GetVariable2 (L"TcpOption", &g9pfsGuid, (VOID **)&TcpOption, &TcpOptionSize);
+  if (!EFI_ERROR (Status)) {
+    if (TcpOptionSize == sizeof (EFI_TCP4_OPTION)) {
+      CopyMem (&Config->TcpOption, TcpOption, sizeof (EFI_TCP4_OPTION));
+      Config->IsTcpOptionSet = TRUE;
+    } else {
+      DEBUG ((DEBUG_ERROR, "%a:%d: Ignoring malformed TcpOption\n", __func__, __LINE__));
+    }
+    FreePool (TcpOption);
+  }
+
+  //
+  // MacAddr is optional. With it only the NIC with that address is bound.
+  //
+  Status = GetVariable2 (L"MacAddr", &g9pfsGuid, (VOID **)&MacAddr, &MacAddrSize);
+  if (!EFI_ERROR (Status)) {
+    if (MacAddrSize <= sizeof (EFI_MAC_ADDRESS)) {
+      CopyMem (&Config->MacAddr, MacAddr, MacAddrSize);
+      Config->MacAddrSize = (UINT32)MacAddrSize;
+    } else {
+      DEBUG ((DEBUG_ERROR, "%a:%d: Ignoring malformed MacAddr\n", __func__, __LINE__));
+    }
+    FreePool (MacAddr);
+  }
+
+  //
+  // Connections, Handshake and EagerConnect are optional and default to a
+  // single connection, a pipelined handshake and mounting on first use.
+  //
+  Connections = 1;
+  P9GetUint32Variable (L"Connections", &Connections);
+  Config->ConnectionCount = Connections;
+
+  Config->Handshake = P9_HANDSHAKE_PIPELINED;
+  P9GetUint32Variable (L"Handshake", &Config->Handshake);
+
+  EagerConnect = 0;
+  P9GetUint32Variable (L"EagerConnect", &EagerConnect);
+  Config->IsEager = (BOOLEAN)(EagerConnect != 0);
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Splits the comma-separated list of exported directory paths in
+  Config->AName in place.
+
+  @param  Config                - The configuration.
+
+  @retval EFI_SUCCESS           - The paths are split.
+  @retval EFI_INVALID_PARAMETER - A path is empty or there are more than
+                                  P9_MAX_EXPORTS of them.
+
+**/
+EFI_STATUS
+P9SplitANames (
+  IN OUT P9_CONFIG          *Config
+  )
+{
+  UINTN                     Index;
+
+  Config->ExportCount    = 1;
+  Config->ANameOffset[0] = 0;
+  for (Index = 0; Config->AName[Index] != '\0'; Index++) {
+    if (Config->AName[Index] != ',') {
+      continue;
+    }
+
+    if (Config->ExportCount == P9_MAX_EXPORTS) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    Config->AName[Index] = '\0';
+    Config->ANameOffset[Config->ExportCount++] = (UINT16)(Index + 1);
+  }
+
+  for (Index = 0; Index < Config->ExportCount; Index++) {
+    if (Config->AName[Config->ANameOffset[Index]] == '\0') {
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+P9ReadConfig (
+  OUT P9_CONFIG             *Config
+  )
+{
+  EFI_STATUS                Status;
+  P9_CONFIG_VARIABLE        *Data;
+  UINTN                     DataSize;
+  UINT32                    IgnoreCase;
+
+  ZeroMem (Config, sizeof (P9_CONFIG));
+
+  Status = GetVariable2 (L"Config", &g9pfsGuid, (VOID **)&Data, &DataSize);
+  if (!EFI_ERROR (Status)) {
+    Status = P9ParseConfigVariable (Data, DataSize, Config);
+    FreePool (Data);
+  } else if (Status == EFI_NOT_FOUND) {
+    Status = P9ReadConfigVariables (Config);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    return Status;
+  }
+
+  Config->ConnectionCount = MIN (MAX (Config->ConnectionCount, 1), P9_MAX_CONNECTIONS);
+
+  //
+  // IgnoreCase is not part of the Config variable and is read in both cases.
+  //
+  IgnoreCase = 0;
+  P9GetUint32Variable (L"IgnoreCase", &IgnoreCase);
+  Config->IgnoreCase = (BOOLEAN)(IgnoreCase != 0);
+
+  Status = P9SplitANames (Config);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    return Status;
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+P9LoadConfig (
+  IN OUT P9_VOLUME          *Volume
+  )
+{
+  EFI_STATUS                Status;
+
+  if (Volume->IsConfigLoaded) {
+    return EFI_SUCCESS;
+  }
+
+  Status = P9ReadConfig (&Volume->Config);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Volume->IsConfigLoaded = TRUE;
+
+  return EFI_SUCCESS;
+}
@@ -11,6 +11,82 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #include "9pfs.h"
 #include "9pLib.h"
 
+/**
+
+  Writes the data queued in the write-back buffer of the file handle.
+
+  Only this handle's data is written; other handles on the volume are not
+  waited for. Asynchronous writes of the handle complete first.
+
+  @param  IFile                 - The file handle.
+
+  @retval EFI_SUCCESS           - The buffer is empty.
+  @return Others                - Writing the buffer failed.
+
+**/
+EFI_STATUS
+P9FlushWriteBack (
+  IN P9_IFILE           *IFile
+  )
+{
+  EFI_STATUS        Status;
+  UINTN             Count;
+
+  if (IFile->PendingWrites != 0) {
+    P9WaitWrites (IFile);
+  }
+
+  if (IFile->WriteBackLength == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Count = IFile->WriteBackLength;
+  Status = P9LWrite (IFile->Volume, IFile, IFile->WriteBackOffset, &Count, IFile->WriteBack);
+
+  //
+  // Keep what the server did not take so that a later flush can retry it.
+  //
+  IFile->WriteBackOffset += Count;
+  IFile->WriteBackLength -= Count;
+  if (IFile->WriteBackLength != 0) {
+    CopyMem (IFile->WriteBack, IFile->WriteBack + Count, IFile->WriteBackLength);
+  }
+
+  return Status;
+}
+
+/**
+
+  Hands the write-back buffer of the file handle over to a write batch,
+  which writes it asynchronously. The handle starts a new buffer on its
+  next buffered write.
+
+  @param  IFile                 - The file handle.
+  @param  Batch                 - The write batch.
+
+  @retval EFI_SUCCESS           - The buffer is empty or its writes are queued.
+  @return Others                - Queuing the writes failed.
+
+**/
+EFI_STATUS
+P9QueueWriteBack (
+  IN P9_IFILE           *IFile,
+  IN P9_WRITE_BATCH     *Batch
+  )
+{
+  EFI_STATUS        Status;
+
+  if (IFile->WriteBackLength == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Status = P9QueueWrite (Batch, IFile->WriteBackOffset, IFile->WriteBackLength, IFile->WriteBack, TRUE);
+  IFile->WriteBack       = NULL;
+  IFile->WriteBackLength = 0;
+
+  return Status;
+}
+
 /**
 
   Flushes all data associated with the file handle.
@@ -31,8 +107,40 @@ P9FlushEx (
   IN EFI_FILE_IO_TOKEN  *Token
   )
 {
+  EFI_STATUS        Status;
+  P9_IFILE          *IFile;
+  P9_WRITE_BATCH    *Batch;
+
   DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
-  return EFI_UNSUPPORTED;
+
+  IFile = IFILE_FROM_FHAND (FHand);
+
+  if ((IFile->Flags & O_ACCMODE) == O_RDONLY) {
+    return EFI_ACCESS_DENIED;
+  }
+
+  //
+  // With a token, the buffered data and then Tfsync are written in the
+  // background, and the token is completed by the last reply.
+  //
+  if (Token != NULL && Token->Event != NULL) {
+    Batch = P9StartWriteBatch (IFile, Token);
+    if (Batch == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = P9QueueWriteBack (IFile, Batch);
+    P9EndWriteBatch (Batch, Status, TRUE);
+    return EFI_SUCCESS;
+  }
+
+  Status = P9FlushWriteBack (IFile);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    return Status;
+  }
+
+  return P9Fsync (IFile->Volume, IFile, NULL);
 }
 
 /**
@@ -75,17 +183,52 @@ P9Close (
   EFI_STATUS        Status;
   P9_IFILE          *IFile;
   P9_VOLUME         *Volume;
+  UINTN             Index;
 
   DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
 
   IFile = IFILE_FROM_FHAND (FHand);
   Volume = IFile->Volume;
 
-  // TODO: Flush before clunk
+  Status = P9FlushWriteBack (IFile);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+  }
 
-  if (IFile != Volume->Root) {
+  if (IFile != IFile->Root) {
+    for (Index = 0; Index < Volume->StripeCount; Index++) {
+      if (IFile->StripeFid[Index] != 0) {
+        P9ClunkFid (Volume->Stripes[Index], IFile->StripeFid[Index]);
+      }
+    }
     Status = P9Clunk (Volume, IFile);
-    FreePool (IFile);
+    //
+    // Unlisted only now, so that a clunk retried after a failover finds the
+    // fid replayed on the new connection.
+    //
+    RemoveEntryList (&IFile->Link);
+    if (IFile->WriteBack != NULL) {
+      FreePool (IFile->WriteBack);
+    }
+    if (IFile->FileInfo != NULL) {
+      FreePool (IFile->FileInfo);
+    }
+    if (IFile->FileName != NULL) {
+      FreePool (IFile->FileName);
+    }
+    if (IFile->Path != NULL) {
+      FreePool (IFile->Path);
+    }
+    if (IFile->SymLinkTarget != NULL) {
+      FreePool (IFile->SymLinkTarget);
+    }
+    if (IFile->Snapshot != NULL) {
+      P9ReleaseDirSnapshot (IFile->Snapshot);
+    }
+    if (IFile->Reader != NULL) {
+      P9CloseDirReader (IFile->Reader);
+    }
+    P9FreeObject (&Volume->FileSlab, IFile);
   }
 
   return Status;
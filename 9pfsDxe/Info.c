@@ -37,6 +37,12 @@ P9GetFileInfo (
     return EFI_BUFFER_TOO_SMALL;
   }
 
+  Status = P9FlushWriteBack (IFile);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
+    goto Exit;
+  }
+
   Status = P9GetAttr (Volume, IFile);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
@@ -70,19 +76,23 @@ P9GetFileSystemInfo (
   IFile = IFILE_FROM_FHAND (FHand);
   Volume = IFile->Volume;
 
-  Status = P9Statfs (Volume);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
-    goto Exit;
-  }
-
-  Size = Volume->FileSystemInfo->Size;
+  //
+  // The size does not depend on the server, so probes for it are answered
+  // without a round trip.
+  //
+  Size = SIZE_OF_EFI_FILE_SYSTEM_INFO + StrSize (P9_VOLUME_LABEL);
   if (*BufferSize < Size) {
     *BufferSize = Size;
-    DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
+    DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, EFI_BUFFER_TOO_SMALL));
     return EFI_BUFFER_TOO_SMALL;
   }
 
+  Status = P9LookupStatfs (Volume, IFile->Root->Fid);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
+    goto Exit;
+  }
+
   CopyMem (Buffer, Volume->FileSystemInfo, Size);
   *BufferSize = Size;
 
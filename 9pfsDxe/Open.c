@@ -10,12 +10,6 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #include "9pfs.h"
 #include "9pLib.h"
 
-/* open-only flags */
-#define	O_RDONLY	0x0000		/* open for reading only */
-#define	O_WRONLY	0x0001		/* open for writing only */
-#define	O_RDWR		0x0002		/* open for reading and writing */
-#define	O_ACCMODE	0x0003		/* mask for above modes */
-
 CHAR16 *
 GetFileNameFromPath (
   IN  CHAR16                  *Path
@@ -38,6 +32,81 @@ GetFileNameFromPath (
   return PathHead;
 }
 
+/**
+
+  Builds the absolute path of FileName opened relative to a file at BasePath.
+  "." and ".." components are resolved, so the result has the form
+  "\a\b", or "\" for the root.
+
+  @param  BasePath              - Absolute path of the starting file.
+  @param  FileName              - File name relative to BasePath.
+
+  @return The absolute path allocated from pool, or NULL.
+
+**/
+CHAR16 *
+P9BuildPath (
+  IN  CHAR16                  *BasePath,
+  IN  CHAR16                  *FileName
+  )
+{
+  CHAR16  *Path;
+  UINTN   PathSize;
+  UINTN   Length;
+  UINTN   NameLength;
+
+  if (BasePath == NULL || FileName[0] == PATH_NAME_SEPARATOR) {
+    BasePath = L"";
+  }
+
+  PathSize = StrLen (BasePath) + StrLen (FileName) + 2;
+  Path = AllocatePool (PathSize * sizeof (CHAR16));
+  if (Path == NULL) {
+    return NULL;
+  }
+
+  StrCpyS (Path, PathSize, BasePath);
+  Length = StrLen (Path);
+  if (Length == 1) {
+    // The root is kept as an empty path while components are appended.
+    Length = 0;
+  }
+
+  while (*FileName != L'\0') {
+    while (*FileName == PATH_NAME_SEPARATOR) {
+      FileName++;
+    }
+
+    NameLength = 0;
+    while (FileName[NameLength] != L'\0' && FileName[NameLength] != PATH_NAME_SEPARATOR) {
+      NameLength++;
+    }
+
+    if (NameLength == 2 && FileName[0] == L'.' && FileName[1] == L'.') {
+      // Drop the last component, along with its separator.
+      while (Length > 0 && Path[Length - 1] != PATH_NAME_SEPARATOR) {
+        Length--;
+      }
+      if (Length > 0) {
+        Length--;
+      }
+    } else if (NameLength > 0 && !(NameLength == 1 && FileName[0] == L'.')) {
+      Path[Length++] = PATH_NAME_SEPARATOR;
+      CopyMem (&Path[Length], FileName, NameLength * sizeof (CHAR16));
+      Length += NameLength;
+    }
+
+    FileName += NameLength;
+  }
+
+  if (Length == 0) {
+    Path[Length++] = PATH_NAME_SEPARATOR;
+  }
+  Path[Length] = L'\0';
+
+  return Path;
+}
+
 /**
 
   Implements OpenEx() of Simple File System Protocol.
@@ -112,33 +181,62 @@ P9Open (
     return EFI_INVALID_PARAMETER;
   }
 
-  if (OpenMode != EFI_FILE_MODE_READ) {
+  if (OpenMode != EFI_FILE_MODE_READ &&
+      OpenMode != (EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE)) {
     return EFI_INVALID_PARAMETER;
   }
 
   IFile = IFILE_FROM_FHAND (FHand);
   Volume = IFile->Volume;
 
-  NewIFile = AllocateZeroPool (sizeof (P9_IFILE));
+  NewIFile = P9AllocateObject (&Volume->FileSlab);
   if (NewIFile == NULL) {
     Status = EFI_OUT_OF_RESOURCES;
     goto Exit;
   }
 
-  NewIFile->Signature  = P9_IFILE_SIGNATURE;
-  NewIFile->Volume     = Volume;
-  NewIFile->Flags      = O_RDONLY; // Currently supports read only.
-  NewIFile->IsOpened   = FALSE;
-  StrCpyS (NewIFile->FileName, P9_MAX_FLEN + 1, GetFileNameFromPath (FileName));
+  //
+  // Slab objects are not cleared; set every field the walk and the open do
+  // not fill in.
+  //
+  NewIFile->Signature       = P9_IFILE_SIGNATURE;
+  NewIFile->Volume          = Volume;
+  NewIFile->Root            = IFile->Root;
+  NewIFile->Fid             = 0;
+  NewIFile->Flags           = (OpenMode & EFI_FILE_MODE_WRITE) ? O_RDWR : O_RDONLY;
+  NewIFile->IoUnit          = 0;
+  NewIFile->IsOpened        = FALSE;
+  NewIFile->Position        = 0;
+  NewIFile->WriteBack       = NULL;
+  NewIFile->WriteBackOffset = 0;
+  NewIFile->WriteBackLength = 0;
+  NewIFile->PendingWrites   = 0;
+  NewIFile->FileInfo        = NULL;
+  NewIFile->SymLinkTarget   = NULL;
+  NewIFile->Snapshot        = NULL;
+  NewIFile->Reader          = NULL;
+  ZeroMem (NewIFile->StripeFid, sizeof (NewIFile->StripeFid));
   CopyMem (&NewIFile->Handle, &P9FileInterface, sizeof (EFI_FILE_PROTOCOL));
 
   DEBUG ((DEBUG_INFO, "%a:%d: FileName: %s\n", __func__, __LINE__, FileName));
-  Status = P9Walk (Volume, IFile, NewIFile, FileName);
+  NewIFile->FileName = AllocateCopyPool (StrSize (GetFileNameFromPath (FileName)), GetFileNameFromPath (FileName));
+  NewIFile->Path     = P9BuildPath (IFile->Path, FileName);
+  if (NewIFile->FileName == NULL || NewIFile->Path == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto Exit;
+  }
+
+  Status = P9Walk (Volume, IFile, NewIFile, FileName, TRUE);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_INFO, "%a:%d %r\n", __func__, __LINE__, Status));
     goto Exit;
   }
 
+  // Directories can only be opened for reading on the server side.
+  if (NewIFile->Qid.Type & QTDir) {
+    NewIFile->Flags = O_RDONLY;
+  }
+
   Status = P9LOpen (Volume, NewIFile);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_INFO, "%a:%d %r\n", __func__, __LINE__, Status));
@@ -146,13 +244,26 @@ P9Open (
   }
 
   NewIFile->IsOpened = TRUE;
+  InsertTailList (&Volume->Files, &NewIFile->Link);
   *NewHandle = &NewIFile->Handle;
 
   return EFI_SUCCESS;
 
 Exit:
   if (NewIFile != NULL) {
-    FreePool (NewIFile);
+    //
+    // A walked fid that could not be opened is released on the server.
+    //
+    if (NewIFile->Fid != 0) {
+      P9ClunkFid (Volume, NewIFile->Fid);
+    }
+    if (NewIFile->FileName != NULL) {
+      FreePool (NewIFile->FileName);
+    }
+    if (NewIFile->Path != NULL) {
+      FreePool (NewIFile->Path);
+    }
+    P9FreeObject (&Volume->FileSlab, NewIFile);
   }
 
   return Status;
@@ -12,129 +12,1303 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 /**
 
-  Implements Simple File System Protocol interface function OpenVolume().
+  Negotiates the protocol on a connected volume and attaches its root.
 
-  @param  This                  - Calling context.
-  @param  File                  - the Root Directory of the volume.
+  @param  Volume                - The 9P volume. Volume->MSize is the proposed
+                                  msize on input and the negotiated one on
+                                  output.
+  @param  Root                  - The root file, with the fid to attach.
+  @param  UNameStr              - Access user name.
+  @param  ANameStr              - Exported directory path.
+  @param  Handshake             - One of the P9_HANDSHAKE_* values.
 
-  @retval EFI_OUT_OF_RESOURCES  - Can not allocate the memory.
-  @retval EFI_VOLUME_CORRUPTED  - The P9 type is error.
-  @retval EFI_SUCCESS           - Open the volume successfully.
+  @retval EFI_SUCCESS           - The root is attached.
+  @return Others                - The handshake failed.
 
 **/
 EFI_STATUS
-EFIAPI
-P9OpenVolume (
-  IN  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *This,
-  OUT EFI_FILE_PROTOCOL                **File
+P9Mount (
+  IN P9_VOLUME              *Volume,
+  IN OUT P9_IFILE           *Root,
+  IN CHAR8                  *UNameStr,
+  IN CHAR8                  *ANameStr,
+  IN UINT32                 Handshake
   )
 {
   EFI_STATUS                Status;
-  P9_VOLUME                 *Volume;
+
+  if (Handshake != P9_HANDSHAKE_SEQUENTIAL) {
+    return P9Handshake (
+             Volume,
+             Root,
+             UNameStr,
+             ANameStr,
+             Handshake == P9_HANDSHAKE_PREFETCH
+             );
+  }
+
+  Status = P9Version (Volume, &Volume->MSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return P9Attach (Volume, Root->Fid, P9_NOFID, UNameStr, ANameStr, Root);
+}
+
+/**
+
+  Allocates a further connection of Volume, with a root file holding Fid.
+  The connection is neither configured nor connected.
+
+  @param  Volume                - The primary 9P volume.
+  @param  Fid                   - The fid of the root on the connection.
+  @param  Connection            - The new connection.
+
+  @retval EFI_SUCCESS           - The connection is allocated.
+  @return Others                - The connection could not be allocated.
+
+**/
+EFI_STATUS
+P9NewConnection (
+  IN P9_VOLUME              *Volume,
+  IN UINT32                 Fid,
+  OUT P9_VOLUME             **Connection
+  )
+{
+  EFI_STATUS                Status;
+  P9_VOLUME                 *NewConnection;
   P9_IFILE                  *IFile;
-  CHAR16                    *StationAddrStr;
-  CHAR16                    *SubnetMaskStr;
-  CHAR16                    *RemoteAddrStr;
-  CHAR8                     *AsciiUNameStr;
-  CHAR8                     *AsciiANameStr;
 
-  DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
+  NewConnection = AllocateZeroPool (sizeof (P9_VOLUME));
+  if (NewConnection == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
 
-  Volume  = VOLUME_FROM_VOL_INTERFACE (This);
-  IFile   = NULL;
+  NewConnection->Signature  = P9_VOLUME_SIGNATURE;
+  NewConnection->Handle     = Volume->Handle;
+  NewConnection->Service    = Volume->Service;
+  NewConnection->Primary    = Volume;
+  NewConnection->Replica    = Volume->Replica;
+  NewConnection->Rtt        = Volume->Rtt;
+  NewConnection->MSize      = Volume->MSize;
+  NewConnection->Tag        = 1;
+  InitializeListHead (&NewConnection->Requests);
+  P9InitSlab (&NewConnection->RequestSlab, P9_REQUEST_OBJECT_SIZE);
+  NewConnection->RxIoToken.Packet.RxData = &NewConnection->RxData;
 
-  Status = GetVariable2 (L"StationAddr", &g9pfsGuid, (VOID **)&StationAddrStr, NULL);
+  Status = gBS->CreateEvent (0, 0, NULL, NULL, &NewConnection->RxIoToken.CompletionToken.Event);
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
     goto Exit;
   }
 
-  Status = GetVariable2 (L"SubnetMask", &g9pfsGuid, (VOID **)&SubnetMaskStr, NULL);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
+  IFile = AllocateZeroPool (sizeof (P9_IFILE));
+  if (IFile == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
     goto Exit;
   }
 
-  Status = GetVariable2 (L"RemoteAddr", &g9pfsGuid, (VOID **)&RemoteAddrStr, NULL);
+  IFile->Signature    = P9_IFILE_SIGNATURE;
+  IFile->Volume       = NewConnection;
+  IFile->Fid          = Fid;
+  IFile->Root         = IFile;
+  NewConnection->Root = IFile;
+
+  *Connection = NewConnection;
+
+  return EFI_SUCCESS;
+
+Exit:
+  P9CleanStripe (NewConnection);
+
+  return Status;
+}
+
+/**
+
+  Opens a further stripe connection of Volume: a TCP connection to the same
+  server on which the same aname is attached. Stripe connections only carry
+  striped reads; everything else stays on the primary connection.
+
+  @param  Volume                - The mounted primary 9P volume.
+
+  @retval EFI_SUCCESS           - The stripe connection is added to Volume.
+  @return Others                - The connection could not be set up.
+
+**/
+EFI_STATUS
+P9OpenStripe (
+  IN P9_VOLUME              *Volume
+  )
+{
+  EFI_STATUS                Status;
+  P9_VOLUME                 *Stripe;
+
+  Status = P9NewConnection (Volume, GetFid (), &Stripe);
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
-    goto Exit;
+    return Status;
   }
 
-  Status = GetVariable2 (L"UName", &g9pfsGuid, (VOID **)&AsciiUNameStr, NULL);
+  Status = ConfigureP9 (Stripe);
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
     goto Exit;
   }
 
-  Status = GetVariable2 (L"AName", &g9pfsGuid, (VOID **)&AsciiANameStr, NULL);
+  Status = ConnectP9 (Stripe);
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
     goto Exit;
   }
 
-  Status = ConfigureP9 (Volume, StationAddrStr, SubnetMaskStr, RemoteAddrStr);
-  if (Status == EFI_ALREADY_STARTED) {
-    DEBUG ((DEBUG_INFO, "9P volume is already configured.\n"));
-    *File = &Volume->Root->Handle;
-    Status = EFI_SUCCESS;
-    goto Exit;
-  } else if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "Failed to configure 9P volume: %r\n", Status));
+  //
+  // Stripe connections never serve file system info or root attributes.
+  //
+  Status = P9Mount (
+    Stripe,
+    Stripe->Root,
+    Volume->Config.UName,
+    Volume->Config.AName,
+    MIN (Volume->Config.Handshake, P9_HANDSHAKE_PIPELINED)
+    );
+  if (EFI_ERROR (Status)) {
     goto Exit;
   }
 
-  Status = ConnectP9 (Volume);
-  if (Status == EFI_ALREADY_STARTED) {
-    DEBUG ((DEBUG_INFO, "9P volume is already connected.\n"));
-    *File = &Volume->Root->Handle;
-    Status = EFI_SUCCESS;
-    goto Exit;
-  } else if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "Failed to connect 9P volume: %r\n", Status));
+  Volume->Stripes[Volume->StripeCount++] = Stripe;
+
+  return EFI_SUCCESS;
+
+Exit:
+  P9CleanStripe (Stripe);
+
+  return Status;
+}
+
+/**
+
+  Opens the stripe connections of Volume up to the configured number of
+  connections. Failing to open a stripe connection only costs read
+  throughput, so errors are logged and otherwise ignored.
+
+  @param  Volume                - The mounted primary 9P volume.
+
+**/
+VOID
+P9OpenStripes (
+  IN P9_VOLUME              *Volume
+  )
+{
+  EFI_STATUS                Status;
+
+  while (Volume->StripeCount + 1 < Volume->Config.ConnectionCount) {
+    Status = P9OpenStripe (Volume);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "Failed to open 9P stripe connection: %r\n", Status));
+      break;
+    }
+  }
+}
+
+/**
+
+  Starts a racing connection of Volume to replica server Replica. The root
+  of Volume is attached on it with the same fid, so that the connection that
+  wins the race can replace the primary connection.
+
+  @param  Volume                - The primary 9P volume.
+  @param  Replica               - Index of the server in the configuration.
+
+  @retval EFI_SUCCESS           - The racing connection is connecting.
+  @return Others                - The connection could not be started.
+
+**/
+EFI_STATUS
+P9StartRacer (
+  IN OUT P9_VOLUME          *Volume,
+  IN UINT32                 Replica
+  )
+{
+  EFI_STATUS                Status;
+  P9_VOLUME                 *Racer;
+
+  Status = P9NewConnection (Volume, Volume->Root->Fid, &Racer);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Racer->Replica = Replica;
+  Status = ConfigureP9 (Racer);
+  if (EFI_ERROR (Status)) {
     goto Exit;
   }
 
-  Volume->Tag   = 1;
-  Volume->MSize = P9_MSIZE;
-  Status = P9Version (Volume, &Volume->MSize);
+  Status = P9StartConnect (Racer);
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
     goto Exit;
   }
 
+  Racer->MountState = P9MountConnecting;
+  Volume->Racers[Volume->RacerCount++] = Racer;
+
+  return EFI_SUCCESS;
+
+Exit:
+  P9CleanStripe (Racer);
+
+  return Status;
+}
+
+/**
+
+  Makes the connection of Racer the primary connection of Volume, together
+  with what its handshake learned about the root and the file system. The
+  racing connection is freed.
+
+  @param  Volume                - The primary 9P volume, without a TCP
+                                  instance of its own.
+  @param  Racer                 - The racing connection that won.
+
+**/
+VOID
+P9AdoptRacer (
+  IN OUT P9_VOLUME          *Volume,
+  IN OUT P9_VOLUME          *Racer
+  )
+{
+  EFI_EVENT                 Event;
+  EFI_FILE_INFO             *FileInfo;
+
+  Volume->Tcp4ChildHandle = Racer->Tcp4ChildHandle;
+  Volume->Tcp4            = Racer->Tcp4;
+  Volume->IsConfigured    = Racer->IsConfigured;
+  Volume->MSize           = Racer->MSize;
+  Volume->Rtt             = Racer->Rtt;
+  Volume->Replica         = Racer->Replica;
+  Volume->MountState      = Racer->MountState;
+  Racer->Tcp4ChildHandle  = NULL;
+  Racer->Tcp4             = NULL;
+
+  //
+  // Completion events are interchangeable; swap them so that each is closed
+  // once.
+  //
+  Event = Volume->RxIoToken.CompletionToken.Event;
+  Volume->RxIoToken.CompletionToken.Event = Racer->RxIoToken.CompletionToken.Event;
+  Racer->RxIoToken.CompletionToken.Event  = Event;
+
+  if (Racer->FileSystemInfo != NULL) {
+    if (Volume->FileSystemInfo != NULL) {
+      FreePool (Volume->FileSystemInfo);
+    }
+    Volume->FileSystemInfo    = Racer->FileSystemInfo;
+    Volume->FileSystemInfoFid = Racer->FileSystemInfoFid;
+    Volume->FileSystemInfoAt  = Racer->FileSystemInfoAt;
+    Racer->FileSystemInfo     = NULL;
+  }
+
+  CopyMem (&Volume->Root->Qid, &Racer->Root->Qid, sizeof (Qid));
+  FileInfo = Volume->Root->FileInfo;
+  Volume->Root->FileInfo = Racer->Root->FileInfo;
+  Racer->Root->FileInfo  = FileInfo;
+
+  P9CleanStripe (Racer);
+}
+
+/**
+
+  Advances one connection of a mount through connecting and handshaking.
+
+  @param  Connection            - The primary 9P volume or one of its racing
+                                  connections.
+  @param  Wait                  - Whether to block until the root is attached.
+
+  @retval EFI_SUCCESS           - The root is attached.
+  @retval EFI_NOT_READY         - Wait is FALSE and the connection can not
+                                  progress without blocking.
+  @return Others                - The connection failed.
+
+**/
+EFI_STATUS
+P9StepMount (
+  IN OUT P9_VOLUME          *Connection,
+  IN BOOLEAN                Wait
+  )
+{
+  EFI_STATUS                Status;
+  P9_CONFIG                 *Config;
+
+  Config = (Connection->Primary != NULL) ? &Connection->Primary->Config : &Connection->Config;
+
+  Status = EFI_SUCCESS;
+  while (!EFI_ERROR (Status) && Connection->MountState != P9MountStriping) {
+    if (Connection->MountState == P9MountConnecting) {
+      Status = P9CheckConnect (Connection, Wait);
+      if (!EFI_ERROR (Status)) {
+        Connection->MountState = P9MountConnected;
+      }
+    } else if (Connection->MountState == P9MountConnected) {
+      if (Config->Handshake != P9_HANDSHAKE_SEQUENTIAL) {
+        Status = P9HandshakeStart (
+          Connection,
+          Connection->Root,
+          Config->UName,
+          Config->AName,
+          Config->Handshake == P9_HANDSHAKE_PREFETCH,
+          &Connection->PendingHandshake
+          );
+        if (!EFI_ERROR (Status)) {
+          Connection->MountState = P9MountHandshaking;
+        }
+      } else if (Wait) {
+        Status = P9Mount (
+          Connection,
+          Connection->Root,
+          Config->UName,
+          Config->AName,
+          P9_HANDSHAKE_SEQUENTIAL
+          );
+        if (!EFI_ERROR (Status)) {
+          Connection->MountState = P9MountStriping;
+        }
+      } else {
+        Status = EFI_NOT_READY;
+      }
+    } else if (Connection->MountState == P9MountHandshaking) {
+      Status = P9HandshakeFinish (Connection, Connection->PendingHandshake, Wait);
+      if (Status != EFI_NOT_READY) {
+        Connection->PendingHandshake = NULL;
+      }
+      if (!EFI_ERROR (Status)) {
+        Connection->MountState = P9MountStriping;
+      }
+    } else {
+      Status = EFI_NOT_STARTED;
+    }
+  }
+
+  return Status;
+}
+
+/**
+
+  Advances the racing connections of a mount. The first connection to get
+  through the handshake wins and becomes the primary connection; the others
+  are closed. With a sequential handshake the first connection established
+  wins.
+
+  @param  Volume                - The racing 9P volume.
+  @param  Wait                  - Whether to block until a connection wins.
+
+  @retval EFI_SUCCESS           - A connection won.
+  @retval EFI_NOT_READY         - Wait is FALSE and no connection won yet.
+  @retval EFI_TIMEOUT           - Wait is TRUE and no connection won within
+                                  P9_REQUEST_TIMEOUT ticks.
+  @return Others                - All the racing connections failed.
+
+**/
+EFI_STATUS
+P9RaceMount (
+  IN OUT P9_VOLUME          *Volume,
+  IN BOOLEAN                Wait
+  )
+{
+  EFI_STATUS                Status;
+  P9_VOLUME                 *Racer;
+  P9_VOLUME                 *Winner;
+  UINTN                     Index;
+  UINT64                    Deadline;
+
+  Status   = EFI_NOT_FOUND;
+  Winner   = NULL;
+  Deadline = P9GetTick () + P9_REQUEST_TIMEOUT;
+  while (Winner == NULL && Volume->RacerCount > 0) {
+    Index = 0;
+    while (Index < Volume->RacerCount) {
+      Racer  = Volume->Racers[Index];
+      Status = P9StepMount (Racer, FALSE);
+      if (!EFI_ERROR (Status) ||
+          (Status == EFI_NOT_READY && Racer->MountState == P9MountConnected)) {
+        Winner = Racer;
+        Volume->Racers[Index] = Volume->Racers[--Volume->RacerCount];
+        break;
+      }
+
+      if (Status == EFI_NOT_READY) {
+        Index++;
+        continue;
+      }
+
+      DEBUG ((DEBUG_ERROR, "%a:%d: Replica %d: %r\n", __func__, __LINE__, Racer->Replica, Status));
+      P9CleanStripe (Racer);
+      Volume->Racers[Index] = Volume->Racers[--Volume->RacerCount];
+    }
+
+    if (Winner == NULL && Volume->RacerCount > 0) {
+      if (!Wait) {
+        return EFI_NOT_READY;
+      }
+      if (P9GetTick () >= Deadline) {
+        DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, EFI_TIMEOUT));
+        while (Volume->RacerCount > 0) {
+          P9CleanStripe (Volume->Racers[--Volume->RacerCount]);
+        }
+        return EFI_TIMEOUT;
+      }
+    }
+  }
+
+  if (Winner == NULL) {
+    return Status;
+  }
+
+  DEBUG ((DEBUG_INFO, "%a:%d: Replica %d won, RTT %ld ms\n", __func__, __LINE__, Winner->Replica, Winner->Rtt));
+
+  while (Volume->RacerCount > 0) {
+    P9CleanStripe (Volume->Racers[--Volume->RacerCount]);
+  }
+
+  P9AdoptRacer (Volume, Winner);
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Drops a failed mount and returns the volume to the idle state, so that the
+  next OpenVolume starts over.
+
+  @param  Volume                - The 9P volume.
+
+**/
+VOID
+P9AbortMount (
+  IN OUT P9_VOLUME          *Volume
+  )
+{
+  while (Volume->RacerCount > 0) {
+    P9CleanStripe (Volume->Racers[--Volume->RacerCount]);
+  }
+
+  P9ResetConnection (Volume);
+
+  if (Volume->Root != NULL) {
+    if (Volume->Root->FileName != NULL) {
+      FreePool (Volume->Root->FileName);
+    }
+    if (Volume->Root->Path != NULL) {
+      FreePool (Volume->Root->Path);
+    }
+    FreePool (Volume->Root);
+    Volume->Root = NULL;
+  }
+
+  //
+  // Read the configuration again on the next attempt, it may have been fixed.
+  //
+  Volume->IsConfigLoaded = FALSE;
+  Volume->MountState     = P9MountIdle;
+  P9ResetNicSelector ();
+}
+
+/**
+
+  Starts mounting a volume: allocates its root, configures the TCP instance
+  and starts connecting to the server. With several replica servers a racing
+  connection is started to each of them instead.
+
+  @param  Volume                - The idle 9P volume.
+
+  @retval EFI_SUCCESS           - The volume is connecting or racing.
+  @return Others                - The mount could not be started.
+
+**/
+EFI_STATUS
+P9StartMount (
+  IN OUT P9_VOLUME          *Volume
+  )
+{
+  EFI_STATUS                Status;
+  P9_IFILE                  *IFile;
+  UINT32                    Replica;
+
+  Status = P9LoadConfig (Volume);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
   IFile = AllocateZeroPool (sizeof (P9_IFILE));
   if (IFile == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
     DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
-    goto Exit;
+    return EFI_OUT_OF_RESOURCES;
   }
 
   IFile->Signature  = P9_IFILE_SIGNATURE;
   IFile->Volume     = Volume;
+  IFile->Root       = IFile;
   IFile->Fid        = GetFid ();
-  StrCpyS (IFile->FileName, P9_MAX_FLEN + 1, L"");
   CopyMem (&IFile->Handle, &P9FileInterface, sizeof (EFI_FILE_PROTOCOL));
+  Volume->Root = IFile;
 
-  Status = P9Attach (Volume, IFile->Fid, P9_NOFID, AsciiUNameStr, AsciiANameStr, IFile);
-  if (EFI_ERROR (Status)) {
+  IFile->FileName = AllocateCopyPool (sizeof (L""), L"");
+  IFile->Path     = AllocateCopyPool (sizeof (L"\\"), L"\\");
+  if (IFile->FileName == NULL || IFile->Path == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
     DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
     goto Exit;
   }
 
-  *File = &IFile->Handle;
-  Volume->Root = IFile;
+  Volume->Tag     = 1;
+  Volume->MSize   = P9_MSIZE;
+  Volume->Replica = 0;
 
-  DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
+  if (Volume->Config.RemoteCount > 1) {
+    for (Replica = 0; Replica < Volume->Config.RemoteCount; Replica++) {
+      Status = P9StartRacer (Volume, Replica);
+      if (EFI_ERROR (Status)) {
+        DEBUG ((DEBUG_ERROR, "Failed to connect 9P replica %d: %r\n", Replica, Status));
+      }
+    }
+
+    if (Volume->RacerCount == 0) {
+      goto Exit;
+    }
+
+    Volume->MountState = P9MountRacing;
+
+    return EFI_SUCCESS;
+  }
+
+  Status = ConfigureP9 (Volume);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed to configure 9P volume: %r\n", Status));
+    goto Exit;
+  }
+
+  Status = P9StartConnect (Volume);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed to connect 9P volume: %r\n", Status));
+    goto Exit;
+  }
+
+  Volume->MountState = P9MountConnecting;
 
   return EFI_SUCCESS;
 
 Exit:
-  if (IFile != NULL) {
-    FreePool (IFile);
+  P9AbortMount (Volume);
+
+  return Status;
+}
+
+/**
+
+  Advances a mount started by P9StartMount.
+
+  Without Wait only the steps that do not block are taken: the connections
+  are polled and the pipelined handshake is sent and its replies collected.
+  The sequential handshake and the stripe connections are left to a call
+  with Wait. A failed mount is aborted.
+
+  @param  Volume                - The 9P volume.
+  @param  Wait                  - Whether to block until the volume is
+                                  mounted.
+
+  @retval EFI_SUCCESS           - The volume is mounted.
+  @retval EFI_NOT_READY         - Wait is FALSE and the mount is in progress.
+  @retval EFI_NOT_STARTED       - No mount is in progress.
+  @return Others                - The mount failed.
+
+**/
+EFI_STATUS
+P9ContinueMount (
+  IN OUT P9_VOLUME          *Volume,
+  IN BOOLEAN                Wait
+  )
+{
+  EFI_STATUS                Status;
+  BOOLEAN                   IsBusy;
+
+  IsBusy = Volume->IsBusy;
+  Volume->IsBusy = TRUE;
+
+  Status = EFI_SUCCESS;
+  while (!EFI_ERROR (Status) && Volume->MountState != P9MountReady) {
+    if (Volume->MountState == P9MountIdle) {
+      Status = EFI_NOT_STARTED;
+    } else if (Volume->MountState == P9MountRacing) {
+      Status = P9RaceMount (Volume, Wait);
+    } else if (Volume->MountState != P9MountStriping) {
+      Status = P9StepMount (Volume, Wait);
+    } else if (!Wait) {
+      Status = EFI_NOT_READY;
+    } else {
+      P9OpenStripes (Volume);
+      gBS->SetTimer (Volume->ReactorTimer, TimerPeriodic, P9_REACTOR_PERIOD);
+      Volume->MountState = P9MountReady;
+      Status = EFI_SUCCESS;
+    }
   }
 
-  DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
+  if (EFI_ERROR (Status) && Status != EFI_NOT_READY && Status != EFI_NOT_STARTED) {
+    DEBUG ((DEBUG_ERROR, "Failed to mount 9P volume: %r\n", Status));
+    P9AbortMount (Volume);
+  }
+
+  Volume->IsBusy = IsBusy;
+
+  return Status;
+}
+
+/**
+
+  Attaches the root of a further export on the connection of its volume.
+  An open root is opened again.
+
+  @param  Export                - The export.
+  @param  Root                  - The root file, with the fid to attach.
+
+  @retval EFI_SUCCESS           - The root is attached.
+  @return Others                - The root could not be attached or opened.
+
+**/
+EFI_STATUS
+P9AttachExport (
+  IN P9_EXPORT              *Export,
+  IN OUT P9_IFILE           *Root
+  )
+{
+  EFI_STATUS                Status;
+  P9_CONFIG                 *Config;
+
+  //
+  // The configuration is read again after a failed mount and may list fewer
+  // exports by now.
+  //
+  Config = &Export->Volume->Config;
+  if (Export->Index >= Config->ExportCount) {
+    return EFI_NOT_FOUND;
+  }
+
+  Status = P9Attach (
+             Export->Volume,
+             Root->Fid,
+             P9_NOFID,
+             Config->UName,
+             Config->AName + Config->ANameOffset[Export->Index],
+             Root
+             );
+  if (EFI_ERROR (Status) || !Root->IsOpened) {
+    return Status;
+  }
+
+  return P9LOpen (Export->Volume, Root);
+}
+
+/**
+
+  Makes the fid of an open file refer to it again on a new connection: the
+  fid is walked to from the root under the same number and opened with the
+  same mode. Stripe fids are dropped and opened again on first use.
+
+  @param  Volume                - The reconnected primary 9P volume.
+  @param  IFile                 - The open file.
+
+  @retval EFI_SUCCESS           - The fid is usable again.
+  @return Others                - The file could not be walked to or opened.
+
+**/
+EFI_STATUS
+P9ReplayFile (
+  IN P9_VOLUME              *Volume,
+  IN OUT P9_IFILE           *IFile
+  )
+{
+  EFI_STATUS                Status;
+  Qid                       NewQid;
+
+  ZeroMem (IFile->StripeFid, sizeof (IFile->StripeFid));
+
+  //
+  // Replica servers need not agree on qids, so the file is identified by
+  // its path only.
+  //
+  Status = P9WalkFid (Volume, IFile->Root->Fid, IFile->Fid, IFile->Path, &NewQid, NULL);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return P9LOpen (Volume, IFile);
+}
+
+/**
+
+  Re-establishes the connections of a mounted volume after its primary
+  connection was lost, trying the replica servers in turn starting with the
+  current one. The root is attached again and the fid of every open file is
+  walked to and opened again under the same number, so requests built before
+  the failure can be sent again unchanged. Requests still queued on the lost
+  connection complete with EFI_ABORTED.
+
+  @param  Volume                - The mounted primary 9P volume.
+
+  @retval EFI_SUCCESS           - The volume is connected again.
+  @retval EFI_UNSUPPORTED       - Volume is not a mounted primary volume.
+  @retval EFI_ALREADY_STARTED   - The volume is already reconnecting.
+  @return Others                - No server could be reached.
+
+**/
+EFI_STATUS
+P9Reconnect (
+  IN OUT P9_VOLUME          *Volume
+  )
+{
+  EFI_STATUS                Status;
+  BOOLEAN                   IsBusy;
+  LIST_ENTRY                *Entry;
+  P9_IFILE                  *IFile;
+  UINT32                    Replica;
+  UINT32                    Index;
+
+  if (Volume->Primary != NULL || Volume->MountState != P9MountReady) {
+    return EFI_UNSUPPORTED;
+  }
+
+  //
+  // The requests of the reconnect itself are not retried.
+  //
+  if (Volume->IsReconnecting) {
+    return EFI_ALREADY_STARTED;
+  }
+
+  DEBUG ((DEBUG_ERROR, "%a:%d: Lost connection to replica %d\n", __func__, __LINE__, Volume->Replica));
+
+  IsBusy = Volume->IsBusy;
+  Volume->IsBusy = TRUE;
+  Volume->IsReconnecting = TRUE;
+
+  while (Volume->StripeCount > 0) {
+    P9CleanStripe (Volume->Stripes[--Volume->StripeCount]);
+  }
+
+  P9ResetConnection (Volume);
+  P9AbortRequests (Volume, EFI_ABORTED);
+  P9ResetFidCache (Volume);
+  P9ResetLinkCache (Volume);
+  P9ResetDirIndexes (Volume);
+  P9ResetDirCache (Volume);
+  P9ResetStatfsCache (Volume);
+
+  Status  = EFI_NOT_FOUND;
+  Replica = Volume->Replica;
+  for (Index = 0; Index < Volume->Config.RemoteCount; Index++) {
+    Volume->Replica = (Replica + Index) % Volume->Config.RemoteCount;
+    Volume->MSize   = P9_MSIZE;
+
+    Status = ConfigureP9 (Volume);
+    if (!EFI_ERROR (Status)) {
+      Status = ConnectP9 (Volume);
+    }
+    if (!EFI_ERROR (Status)) {
+      //
+      // Root attributes and file system info are still known.
+      //
+      Status = P9Mount (
+        Volume,
+        Volume->Root,
+        Volume->Config.UName,
+        Volume->Config.AName,
+        MIN (Volume->Config.Handshake, P9_HANDSHAKE_PIPELINED)
+        );
+    }
+    if (!EFI_ERROR (Status)) {
+      break;
+    }
+
+    DEBUG ((DEBUG_ERROR, "%a:%d: Replica %d: %r\n", __func__, __LINE__, Volume->Replica, Status));
+    P9ResetConnection (Volume);
+  }
+
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  DEBUG ((DEBUG_INFO, "%a:%d: Reconnected to replica %d\n", __func__, __LINE__, Volume->Replica));
+
+  if (Volume->Root->IsOpened) {
+    Status = P9LOpen (Volume, Volume->Root);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    }
+  }
+
+  //
+  // Further exports keep their roots under the same fids as well.
+  //
+  for (Index = 0; Index < Volume->ExportCount; Index++) {
+    if (Volume->Exports[Index]->Root == NULL) {
+      continue;
+    }
+
+    Status = P9AttachExport (Volume->Exports[Index], Volume->Exports[Index]->Root);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: Export %d: %r\n", __func__, __LINE__, Volume->Exports[Index]->Index, Status));
+    }
+  }
+
+  //
+  // A file that can not be replayed fails its next request.
+  //
+  BASE_LIST_FOR_EACH (Entry, &Volume->Files) {
+    IFile  = BASE_CR (Entry, P9_IFILE, Link);
+    Status = P9ReplayFile (Volume, IFile);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %s: %r\n", __func__, __LINE__, IFile->Path, Status));
+    }
+  }
+
+  P9OpenStripes (Volume);
+  Status = EFI_SUCCESS;
+
+Exit:
+  Volume->IsReconnecting = FALSE;
+  Volume->IsBusy = IsBusy;
+
+  return Status;
+}
+
+/**
+
+  Advances a pending mount from the mount timer of the volume.
+
+  @param  Event                 - The mount timer event.
+  @param  Context               - The 9P volume.
+
+**/
+VOID
+EFIAPI
+P9MountTimer (
+  IN EFI_EVENT              Event,
+  IN VOID                   *Context
+  )
+{
+  P9_VOLUME                 *Volume;
+
+  Volume = (P9_VOLUME *)Context;
+
+  //
+  // OpenVolume may be mounting the volume itself.
+  //
+  if (!Volume->IsBusy) {
+    P9ContinueMount (Volume, FALSE);
+  }
+
+  //
+  // Only racing, connecting and collecting the handshake replies progress
+  // without blocking. The remaining steps are taken by OpenVolume.
+  //
+  if (Volume->MountState != P9MountRacing &&
+      Volume->MountState != P9MountConnecting &&
+      Volume->MountState != P9MountHandshaking) {
+    gBS->SetTimer (Event, TimerCancel, 0);
+  }
+}
+
+/**
+
+  Starts mounting a volume in the background if the EagerConnect variable is
+  set. The mount is advanced by the mount timer of the volume.
+
+  @param  Volume                - The 9P volume.
+
+  @retval EFI_SUCCESS           - The mount is started, or eager mounting is
+                                  not enabled.
+  @return Others                - The mount could not be started.
+
+**/
+EFI_STATUS
+P9EagerMount (
+  IN P9_VOLUME              *Volume
+  )
+{
+  EFI_STATUS                Status;
+
+  Status = P9LoadConfig (Volume);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (!Volume->Config.IsEager || Volume->MountState != P9MountIdle) {
+    return EFI_SUCCESS;
+  }
+
+  Status = P9StartMount (Volume);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return gBS->SetTimer (Volume->MountTimer, TimerPeriodic, P9_REACTOR_PERIOD);
+}
+
+/**
+
+  Mounts a volume, starting the mount if none is in progress and waiting for
+  it to finish.
+
+  @param  Volume                - The 9P volume.
+
+  @retval EFI_SUCCESS           - The volume is mounted.
+  @return Others                - The mount failed.
+
+**/
+EFI_STATUS
+P9MountVolume (
+  IN OUT P9_VOLUME          *Volume
+  )
+{
+  EFI_STATUS                Status;
+
+  if (Volume->MountState == P9MountIdle) {
+    Status = P9StartMount (Volume);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  //
+  // A mount started eagerly may already be partly or fully done.
+  //
+  return P9ContinueMount (Volume, TRUE);
+}
+
+/**
+
+  Implements Simple File System Protocol interface function OpenVolume().
+
+  @param  This                  - Calling context.
+  @param  File                  - the Root Directory of the volume.
+
+  @retval EFI_OUT_OF_RESOURCES  - Can not allocate the memory.
+  @retval EFI_VOLUME_CORRUPTED  - The P9 type is error.
+  @retval EFI_SUCCESS           - Open the volume successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+P9OpenVolume (
+  IN  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *This,
+  OUT EFI_FILE_PROTOCOL                **File
+  )
+{
+  EFI_STATUS                Status;
+  P9_VOLUME                 *Volume;
+
+  DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
+
+  Volume = VOLUME_FROM_VOL_INTERFACE (This);
+
+  Status = P9MountVolume (Volume);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    return Status;
+  }
+
+  *File = &Volume->Root->Handle;
+
+  DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Implements OpenVolume() of the Simple File System Protocol of a further
+  export. The export is attached on the connection of its volume the first
+  time it is opened.
+
+  @param  This                  - Calling context.
+  @param  File                  - the Root Directory of the export.
+
+  @retval EFI_SUCCESS           - Open the export successfully.
+  @retval EFI_OUT_OF_RESOURCES  - Can not allocate the memory.
+  @return Others                - The volume could not be mounted or the
+                                  export could not be attached.
+
+**/
+EFI_STATUS
+EFIAPI
+P9OpenExport (
+  IN  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *This,
+  OUT EFI_FILE_PROTOCOL                **File
+  )
+{
+  EFI_STATUS                Status;
+  P9_EXPORT                 *Export;
+  P9_VOLUME                 *Volume;
+  P9_IFILE                  *IFile;
+
+  DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
+
+  Export = EXPORT_FROM_VOL_INTERFACE (This);
+  Volume = Export->Volume;
+
+  Status = P9MountVolume (Volume);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    return Status;
+  }
+
+  if (Export->Root != NULL) {
+    *File = &Export->Root->Handle;
+    return EFI_SUCCESS;
+  }
+
+  IFile = AllocateZeroPool (sizeof (P9_IFILE));
+  if (IFile == NULL) {
+    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  IFile->Signature  = P9_IFILE_SIGNATURE;
+  IFile->Volume     = Volume;
+  IFile->Root       = IFile;
+  IFile->Fid        = GetFid ();
+  CopyMem (&IFile->Handle, &P9FileInterface, sizeof (EFI_FILE_PROTOCOL));
+
+  IFile->FileName = AllocateCopyPool (sizeof (L""), L"");
+  IFile->Path     = AllocateCopyPool (sizeof (L"\\"), L"\\");
+  if (IFile->FileName == NULL || IFile->Path == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    DEBUG ((DEBUG_ERROR, "%a:%d\n", __func__, __LINE__));
+    goto Exit;
+  }
+
+  Status = P9AttachExport (Export, IFile);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: Export %d: %r\n", __func__, __LINE__, Export->Index, Status));
+    goto Exit;
+  }
+
+  Export->Root = IFile;
+  *File = &IFile->Handle;
+
+  return EFI_SUCCESS;
+
+Exit:
+  if (IFile->FileName != NULL) {
+    FreePool (IFile->FileName);
+  }
+  if (IFile->Path != NULL) {
+    FreePool (IFile->Path);
+  }
+  FreePool (IFile);
+
+  return Status;
+}
+
+/**
+
+  Installs a file system for each export of the configuration after the
+  first one, which is served by the volume itself. Each export is a child
+  of the controller of the volume, so that the controller can only be
+  stopped after its exports.
+
+  @param  Volume                - The 9P volume.
+
+  @retval EFI_SUCCESS           - The exports are installed.
+  @retval EFI_UNSUPPORTED       - The controller has no device path.
+  @retval EFI_OUT_OF_RESOURCES  - Can not allocate the memory.
+  @return Others                - The configuration could not be read or an
+                                  export could not be installed.
+
+**/
+EFI_STATUS
+P9InstallExports (
+  IN P9_VOLUME              *Volume
+  )
+{
+  EFI_STATUS                Status;
+  EFI_DEVICE_PATH_PROTOCOL  *ParentDevicePath;
+  P9_EXPORT_DEVICE_PATH     Node;
+  P9_EXPORT                 *Export;
+  UINT32                    Index;
+  VOID                      *Interface;
+
+  Status = P9LoadConfig (Volume);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  ParentDevicePath = DevicePathFromHandle (Volume->Handle);
+  if (ParentDevicePath == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  ZeroMem (&Node, sizeof (Node));
+  Node.Vendor.Header.Type    = MESSAGING_DEVICE_PATH;
+  Node.Vendor.Header.SubType = MSG_VENDOR_DP;
+  SetDevicePathNodeLength (&Node.Vendor.Header, sizeof (Node));
+  CopyGuid (&Node.Vendor.Guid, &g9pfsGuid);
+
+  for (Index = 1; Index < Volume->Config.ExportCount; Index++) {
+    Export = AllocateZeroPool (sizeof (P9_EXPORT));
+    if (Export == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Export->Signature                  = P9_EXPORT_SIGNATURE;
+    Export->Volume                     = Volume;
+    Export->Index                      = Index;
+    Export->VolumeInterface.Revision   = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_REVISION;
+    Export->VolumeInterface.OpenVolume = P9OpenExport;
+
+    Node.Index = Index;
+    Export->DevicePath = AppendDevicePathNode (ParentDevicePath, &Node.Vendor.Header);
+    if (Export->DevicePath == NULL) {
+      FreePool (Export);
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = gBS->InstallMultipleProtocolInterfaces (
+                    &Export->Handle,
+                    &gEfiDevicePathProtocolGuid,
+                    Export->DevicePath,
+                    &gEfiSimpleFileSystemProtocolGuid,
+                    &Export->VolumeInterface,
+                    NULL
+                    );
+    if (EFI_ERROR (Status)) {
+      FreePool (Export->DevicePath);
+      FreePool (Export);
+      return Status;
+    }
+
+    Status = gBS->OpenProtocol (
+                    Volume->Handle,
+                    &gEfiTcp4ServiceBindingProtocolGuid,
+                    &Interface,
+                    g9pfsDriverBinding.DriverBindingHandle,
+                    Export->Handle,
+                    EFI_OPEN_PROTOCOL_BY_CHILD_CONTROLLER
+                    );
+    if (EFI_ERROR (Status)) {
+      gBS->UninstallMultipleProtocolInterfaces (
+             Export->Handle,
+             &gEfiDevicePathProtocolGuid,
+             Export->DevicePath,
+             &gEfiSimpleFileSystemProtocolGuid,
+             &Export->VolumeInterface,
+             NULL
+             );
+      FreePool (Export->DevicePath);
+      FreePool (Export);
+      return Status;
+    }
+
+    Volume->Exports[Volume->ExportCount++] = Export;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Uninstalls one further export of a volume and frees it, unless its file
+  system is still in use.
+
+  @param  Export                - The export.
+
+  @retval EFI_SUCCESS           - The export is uninstalled.
+  @return Others                - The file system could not be uninstalled;
+                                  the export is left in place.
+
+**/
+EFI_STATUS
+P9UninstallExport (
+  IN P9_EXPORT              *Export
+  )
+{
+  EFI_STATUS                Status;
+  P9_VOLUME                 *Volume;
+  VOID                      *Interface;
+  UINTN                     Index;
+
+  Volume = Export->Volume;
+
+  gBS->CloseProtocol (
+         Volume->Handle,
+         &gEfiTcp4ServiceBindingProtocolGuid,
+         g9pfsDriverBinding.DriverBindingHandle,
+         Export->Handle
+         );
+
+  Status = gBS->UninstallMultipleProtocolInterfaces (
+                  Export->Handle,
+                  &gEfiDevicePathProtocolGuid,
+                  Export->DevicePath,
+                  &gEfiSimpleFileSystemProtocolGuid,
+                  &Export->VolumeInterface,
+                  NULL
+                  );
+  if (EFI_ERROR (Status)) {
+    gBS->OpenProtocol (
+           Volume->Handle,
+           &gEfiTcp4ServiceBindingProtocolGuid,
+           &Interface,
+           g9pfsDriverBinding.DriverBindingHandle,
+           Export->Handle,
+           EFI_OPEN_PROTOCOL_BY_CHILD_CONTROLLER
+           );
+    return Status;
+  }
+
+  for (Index = 0; Index < Volume->ExportCount; Index++) {
+    if (Volume->Exports[Index] == Export) {
+      Volume->Exports[Index] = Volume->Exports[--Volume->ExportCount];
+      break;
+    }
+  }
+
+  if (Export->Root != NULL) {
+    if (Export->Root->FileInfo != NULL) {
+      FreePool (Export->Root->FileInfo);
+    }
+    if (Export->Root->FileName != NULL) {
+      FreePool (Export->Root->FileName);
+    }
+    if (Export->Root->Path != NULL) {
+      FreePool (Export->Root->Path);
+    }
+    FreePool (Export->Root);
+  }
+  FreePool (Export->DevicePath);
+  FreePool (Export);
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Uninstalls and frees the further exports of a volume that are not in
+  use. The driver binding normally stops them as children first.
+
+  @param  Volume                - The 9P volume.
+
+  @retval EFI_SUCCESS           - All the exports are uninstalled.
+  @return Others                - An export is still in use.
+
+**/
+EFI_STATUS
+P9UninstallExports (
+  IN P9_VOLUME              *Volume
+  )
+{
+  EFI_STATUS                Status;
+  UINTN                     Index;
+
+  Status = EFI_SUCCESS;
+  for (Index = Volume->ExportCount; Index > 0; Index--) {
+    if (EFI_ERROR (P9UninstallExport (Volume->Exports[Index - 1]))) {
+      Status = EFI_ACCESS_DENIED;
+    }
+  }
 
   return Status;
 }
@@ -11,12 +11,6 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #include "9pfs.h"
 #include "9pLib.h"
 
-/* open-only flags */
-#define	O_RDONLY	0x0000		/* open for reading only */
-#define	O_WRONLY	0x0001		/* open for writing only */
-#define	O_RDWR		0x0002		/* open for reading and writing */
-#define	O_ACCMODE	0x0003		/* mask for above modes */
-
 /**
 
   Get the file's position of the file.
@@ -75,6 +69,18 @@ P9SetPosition (
   if (IFile->Qid.Type == QTDir && Position != 0) {
     return EFI_UNSUPPORTED;
   }
+
+  //
+  // Enumerating a directory again starts with a fresh listing.
+  //
+  if (IFile->Snapshot != NULL) {
+    P9ReleaseDirSnapshot (IFile->Snapshot);
+    IFile->Snapshot = NULL;
+  }
+  if (IFile->Reader != NULL) {
+    P9CloseDirReader (IFile->Reader);
+    IFile->Reader = NULL;
+  }
   IFile->Position = Position;
 
   return EFI_SUCCESS;
@@ -107,8 +113,8 @@ P9FileRead (
   P9_VOLUME         *Volume;
   UINT32            MaxRxSize;
   UINT64            Position;
-  UINTN             Index;
-  UINTN             NReads;
+  UINTN             Total;
+  UINTN             Remaining;
   UINT32            Count;
 
   DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
@@ -116,20 +122,57 @@ P9FileRead (
   IFile = IFILE_FROM_FHAND (FHand);
   Volume = IFile->Volume;
 
-  MaxRxSize = P9_MSIZE - 24;
-  Position  = IFile->Position;
-  NReads    = (*BufferSize + (MaxRxSize - 1)) / MaxRxSize;
-  for (Index = 0; Index < NReads; Index++) {
-    Count = (Index < NReads - 1) ? MaxRxSize : (*BufferSize % MaxRxSize);
-    Status = P9LRead (Volume, IFile, (UINT32 *)&Count, Buffer);
+  Status = P9FlushWriteBack (IFile);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    goto Exit;
+  }
+
+  MaxRxSize = Volume->MSize - sizeof (P9RRead);
+  if (IFile->IoUnit != 0 && IFile->IoUnit < MaxRxSize) {
+    MaxRxSize = IFile->IoUnit;
+  }
+
+  if (Volume->StripeCount > 0 && *BufferSize >= P9_STRIPE_MIN_SIZE) {
+    Total = *BufferSize;
+    Status = P9LReadStriped (Volume, IFile, IFile->Position, &Total, Buffer);
+
+    //
+    // After a failover, resume after the data already read.
+    //
+    if (P9IsConnectionLost (Status) && !EFI_ERROR (P9Reconnect (Volume))) {
+      Remaining = *BufferSize - Total;
+      Status = P9LReadStriped (Volume, IFile, IFile->Position + Total, &Remaining, (UINT8 *)Buffer + Total);
+      Total += Remaining;
+    }
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+      goto Exit;
+    }
+
+    IFile->Position += Total;
+    *BufferSize = Total;
+    goto Exit;
+  }
+
+  Position = IFile->Position;
+  Total    = 0;
+  while (Total < *BufferSize) {
+    Count = (UINT32)MIN ((UINTN)MaxRxSize, *BufferSize - Total);
+    Status = P9LRead (Volume, IFile, &Count, (UINT8 *)Buffer + Total);
     if (EFI_ERROR (Status)) {
       IFile->Position = Position;
       DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
       goto Exit;
     }
-    Buffer = (UINT8 *)Buffer + Count;
+
+    Total += Count;
+    if (Count == 0) {
+      break;
+    }
   }
 
+  *BufferSize = Total;
   Status = EFI_SUCCESS;
 
 Exit:
@@ -162,28 +205,13 @@ P9DirRead (
   EFI_STATUS        Status;
   P9_IFILE          *IFile;
   P9_VOLUME         *Volume;
-  UINT32            Count;
-  UINT32            NameLength;
-  UINT32            DirEntSize;
-  P9DirEnt          *DirEnt;
-  UINTN             Size;
-  UINTN             NameSize;
-  P9_IFILE          *NewIFile;
-  CHAR16            *Path;
+  EFI_FILE_INFO     *Info;
 
   DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
 
   IFile = IFILE_FROM_FHAND (FHand);
   Volume = IFile->Volume;
 
-  NameLength = 255;
-  DirEntSize = sizeof (P9DirEnt) + sizeof (CHAR8) * NameLength;
-  DirEnt = AllocateZeroPool (DirEntSize);
-  if (DirEnt == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
-    goto Exit;
-  }
   if (IFile->IsOpened != TRUE) {
     Status = P9LOpen (Volume, IFile);
     if (EFI_ERROR (Status)) {
@@ -192,74 +220,59 @@ P9DirRead (
     }
     IFile->IsOpened = TRUE;
   }
-  Count = DirEntSize;
-  Status = P9LReadDir (Volume, IFile, IFile->Position, &Count, DirEnt);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
-    goto Exit;
+
+  //
+  // A directory that has no cached listing is read from the server as it
+  // is enumerated. The position is the offset of the next entry in the
+  // listing, whether it is cached or being recorded.
+  //
+  if (IFile->Snapshot == NULL && IFile->Reader == NULL) {
+    Status = P9LookupDirSnapshot (Volume, IFile, &IFile->Snapshot);
+    if (Status == EFI_NOT_FOUND) {
+      Status = P9OpenDirReader (Volume, IFile, &IFile->Reader);
+    }
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+      goto Exit;
+    }
+  }
+
+  if (IFile->Snapshot != NULL) {
+    Info = NULL;
+    if (IFile->Position < IFile->Snapshot->Size) {
+      Info = (EFI_FILE_INFO *)(IFile->Snapshot->Entries + IFile->Position);
+    }
+  } else {
+    Status = P9PeekDirEntry (Volume, IFile, IFile->Reader, &Info);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+      goto Exit;
+    }
   }
+
   // Reached EOF
-  if (Count == 0) {
+  if (Info == NULL) {
     *BufferSize = 0;
     Status = EFI_SUCCESS;
     goto Exit;
   }
 
-  NameSize = sizeof (CHAR16) * (DirEnt->Name.Size + 1);
-  Size = SIZE_OF_EFI_FILE_INFO + NameSize;
-  if (*BufferSize < Size) {
-    *BufferSize = Size;
+  if (*BufferSize < Info->Size) {
+    *BufferSize = (UINTN)Info->Size;
     Status = EFI_BUFFER_TOO_SMALL;
     DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
     goto Exit;
   }
-  Path = AllocateZeroPool (NameSize);
-  if (Path == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
-    goto Exit;
-  }
-  P9StringToUnicodeStrS (&DirEnt->Name, Path, NameSize);
-  NewIFile = AllocateZeroPool (sizeof (P9_IFILE));
-  if (NewIFile == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Exit;
-  }
-
-  NewIFile->Signature  = P9_IFILE_SIGNATURE;
-  NewIFile->Volume     = Volume;
-  NewIFile->Flags      = O_RDONLY; // Currently supports read only.
-  NewIFile->IsOpened   = FALSE;
-  StrCpyS (NewIFile->FileName, P9_MAX_FLEN + 1, Path);
-  CopyMem (&NewIFile->Handle, &P9FileInterface, sizeof (EFI_FILE_PROTOCOL));
-
-  Status = P9Walk (Volume, IFile, NewIFile, Path);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
-    goto Exit;
-  }
-  Status = P9GetAttr (Volume, NewIFile);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
-    goto Exit;
+  CopyMem (Buffer, Info, (UINTN)Info->Size);
+  *BufferSize = (UINTN)Info->Size;
+  IFile->Position += ALIGN_VALUE (Info->Size, 8);
+  if (IFile->Reader != NULL) {
+    P9NextDirEntry (IFile->Reader);
   }
-  CopyMem (Buffer, NewIFile->FileInfo, Size);
-  *BufferSize = Size;
-  IFile->Position = DirEnt->Offset;
 
   Status = EFI_SUCCESS;
 
 Exit:
-  if (NewIFile != NULL) {
-    FreePool (NewIFile);
-  }
-  if (DirEnt != NULL) {
-    FreePool (DirEnt);
-  }
-  if (Path != NULL) {
-    FreePool (Path);
-  }
-
   DEBUG ((DEBUG_INFO, "%a:%d: %r\n", __func__, __LINE__, Status));
   return Status;
 }
@@ -378,6 +391,63 @@ P9ReadEx (
   return EFI_UNSUPPORTED;
 }
 
+/**
+
+  Appends data at the current position to the write-back buffer of the file
+  handle, which must be empty or end at the position and have room for it.
+
+  @param  IFile                 - The file handle.
+  @param  BufferSize            - Size of Buffer.
+  @param  Buffer                - The data to append.
+
+  @retval EFI_SUCCESS           - The data is buffered.
+  @retval EFI_OUT_OF_RESOURCES  - The buffer could not be allocated.
+
+**/
+STATIC
+EFI_STATUS
+P9AppendWriteBack (
+  IN P9_IFILE           *IFile,
+  IN UINTN              BufferSize,
+  IN VOID               *Buffer
+  )
+{
+  if (IFile->WriteBack == NULL) {
+    IFile->WriteBack = AllocatePool (P9_WRITE_BACK_SIZE);
+    if (IFile->WriteBack == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+  }
+
+  if (IFile->WriteBackLength == 0) {
+    IFile->WriteBackOffset = IFile->Position;
+  }
+
+  CopyMem (IFile->WriteBack + IFile->WriteBackLength, Buffer, BufferSize);
+  IFile->WriteBackLength += BufferSize;
+  IFile->Position += BufferSize;
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Tells whether a write of Size bytes at the current position of the file
+  handle cannot be added to its write-back buffer.
+
+**/
+STATIC
+BOOLEAN
+P9IsWriteBackFull (
+  IN P9_IFILE           *IFile,
+  IN UINTN              Size
+  )
+{
+  return (BOOLEAN)(IFile->WriteBackLength != 0 &&
+                   (IFile->Position != IFile->WriteBackOffset + IFile->WriteBackLength ||
+                    IFile->WriteBackLength + Size > P9_WRITE_BACK_SIZE));
+}
+
 /**
 
   Write the content of buffer into files.
@@ -403,20 +473,73 @@ P9Write (
   IN     VOID               *Buffer
   )
 {
+  EFI_STATUS        Status;
+  P9_IFILE          *IFile;
+  P9_VOLUME         *Volume;
+
   DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
-  return EFI_UNSUPPORTED;
+
+  IFile = IFILE_FROM_FHAND (FHand);
+  Volume = IFile->Volume;
+
+  if (IFile->Qid.Type & (QTDir | QTSymLink)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((IFile->Flags & O_ACCMODE) == O_RDONLY) {
+    return EFI_ACCESS_DENIED;
+  }
+
+  //
+  // Let asynchronous writes of the handle land first.
+  //
+  if (IFile->PendingWrites != 0) {
+    P9WaitWrites (IFile);
+  }
+
+  //
+  // Flush the write-back buffer if this write does not extend it.
+  //
+  if (P9IsWriteBackFull (IFile, *BufferSize)) {
+    Status = P9FlushWriteBack (IFile);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+      return Status;
+    }
+  }
+
+  //
+  // Large writes go straight to the server.
+  //
+  if (*BufferSize >= P9_WRITE_BACK_SIZE) {
+    Status = P9LWrite (Volume, IFile, IFile->Position, BufferSize, Buffer);
+    IFile->Position += *BufferSize;
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+    }
+    return Status;
+  }
+
+  return P9AppendWriteBack (IFile, *BufferSize, Buffer);
 }
 
 /**
 
-  Get the file info.
+  Writes the content of the token's buffer into the file.
+
+  Without an event the write is synchronous. Otherwise small writes are
+  buffered and the token is completed at once, while a write-back buffer
+  that has to be flushed and large writes go out as Twrites in the
+  background; the token is completed by their replies, and Token->Buffer
+  must stay valid until then.
 
   @param  FHand                 - The handle of the file.
   @param  Token                 - A pointer to the token associated with the transaction.
 
-  @retval EFI_SUCCESS           - Get the file info successfully.
-  @retval EFI_DEVICE_ERROR      - Can not find the OFile for the file.
-  @retval EFI_VOLUME_CORRUPTED  - The file type of open file is error.
+  @retval EFI_SUCCESS           - The write is complete or queued.
+  @retval EFI_INVALID_PARAMETER - Token is NULL.
+  @retval EFI_ACCESS_DENIED     - The file is read-only.
+  @retval EFI_UNSUPPORTED       - The open file is not a file.
   @return other                 - An error occurred when operation the disk.
 
 **/
@@ -427,6 +550,66 @@ P9WriteEx (
   IN OUT EFI_FILE_IO_TOKEN  *Token
   )
 {
+  EFI_STATUS        Status;
+  P9_IFILE          *IFile;
+  P9_WRITE_BATCH    *Batch;
+
   DEBUG ((DEBUG_INFO, "%a:%d\n", __func__, __LINE__));
-  return EFI_UNSUPPORTED;
+
+  if (Token == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Token->Event == NULL) {
+    return P9Write (FHand, &Token->BufferSize, Token->Buffer);
+  }
+
+  IFile = IFILE_FROM_FHAND (FHand);
+
+  if (IFile->Qid.Type & (QTDir | QTSymLink)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((IFile->Flags & O_ACCMODE) == O_RDONLY) {
+    return EFI_ACCESS_DENIED;
+  }
+
+  Batch = P9StartWriteBatch (IFile, Token);
+  if (Batch == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = EFI_SUCCESS;
+  if (P9IsWriteBackFull (IFile, Token->BufferSize)) {
+    Status = P9QueueWriteBack (IFile, Batch);
+  }
+
+  if (EFI_ERROR (Status)) {
+    Token->BufferSize = 0;
+  } else if (Token->BufferSize >= P9_WRITE_BACK_SIZE) {
+    //
+    // The bytes written are reported in the token by the batch, which also
+    // moves the position back if they fall short.
+    //
+    Status = P9QueueWrite (Batch, IFile->Position, Token->BufferSize, Token->Buffer, FALSE);
+    if (!EFI_ERROR (Status)) {
+      IFile->Position += Token->BufferSize;
+    }
+  } else {
+    Status = P9AppendWriteBack (IFile, Token->BufferSize, Token->Buffer);
+    if (EFI_ERROR (Status)) {
+      Token->BufferSize = 0;
+    }
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a:%d: %r\n", __func__, __LINE__, Status));
+  }
+
+  //
+  // Errors from here on are reported in the token.
+  //
+  P9EndWriteBatch (Batch, Status, FALSE);
+
+  return EFI_SUCCESS;
 }